@@ -0,0 +1,412 @@
+/* This program benchmarks the hot paths of the mulder C library.
+ *
+ * Timings are reported as JSON lines on stdout, one line per benchmark, e.g.
+ * for catching performance regressions across Pumas or Turtle upgrades. Each
+ * line specifies the benchmark name, the geometry (flat layers or topography
+ * map), the geomagnet usage, the transport mode (if relevant), the number of
+ * calls, the rate of calls (per second), the mean time per call (in ns), the
+ * number of Turtle steps and the mean time per step (in ns, if relevant) and
+ * the peak resident memory (in kB). Steps are counted with the fluxmeter
+ * instrumentation, in a second untimed pass. For the whereami benchmark, a
+ * call is a single Turtle step.
+ *
+ * Usage: bench [-n calls] [-m map] [-t table]
+ *
+ * - The default map is the one used by example.c. If it cannot be loaded, map
+ *   benchmarks are skipped.
+ *
+ * - A reference table can be provided, in order to benchmark tabulated
+ *   fluxes. Otherwise, only the default reference is benchmarked.
+ *
+ * Note that this program is usually run with `make bench`, which also sets the
+ * data prefix (see example.c).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+/* C standard library */
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+/* POSIX */
+#include <sys/resource.h>
+
+/* Mulder API */
+#include "mulder.h"
+
+
+#ifndef MULDER_PREFIX
+#define MULDER_PREFIX "."
+#endif
+
+
+/* Non fatal error handler, e.g. for skipping missing data */
+static int errors = 0;
+
+static void bench_error(const char * message)
+{
+        fprintf(stderr, "error[mulder]: %s\n", message);
+        errors++;
+}
+
+
+/* Deterministic pseudo random stream (xorshift64*), for sampling inputs */
+static unsigned long long bench_seed = 0x9E3779B97F4A7C15ULL;
+
+static double bench_uniform01(void)
+{
+        bench_seed ^= bench_seed >> 12;
+        bench_seed ^= bench_seed << 25;
+        bench_seed ^= bench_seed >> 27;
+        return ((bench_seed * 0x2545F4914F6CDD1DULL) >> 11) *
+            (1. / 9007199254740992.);
+}
+
+
+/* Timing utilities */
+static double bench_time(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + 1E-09 * ts.tv_nsec;
+}
+
+static long bench_rss(void)
+{
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024; /* bytes */
+#else
+        return usage.ru_maxrss; /* kB */
+#endif
+}
+
+static void bench_report(
+    const char * name,
+    const char * geometry,
+    int geomagnet,
+    const char * mode,
+    long calls,
+    long steps,
+    double seconds)
+{
+        if (seconds <= 0.) seconds = 1E-09;
+        printf("{\"benchmark\": \"%s\", \"geometry\": ", name);
+        if (geometry == NULL) printf("null");
+        else printf("\"%s\"", geometry);
+        printf(", \"geomagnet\": %s, \"mode\": ",
+            geomagnet ? "true" : "false");
+        if (mode == NULL) printf("null");
+        else printf("\"%s\"", mode);
+        printf(", \"calls\": %ld, \"calls_per_s\": %.6E, "
+            "\"ns_per_call\": %.6E, \"steps\": %ld, \"ns_per_step\": ",
+            calls, calls / seconds, 1E+09 * seconds / calls, steps);
+        if (steps <= 0) printf("null");
+        else printf("%.6E", 1E+09 * seconds / steps);
+        printf(", \"peak_rss_kb\": %ld}\n", bench_rss());
+        fflush(stdout);
+}
+
+
+/* Random observation states, around a given position */
+static struct mulder_state bench_state(struct mulder_position position)
+{
+        const double energies[4] = {1E+00, 1E+01, 1E+02, 1E+03};
+        struct mulder_state state = {
+            .pid = MULDER_ANY,
+            .position = position,
+            .direction = {
+                .azimuth = 360. * bench_uniform01(),
+                .elevation = 90. * bench_uniform01()
+            },
+            .energy = energies[(int)(4. * bench_uniform01()) & 3],
+            .weight = 1.
+        };
+        return state;
+}
+
+
+/* Benchmarked geometry */
+struct scenario {
+        const char * name;
+        struct mulder_layer * layers[2];
+        struct mulder_geometry * geometry;
+        struct mulder_fluxmeter * fluxmeter;
+        struct mulder_position position;
+};
+
+static int scenario_create(
+    struct scenario * scenario,
+    const char * name,
+    const char * map)
+{
+        scenario->name = name;
+        scenario->layers[0] = mulder_layer_create("Rock", map, 0.);
+        scenario->layers[1] = mulder_layer_create("Water", NULL, 0.);
+        if ((scenario->layers[0] == NULL) || (scenario->layers[1] == NULL)) {
+                mulder_layer_destroy(scenario->layers);
+                mulder_layer_destroy(scenario->layers + 1);
+                return -1;
+        }
+        scenario->geometry = mulder_geometry_create(2, scenario->layers);
+        scenario->fluxmeter = mulder_fluxmeter_create(
+            MULDER_PREFIX "/data/materials.pumas", scenario->geometry);
+        if (scenario->fluxmeter == NULL) {
+                fputs("error[bench]: could not create fluxmeter\n", stderr);
+                exit(EXIT_FAILURE);
+        }
+
+        /* Observations are located 30 m below the rock surface */
+        if (map == NULL) {
+                const struct mulder_position position = {45., 3., -30.};
+                scenario->position = position;
+        } else {
+                const struct mulder_layer * layer = scenario->layers[0];
+                struct mulder_projection projection = {
+                    .x = 0.5 * (layer->xmin + layer->xmax),
+                    .y = 0.5 * (layer->ymin + layer->ymax)
+                };
+                scenario->position = mulder_layer_position(layer, projection);
+                scenario->position.height -= 30.;
+        }
+        return 0;
+}
+
+static void scenario_destroy(struct scenario * scenario)
+{
+        mulder_fluxmeter_destroy(&scenario->fluxmeter);
+        mulder_geometry_destroy(&scenario->geometry);
+        mulder_layer_destroy(scenario->layers);
+        mulder_layer_destroy(scenario->layers + 1);
+}
+
+
+/* Benchmarked loops, over random states */
+typedef void bench_loop_t(struct scenario * scenario, long n);
+
+static void loop_flux(struct scenario * scenario, long n)
+{
+        long j;
+        for (j = 0; j < n; j++) {
+                mulder_fluxmeter_flux(
+                    scenario->fluxmeter, bench_state(scenario->position));
+        }
+}
+
+static void loop_transport(struct scenario * scenario, long n)
+{
+        long j;
+        for (j = 0; j < n; j++) {
+                struct mulder_state state = bench_state(scenario->position);
+                state.pid = MULDER_MUON;
+                mulder_fluxmeter_transport(scenario->fluxmeter, state);
+        }
+}
+
+static void loop_grammage(struct scenario * scenario, long n)
+{
+        double grammage[3];
+        long j;
+        for (j = 0; j < n; j++) {
+                struct mulder_state state = bench_state(scenario->position);
+                mulder_fluxmeter_grammage(scenario->fluxmeter,
+                    state.position, state.direction, grammage);
+        }
+}
+
+static void loop_intersect(struct scenario * scenario, long n)
+{
+        long j;
+        for (j = 0; j < n; j++) {
+                struct mulder_state state = bench_state(scenario->position);
+                mulder_fluxmeter_intersect(
+                    scenario->fluxmeter, state.position, state.direction);
+        }
+}
+
+
+/* Time a loop, without instrumentation (which has its own overhead). Then,
+ * Turtle steps are counted in a second (untimed) pass, replaying the same
+ * states.
+ */
+static void bench_run(
+    const char * name,
+    struct scenario * scenario,
+    int geomagnet,
+    const char * mode,
+    bench_loop_t * loop,
+    long n)
+{
+        const unsigned long long seed = bench_seed;
+        const double t0 = bench_time();
+        loop(scenario, n);
+        const double seconds = bench_time() - t0;
+
+        struct mulder_stats stats;
+        memset(&stats, 0x0, sizeof stats);
+        bench_seed = seed;
+        scenario->fluxmeter->stats = &stats;
+        loop(scenario, n);
+        scenario->fluxmeter->stats = NULL;
+
+        bench_report(name, scenario->name, geomagnet, mode, n, stats.steps,
+            seconds);
+}
+
+
+/* Benchmarks of fluxmeter functions */
+static void bench_fluxmeter(struct scenario * scenario, long n, int geomagnet)
+{
+        struct mulder_fluxmeter * fluxmeter = scenario->fluxmeter;
+        const enum mulder_mode modes[3] = {
+            MULDER_CONTINUOUS, MULDER_MIXED, MULDER_DISCRETE
+        };
+        const char * names[3] = {"continuous", "mixed", "discrete"};
+        const long scales[3] = {1, 1, 10}; /* detailed mode is slower */
+
+        int i;
+        for (i = 0; i < 3; i++) {
+                fluxmeter->mode = modes[i];
+                const long m = (n / scales[i] > 0) ? n / scales[i] : 1;
+                bench_run("flux", scenario, geomagnet, names[i], &loop_flux,
+                    m);
+                bench_run("transport", scenario, geomagnet, names[i],
+                    &loop_transport, m);
+        }
+        fluxmeter->mode = MULDER_CONTINUOUS;
+}
+
+
+/* Benchmarks of geometry functions (the geomagnet is irrelevant) */
+static void bench_geometry(struct scenario * scenario, long n)
+{
+        struct mulder_fluxmeter * fluxmeter = scenario->fluxmeter;
+        bench_run("grammage", scenario, 0, NULL, &loop_grammage, n);
+        bench_run("intersect", scenario, 0, NULL, &loop_intersect, n);
+
+        long j;
+        const long m = 100 * n;
+        double t0 = bench_time();
+        for (j = 0; j < m; j++) {
+                struct mulder_position position = scenario->position;
+                position.height += 100. * bench_uniform01();
+                mulder_fluxmeter_whereami(fluxmeter, position);
+        }
+        bench_report("whereami", scenario->name, 0, NULL, m, m,
+            bench_time() - t0);
+
+        const struct mulder_layer * layer = scenario->layers[0];
+        if (layer->model != NULL) {
+                t0 = bench_time();
+                for (j = 0; j < m; j++) {
+                        struct mulder_projection projection = {
+                            .x = layer->xmin + (layer->xmax - layer->xmin) *
+                                bench_uniform01(),
+                            .y = layer->ymin + (layer->ymax - layer->ymin) *
+                                bench_uniform01()
+                        };
+                        mulder_layer_height(layer, projection);
+                }
+                bench_report("layer_height", scenario->name, 0, NULL, m, 0,
+                    bench_time() - t0);
+        }
+}
+
+
+/* Benchmarks of reference fluxes */
+static void bench_reference(
+    const char * name,
+    struct mulder_reference * reference,
+    long n)
+{
+        const long m = 100 * n;
+        long j;
+        double t0 = bench_time();
+        for (j = 0; j < m; j++) {
+                const double height = reference->height_min +
+                    (reference->height_max - reference->height_min) *
+                    bench_uniform01();
+                const double elevation = 90. * bench_uniform01();
+                /* Log-uniform energies, over the reference range */
+                const double energy = reference->energy_min * exp(
+                    log(reference->energy_max / reference->energy_min) *
+                    bench_uniform01());
+                reference->flux(reference, height, elevation, energy);
+        }
+        bench_report(name, NULL, 0, NULL, m, 0, bench_time() - t0);
+}
+
+
+int main(int argc, char * argv[])
+{
+        /* Parse arguments */
+        long n = 1000;
+        const char * map = "data/GMRT.asc";
+        const char * table = NULL;
+        int i;
+        for (i = 1; i < argc; i++) {
+                if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) {
+                        n = strtol(argv[++i], NULL, 10);
+                } else if ((strcmp(argv[i], "-m") == 0) && (i + 1 < argc)) {
+                        map = argv[++i];
+                } else if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc)) {
+                        table = argv[++i];
+                } else {
+                        fprintf(stderr,
+                            "usage: %s [-n calls] [-m map] [-t table]\n",
+                            argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (n <= 0) n = 1;
+
+        /* Errors are not fatal, e.g. missing map data */
+        mulder_error = &bench_error;
+
+        /* Geometries, with flat layers or a topography map */
+        struct scenario scenarios[2];
+        int n_scenarios = 0;
+        if (scenario_create(scenarios, "flat", NULL) == 0) n_scenarios++;
+        if (scenario_create(scenarios + n_scenarios, "map", map) == 0) {
+                n_scenarios++;
+        }
+
+        struct mulder_geomagnet * geomagnet = mulder_geomagnet_create(
+            MULDER_PREFIX "/data/IGRF13.COF", 1, 1, 2020);
+        errors = 0; /* missing optional data are skipped */
+
+        /* Run benchmarks */
+        for (i = 0; i < n_scenarios; i++) {
+                struct scenario * scenario = scenarios + i;
+                bench_geometry(scenario, n);
+                bench_fluxmeter(scenario, n, 0);
+                if (geomagnet != NULL) {
+                        scenario->geometry->geomagnet = geomagnet;
+                        bench_fluxmeter(scenario, n, 1);
+                        scenario->geometry->geomagnet = NULL;
+                }
+        }
+
+        struct mulder_reference * reference = mulder_reference_create(NULL);
+        bench_reference("reference_default", reference, n);
+        mulder_reference_destroy(&reference);
+
+        if (table != NULL) {
+                reference = mulder_reference_create(table);
+                if (reference != NULL) {
+                        bench_reference("reference_table", reference, n);
+                        mulder_reference_destroy(&reference);
+                }
+        }
+
+        /* Clean memory */
+        for (i = 0; i < n_scenarios; i++) {
+                scenario_destroy(scenarios + i);
+        }
+        mulder_geomagnet_destroy(&geomagnet);
+
+        exit(errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
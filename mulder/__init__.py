@@ -1,8 +1,9 @@
 """MUon fLux unDER (Mulder).
 """
 
-from .core import Layer, Geomagnet, Geometry, Fluxmeter, Reference, State
-from .grids import FluxGrid, Grid, MapGrid, PixelGrid
-from .types import Atmosphere, Direction, Enu, Flux, Intersection, Position, \
-                   Projection
+from .core import Layer, Geomagnet, Geometry, Fluxmap, Fluxmeter, \
+                  Reference, State, Tally
+from .grids import FluxGrid, Grid, MapGrid, MapWriter, PixelGrid
+from .types import Atmosphere, Direction, Enu, Estimate, Flux, Intersection, \
+                   Position, Projection
 from .version import git_revision, version
@@ -113,6 +113,44 @@ def main():
     convert_parser.add_argument("-d", "--destination",
         help="destination directory for physics tables")
 
+    convert_parser.add_argument("-t", "--threads",
+        help="number of concurrent processes", type=int)
+
+
+    # Merge command
+    merge_parser = subparsers.add_parser(
+        name="merge",
+        epilog=copyright,
+        description="Merge the shards of a flux job")
+
+    merge_parser.add_argument("output",
+        help="job output directory")
+
+    merge_parser.add_argument("-p", "--path",
+        help="path to the merged file (default: <output>/flux.npz)")
+
+
+    # Run command
+    run_parser = subparsers.add_parser(
+        name="run",
+        epilog=copyright,
+        description="Run a flux job, or one of its shards")
+
+    run_parser.add_argument("spec",
+        help="path to the job spec (JSON)")
+
+    run_parser.add_argument("output",
+        help="job output directory")
+
+    run_parser.add_argument("-n", "--shards",
+        help="number of shards (default: 1)", type=int, default=1)
+
+    run_parser.add_argument("-s", "--shard",
+        help="index of the shard to run (default: all)", type=int)
+
+    run_parser.add_argument("-t", "--threads",
+        help="number of threads", type=int)
+
 
     # XXX Add a generator for references? (e.g. using MCEq)
 
@@ -142,7 +180,15 @@ def main():
         convert(Path(args.path), args.offset)
 
     elif args.command == "generate":
-        generate_physics(args.path, args.destination)
+        generate_physics(args.path, args.destination, threads=args.threads)
+
+    elif args.command == "merge":
+        from .runner import merge
+        merge(args.output, args.path)
+
+    elif args.command == "run":
+        from .runner import run
+        run(args.spec, args.output, args.shards, args.shard, args.threads)
 
     else:
         parser.print_usage()
@@ -1,23 +1,36 @@
 """Core functionalities of the mulder library.
 """
 
+from concurrent.futures import ThreadPoolExecutor
 from numbers import Integral, Number
 from pathlib import Path
+from threading import Lock
 
 import numpy
 
 from .arrays import arrayclass, commonsize, pack
 from .ffi import ffi, lib, LibraryError, todouble, toint, tostr
 from .generators import LogUniform, SinUniform, Uniform
-from .grids import MapGrid
-from .types import Atmosphere, Direction, Enu, Flux, Intersection, \
-                   MapLocation, Position, Projection
+from .grids import MapGrid, PixelGrid
+from .physics import physics_cache
+from .types import Atmosphere, Direction, Enu, Estimate, Flux, \
+                   Intersection, MapLocation, Position, Projection
 
 
 """Package / C-library installation prefix."""
 PREFIX = str(Path(__file__).parent.resolve())
 
 
+def _threads(threads):
+    """Check the number of threads for vectorized computations."""
+    if threads is None:
+        return 1
+    else:
+        assert(isinstance(threads, Integral))
+        assert(threads > 0)
+        return threads
+
+
 @arrayclass
 class State:
     """Observation state(s)."""
@@ -58,6 +71,97 @@ class State:
         self.weight[:] *= generator.invpdf(values)
 
 
+"""Columns of observation states, in C order (see struct mulder_states)."""
+_STATE_COLUMNS = (
+    ("pid", "i4"),
+    ("latitude", "f8"),
+    ("longitude", "f8"),
+    ("height", "f8"),
+    ("azimuth", "f8"),
+    ("elevation", "f8"),
+    ("energy", "f8"),
+    ("weight", "f8")
+)
+
+
+def _state_columns(*args, **kwargs):
+    """Get observation states as C columns (structure of arrays).
+
+    Numpy arrays are used in place, whenever possible, i.e. without packing
+    them as a State. Scalar values are broadcasted (using a null stride).
+    """
+
+    if args and isinstance(args[0], State) and (len(args) == 1) and \
+       not kwargs:
+        state = args[0]
+        data = state.numpy_array
+        columns = [data["pid"]]
+        columns += [data["position"][k] for k in ("latitude", "longitude",
+                                                  "height")]
+        columns += [data["direction"][k] for k in ("azimuth", "elevation")]
+        columns += [data["energy"], data["weight"]]
+        size = state._size
+    else:
+        if len(args) > len(State.properties):
+            raise TypeError(
+                f"State takes at most {len(State.properties)} arguments "
+                f"({len(args)} given)"
+            )
+        parsed = State._parser(*args, **kwargs)
+        position = None if parsed.position is None else \
+                   Position.parse(parsed.position)
+        direction = None if parsed.direction is None else \
+                    Direction.parse(parsed.direction)
+        columns = []
+        for name, dtype in _STATE_COLUMNS:
+            value = getattr(parsed, name)
+            if value is None:
+                if (position is not None) and hasattr(position, name):
+                    value = getattr(position, name)
+                elif (direction is not None) and hasattr(direction, name):
+                    value = getattr(direction, name)
+                elif name == "weight":
+                    value = 1
+                else:
+                    value = 0
+            columns.append(numpy.asarray(value, dtype=dtype))
+        size = commonsize(*columns)
+
+    states = ffi.new("struct mulder_states *")
+    for i, (column, (name, dtype)) in enumerate(zip(columns, _STATE_COLUMNS)):
+        ctype = "int *" if dtype == "i4" else "double *"
+        setattr(states, name, ffi.cast(ctype, column.ctypes.data))
+        states.strides[i] = column.strides[0] if \
+            (column.ndim > 0) and (column.size > 1) else 0
+
+    return size, states, columns
+
+
+def _output(cls, size, out):
+    """Get an output array, or check a caller provided one (in place)."""
+
+    if out is None:
+        return cls.empty(size)
+    else:
+        assert(isinstance(out, cls))
+        assert((out.size or 1) == (size or 1))
+        assert(out.numpy_array.flags.c_contiguous)
+        return out
+
+
+def _state_slice(states, start):
+    """Offset C columns of observation states to the given entry."""
+
+    result = ffi.new("struct mulder_states *")
+    for i, (name, dtype) in enumerate(_STATE_COLUMNS):
+        ctype = "int *" if dtype == "i4" else "double *"
+        pointer = ffi.cast("char *", getattr(states, name))
+        stride = states.strides[i]
+        setattr(result, name, ffi.cast(ctype, pointer + start * stride))
+        result.strides[i] = stride
+    return result
+
+
 class Layer:
     """Topographic layer."""
 
@@ -182,15 +286,37 @@ class Layer:
             (0, 1, 0, 1)
         )
 
-    def __init__(self, material=None, model=None, density=None, offset=None):
+    def __init__(self, material=None, model=None, density=None, offset=None,
+                 tiles=None, zrange=None):
         if material is None: material = "Rock"
 
         layer = ffi.new("struct mulder_layer *[1]")
-        layer[0] = lib.mulder_layer_create(
-            tostr(material),
-            tostr(model),
-            0 if offset is None else offset
-        )
+        if isinstance(model, (list, tuple)):
+            # Several maps of the same surface, by priority order (e.g. a fine
+            # near-field map followed by a coarse far-field one).
+            models = [tostr(str(m)) for m in model]
+            layer[0] = lib.mulder_layer_create_multires(
+                tostr(material),
+                len(models),
+                models,
+                0 if offset is None else offset
+            )
+        elif (tiles is None) and (zrange is None):
+            layer[0] = lib.mulder_layer_create(
+                tostr(material),
+                tostr(model),
+                0 if offset is None else offset
+            )
+        else:
+            # Stack of maps, with at most `tiles` maps in memory. Elevation
+            # bounds are scanned from tiles, unless a zrange is provided.
+            layer[0] = lib.mulder_layer_create_stack(
+                tostr(material),
+                tostr(model),
+                0 if offset is None else offset,
+                8 if tiles is None else tiles,
+                (0, 0) if zrange is None else zrange
+            )
         if layer[0] == ffi.NULL:
             raise LibraryError()
         else:
@@ -211,13 +337,22 @@ class Layer:
     def grid(self):
         """Return topography data as a MapGrid object"""
 
-        if self.model is None:
+        if (self.model is None) or (self.encoding == "stack"):
             return None
         else:
             x = numpy.linspace(self.xmin, self.xmax, self.nx)
             y = numpy.linspace(self.ymin, self.ymax, self.ny)
             grid = MapGrid(x, y)
-            grid.height[:] = self.height(**grid.nodes)
+            lib.mulder_layer_height_grid_v(
+                self._layer[0],
+                self.nx,
+                self.ny,
+                self.xmin,
+                self.xmax,
+                self.ymin,
+                self.ymax,
+                todouble(grid.height)
+            )
             return grid
 
     def gradient(self, *args, **kwargs) -> Projection:
@@ -351,7 +486,8 @@ class Geomagnet:
         return float(self._geomagnet[0].height_max)
 
 
-    def __init__(self, model=None, day=None, month=None, year=None):
+    def __init__(self, model=None, day=None, month=None, year=None,
+                 grid=None):
         # Set default arguments
         if model is None: model = f"{PREFIX}/data/IGRF13.COF"
         if day is None: day = 1
@@ -360,12 +496,27 @@ class Geomagnet:
 
         # Create the C object
         geomagnet = ffi.new("struct mulder_geomagnet *[1]")
-        geomagnet[0] = lib.mulder_geomagnet_create(
-            tostr(model),
-            day,
-            month,
-            year
-        )
+        if grid is None:
+            geomagnet[0] = lib.mulder_geomagnet_create(
+                tostr(model),
+                day,
+                month,
+                year
+            )
+        else:
+            # Tabulate the field over a geodetic grid, spanning a Geometry's
+            # topography (up to a Fluxmeter's reference height, if a Fluxmeter
+            # is given) or given (min, max) ranges (as a dict).
+            xmin, xmax, shape = _geomagnet_grid(grid)
+            geomagnet[0] = lib.mulder_geomagnet_create_grid(
+                tostr(model),
+                day,
+                month,
+                year,
+                ffi.new("struct mulder_position *", xmin)[0],
+                ffi.new("struct mulder_position *", xmax)[0],
+                shape
+            )
         if geomagnet[0] == ffi.NULL:
             raise LibraryError()
         else:
@@ -397,6 +548,56 @@ class Geomagnet:
         return enu
 
 
+"""Default spacing of geomagnet grids, in deg and in m."""
+_GRID_ANGULAR_SPACING = 0.05
+_GRID_HEIGHT_SPACING = 500.
+
+
+def _geomagnet_grid(grid):
+    """Get the range and shape of a geomagnet grid."""
+
+    reference = None
+    if isinstance(grid, Fluxmeter):
+        reference = grid.reference
+        grid = grid.geometry
+
+    if isinstance(grid, Geometry):
+        latitude, longitude, height = [], [], []
+        for layer in grid.layers:
+            height += [layer.zmin, layer.zmax]
+            if layer.model is None: continue
+            for corner in (layer.bottom_left, layer.bottom_right,
+                           layer.top_left, layer.top_right):
+                latitude.append(corner.latitude)
+                longitude.append(corner.longitude)
+        if not latitude:
+            raise ValueError("bad grid (no topography map)")
+        # Cover the atmosphere leg as well, up to the reference height.
+        if reference is None: reference = Reference()
+        height.append(reference.height_max)
+        ranges = {
+            "latitude": (min(latitude), max(latitude)),
+            "longitude": (min(longitude), max(longitude)),
+            "height": (min(height), max(height))
+        }
+    elif isinstance(grid, dict):
+        ranges = grid
+    else:
+        raise TypeError(
+            "bad grid (expected a Fluxmeter, a Geometry or a dict)")
+
+    xmin, xmax, shape = {}, {}, []
+    for k, spacing in (("latitude", _GRID_ANGULAR_SPACING),
+                       ("longitude", _GRID_ANGULAR_SPACING),
+                       ("height", _GRID_HEIGHT_SPACING)):
+        a, b = map(float, ranges[k])
+        if b <= a: b = a + spacing
+        xmin[k], xmax[k] = a, b
+        shape.append(max(int(numpy.ceil((b - a) / spacing)) + 1, 2))
+
+    return xmin, xmax, shape
+
+
 class Geometry:
     """Stratified Earth geometry."""
 
@@ -584,11 +785,111 @@ class Reference:
         return flux
 
 
+class Fluxmap:
+    """Tabulated muon flux at a fixed observation position."""
+
+    __slots__ = ("_fluxmap", "_path")
+
+    @property
+    def azimuth(self):
+        """Azimuth nodes, in deg."""
+        n = self._fluxmap[0].n_azimuth
+        return numpy.frombuffer(
+            ffi.buffer(self._fluxmap[0].azimuth, n * 8), dtype="f8").copy()
+
+    @property
+    def elevation(self):
+        """Elevation nodes, in deg."""
+        n = self._fluxmap[0].n_elevation
+        return numpy.frombuffer(
+            ffi.buffer(self._fluxmap[0].elevation, n * 8), dtype="f8").copy()
+
+    @property
+    def energy(self):
+        """Kinetic energy nodes, in GeV."""
+        fluxmap = self._fluxmap[0]
+        return numpy.geomspace(
+            fluxmap.energy_min, fluxmap.energy_max, fluxmap.n_energy)
+
+    @property
+    def path(self):
+        """Source file of a loaded map."""
+        return self._path
+
+    @property
+    def position(self):
+        """Observation position."""
+        position = self._fluxmap[0].position
+        return Position(
+            position.latitude, position.longitude, position.height)
+
+    def __init__(self, path):
+        fluxmap = ffi.new("struct mulder_fluxmap *[1]")
+        fluxmap[0] = lib.mulder_fluxmap_load(tostr(str(path)))
+        if fluxmap[0] == ffi.NULL:
+            raise LibraryError()
+        self._fluxmap = ffi.gc(fluxmap, lib.mulder_fluxmap_destroy)
+        self._path = str(path)
+
+    def dump(self, path):
+        """Dump the map to a file, e.g. for later loading."""
+        rc = lib.mulder_fluxmap_dump(self._fluxmap[0], tostr(str(path)))
+        if rc != lib.MULDER_SUCCESS:
+            raise LibraryError()
+
+    def flux(self, azimuth, elevation, energy):
+        """Get interpolated flux(es), for the given direction(s)."""
+
+        args = [numpy.asarray(a, dtype="f8") \
+                for a in (azimuth, elevation, energy)]
+        size = commonsize(*args)
+        strides = [a.strides[-1] if a.strides else 0 for a in args]
+        azimuth, elevation, energy = args
+
+        flux = Flux.empty(size)
+
+        lib.mulder_fluxmap_flux_v(
+            self._fluxmap[0],
+            size or 1,
+            strides,
+            todouble(azimuth),
+            todouble(elevation),
+            todouble(energy),
+            flux.cffi_pointer
+        )
+
+        return flux
+
+
+"""Built-in PRNG algorithms."""
+_PRNG_ALGORITHMS = {
+    "mersenne-twister": lib.MULDER_MERSENNE_TWISTER,
+    "philox": lib.MULDER_PHILOX
+}
+
+
 class Prng:
     """Pseudo random numbers generator."""
 
     __slots__ = ("_fluxmeter",)
 
+    @property
+    def algorithm(self):
+        """PRNG algorithm ("mersenne-twister" or "philox")."""
+        fluxmeter = self._fluxmeter._fluxmeter
+        philox = lib.mulder_fluxmeter_prng(fluxmeter[0], lib.MULDER_PHILOX)
+        return "philox" if fluxmeter[0].prng == philox else \
+               "mersenne-twister"
+
+    @algorithm.setter
+    def algorithm(self, v):
+        try:
+            tp = _PRNG_ALGORITHMS[v]
+        except KeyError:
+            raise ValueError(f"bad PRNG algorithm ({v})")
+        fluxmeter = self._fluxmeter._fluxmeter
+        fluxmeter[0].prng = lib.mulder_fluxmeter_prng(fluxmeter[0], tp)
+
     @property
     def fluxmeter(self):
         return self._fluxmeter
@@ -641,10 +942,132 @@ class Prng:
         return Uniform(self, x0, x1)
 
 
+class Tally:
+    """Reduction of Monte Carlo events (see Fluxmeter.generate)."""
+
+    __slots__ = ("_edges", "_squares", "_tally", "_values", "_variable")
+
+    @property
+    def edges(self):
+        """Histogram bins edges (None if not histogrammed)."""
+        return self._edges
+
+    @property
+    def error(self):
+        """Monte Carlo uncertainty on the flux value."""
+        n = self.events
+        if n <= 1: return 0.
+        mean = self._tally.sum / n
+        var = max(self._tally.sum2 / n - mean**2, 0)
+        return numpy.sqrt(var / n)
+
+    @property
+    def events(self):
+        """Total number of tallied events."""
+        return int(self._tally.events)
+
+    @property
+    def flux(self):
+        """Estimate of the (integrated) flux."""
+        n, s = self.events, self._tally.sum
+        return Flux(
+            value = s / n if n > 0 else 0.,
+            asymmetry = self._tally.asymmetry / s if s != 0 else 0.
+        )
+
+    @property
+    def histogram(self):
+        """Estimate of the flux per bin, and its uncertainty."""
+        if self._values is None: return None
+        n = self.events
+        if n <= 0:
+            return numpy.zeros(self._values.size), \
+                   numpy.zeros(self._values.size)
+        mean = self._values / n
+        var = numpy.maximum(self._squares / n - mean**2, 0)
+        return mean, numpy.sqrt(var / n)
+
+    @property
+    def variable(self):
+        """Histogrammed variable (None if not histogrammed)."""
+        return self._variable
+
+    def __init__(self, variable=None, edges=None):
+        self._tally = ffi.new("struct mulder_tally *")
+        self._variable = variable
+        self._edges = edges
+        if variable is None:
+            self._values = None
+            self._squares = None
+        else:
+            bins = len(edges) - 1
+            self._tally.variable = _TALLY_VARIABLES[variable]
+            self._tally.bins = bins
+            self._values = numpy.zeros(bins)
+            self._squares = numpy.zeros(bins)
+            self._tally.values = todouble(self._values)
+            self._tally.squares = todouble(self._squares)
+
+
+"""Histogrammable variables of Monte Carlo generators."""
+_TALLY_VARIABLES = {
+    "azimuth": lib.MULDER_AZIMUTH,
+    "elevation": lib.MULDER_ELEVATION,
+    "energy": lib.MULDER_ENERGY
+}
+
+"""Default number of events per call, for Monte Carlo generators."""
+_GENERATE_CHUNK = 1000000
+
+"""Default number of states per asynchronous task."""
+_ASYNC_CHUNK = 10000
+
+"""Default maximum number of events per flux estimate."""
+_ESTIMATE_EVENTS = 10000
+
+
+def _sampler(sampler, value, default):
+    """Set a C sampler from a Number, a (min, max) range or a Generator.
+
+    Returns a function mapping uniform deviates to sampled values.
+    """
+
+    if isinstance(value, Number):
+        sampler.sampling = lib.MULDER_FIXED
+        sampler.min = sampler.max = value
+    elif isinstance(value, Uniform):
+        sampler.sampling = lib.MULDER_UNIFORM
+        sampler.min = value._x0
+        sampler.max = value._x0 + value._dx
+    elif isinstance(value, LogUniform):
+        sampler.sampling = lib.MULDER_LOG_UNIFORM
+        sampler.min = value._x0
+        sampler.max = value._x0 * numpy.exp(value._rx)
+    elif isinstance(value, SinUniform):
+        sampler.sampling = lib.MULDER_SIN_UNIFORM
+        sampler.min = numpy.degrees(numpy.arcsin(value._x0))
+        sampler.max = numpy.degrees(numpy.arcsin(value._x0 + value._dx))
+    else:
+        sampler.sampling = default
+        sampler.min, sampler.max = value
+
+    x0, x1 = sampler.min, sampler.max
+    if sampler.sampling == lib.MULDER_UNIFORM:
+        return lambda u: x0 + (x1 - x0) * u
+    elif sampler.sampling == lib.MULDER_LOG_UNIFORM:
+        return lambda u: x0 * (x1 / x0)**u
+    elif sampler.sampling == lib.MULDER_SIN_UNIFORM:
+        s0, s1 = numpy.sin(numpy.radians((x0, x1)))
+        return lambda u: numpy.degrees(numpy.arcsin(s0 + (s1 - s0) * u))
+    else:
+        return lambda u: numpy.full(numpy.shape(u), x0)
+
+
 class Fluxmeter:
     """Muon flux calculator."""
 
-    __slots__ = ("_fluxmeter", "_geometry", "_prng", "_reference")
+    __slots__ = ("_executor", "_fluxmeter", "_geometry", "_lock", "_prng",
+                 "_reference", "_stats")
 
     @property
     def geometry(self):
@@ -671,6 +1094,20 @@ class Fluxmeter:
         else:
             self._fluxmeter[0].mode = mode
 
+    @property
+    def share_underground(self):
+        """Transport the underground leg once for both charges.
+
+        This applies to charge-summed fluxes computed with a geomagnet. Since
+        topography layers have no magnetic field, only the atmosphere leg is
+        then transported per charge.
+        """
+        return bool(self._fluxmeter[0].share_underground)
+
+    @share_underground.setter
+    def share_underground(self, v):
+        self._fluxmeter[0].share_underground = 1 if v else 0
+
     @property
     def physics(self):
         """Physics tabulations (stopping power etc.)."""
@@ -703,6 +1140,56 @@ class Fluxmeter:
         self._fluxmeter[0].reference = v._reference[0]
         self._reference = v
 
+    @property
+    def stats(self):
+        """Instrumentation counters (None if disabled).
+
+        Counters are enabled by setting this property to True, and disabled
+        by setting it to False. Setting it again to True resets counters.
+        """
+        if self._stats is None:
+            return None
+        else:
+            fields = ffi.typeof("struct mulder_stats").fields
+            return {k: getattr(self._stats, k) for k, _ in fields}
+
+    @stats.setter
+    def stats(self, v):
+        if v:
+            self._stats = ffi.new("struct mulder_stats *")
+            self._fluxmeter[0].stats = self._stats
+        else:
+            self._fluxmeter[0].stats = ffi.NULL
+            self._stats = None
+
+    @property
+    def use_pruning(self):
+        """Reject hopeless events using an energy pre-pass.
+
+        Underground muons are first traced along a straight line, bounding
+        their energy at the surface from range tables. Events exceeding the
+        reference energy range are then skipped (null flux). This applies to
+        the continuous and mixed modes only.
+        """
+        return bool(self._fluxmeter[0].use_pruning)
+
+    @use_pruning.setter
+    def use_pruning(self, v):
+        self._fluxmeter[0].use_pruning = 1 if v else 0
+
+    @property
+    def use_ranges(self):
+        """Transport the underground leg using tabulated CSDA ranges.
+
+        This applies to the continuous mode. Muons then follow straight lines
+        through uniform layers, without Pumas stepping.
+        """
+        return bool(self._fluxmeter[0].use_ranges)
+
+    @use_ranges.setter
+    def use_ranges(self, v):
+        self._fluxmeter[0].use_ranges = 1 if v else 0
+
     def __init__(self, *args, physics=None, **kwargs):
 
         if args or kwargs:
@@ -712,6 +1199,9 @@ class Fluxmeter:
 
         if physics is None:
             physics = f"{PREFIX}/data/materials.pumas"
+        elif Path(physics).suffix == ".xml":
+            # Materials Description File, using cached physics.
+            physics = physics_cache(physics)
 
         fluxmeter = ffi.new("struct mulder_fluxmeter *[1]")
         fluxmeter[0] = lib.mulder_fluxmeter_create(
@@ -739,79 +1229,290 @@ class Fluxmeter:
         self._geometry = geometry
         self._reference = None
         self._prng = Prng(self)
-
-    def flux(self, *args, **kwargs) -> Flux:
-        """Calculate the muon flux for the given observation state."""
+        self._stats = None
+        self._lock = Lock()
+        self._executor = None
+
+    def estimate(self, *args, events=None, precision=None, antithetic=False,
+                 out=None, threads=None, **kwargs) -> Estimate:
+        """Estimate the muon flux over several Monte Carlo events.
+
+        In mixed or discrete mode, events are transported per observation
+        state until the relative error on the mean flux is below precision,
+        or until the number of events is reached. Optionally, events are
+        drawn by antithetic pairs. In continuous mode, a single event is
+        transported.
+        """
 
         state = State.parse(*args, **kwargs)
+        if events is None: events = _ESTIMATE_EVENTS
+        assert(isinstance(events, Integral) and (events > 0))
+        if precision is None: precision = 0
+        assert(isinstance(precision, Number) and (precision >= 0))
 
         size = state._size or 1
-        flux = Flux.empty(state._size)
+        estimate = _output(Estimate, state._size, out)
+
+        with self._lock:
+            rc = lib.mulder_fluxmeter_estimate_v(
+                self._fluxmeter[0],
+                size,
+                state.numpy_stride,
+                state.cffi_pointer,
+                precision,
+                events,
+                1 if antithetic else 0,
+                estimate.cffi_pointer,
+                _threads(threads)
+            )
+        if rc != lib.MULDER_SUCCESS:
+            raise LibraryError()
 
-        rc = lib.mulder_fluxmeter_flux_v(
-            self._fluxmeter[0],
-            size,
-            state.numpy_stride,
-            state.cffi_pointer,
-            flux.cffi_pointer
-        )
+        return estimate
+
+    def flux(self, *args, out=None, threads=None, **kwargs) -> Flux:
+        """Calculate the muon flux for the given observation state.
+
+        Optionally, results are written in place to out (a Flux array).
+        """
+
+        size, states, _columns = _state_columns(*args, **kwargs)
+
+        flux = _output(Flux, size, out)
+
+        with self._lock:
+            rc = lib.mulder_fluxmeter_flux_columns(
+                self._fluxmeter[0],
+                size or 1,
+                states,
+                flux.cffi_pointer,
+                _threads(threads)
+            )
         if rc != lib.MULDER_SUCCESS:
             raise LibraryError()
 
         return flux
 
-    def transport(self, *args, events=None, **kwargs) -> State:
-        """Transport observation state to the reference location."""
+    def flux_async(self, *args, chunk=None, executor=None, threads=None,
+                   **kwargs):
+        """Calculate the muon flux asynchronously, by chunks of states.
 
-        state = State.parse(*args, **kwargs)
+        A list of futures is returned, one per chunk of observation states,
+        each resolving to the corresponding Flux. Chunks are computed by the
+        given executor (e.g. a concurrent.futures.ThreadPoolExecutor), or by a
+        background thread of the fluxmeter. Note that calls to a same
+        fluxmeter are serialised. Thus, concurrent computations require
+        distinct fluxmeters (while threads parallelise a single call).
+        """
+
+        size, states, columns = _state_columns(*args, **kwargs)
+        if chunk is None: chunk = _ASYNC_CHUNK
+        assert(isinstance(chunk, Integral) and (chunk > 0))
+        threads = _threads(threads)
+
+        if executor is None:
+            with self._lock:
+                if self._executor is None:
+                    self._executor = ThreadPoolExecutor(max_workers=1)
+            executor = self._executor
+
+        def run(start, n, _columns=columns):
+            flux = Flux.empty(n if size is not None else None)
+            chunk_states = _state_slice(states, start)
+            with self._lock:
+                rc = lib.mulder_fluxmeter_flux_columns(
+                    self._fluxmeter[0],
+                    n,
+                    chunk_states,
+                    flux.cffi_pointer,
+                    threads
+                )
+            if rc != lib.MULDER_SUCCESS:
+                raise LibraryError()
+            return flux
+
+        n = size or 1
+        return [executor.submit(run, start, min(chunk, n - start))
+                for start in range(0, n, chunk)]
+
+    def transport(self, *args, events=None, out=None, threads=None,
+                  **kwargs) -> State:
+        """Transport observation state to the reference location.
+
+        Optionally, results are written in place to out (a State array).
+        """
+
+        size, states, _columns = _state_columns(*args, **kwargs)
 
-        size = state._size or 1
         if events is not None:
             assert(isinstance(events, Integral))
             assert(events > 0)
-            result = State.empty(events * size)
+            result = _output(State, events * (size or 1), out)
         else:
             events = 1
-            result = State.empty(state._size)
+            result = _output(State, size, out)
+        _, out, _out_columns = _state_columns(result)
+
+        with self._lock:
+            rc = lib.mulder_fluxmeter_transport_columns(
+                self._fluxmeter[0],
+                events,
+                size or 1,
+                states,
+                out,
+                _threads(threads)
+            )
+        if rc != lib.MULDER_SUCCESS:
+            raise LibraryError()
 
-        rc = lib.mulder_fluxmeter_transport_v(
-            self._fluxmeter[0],
-            events,
-            size,
-            state.numpy_stride,
-            state.cffi_pointer,
-            result.cffi_pointer
-        )
+        return result
+
+    def fluxmap(self, position, azimuth=None, elevation=None, energy=None,
+                tolerance=None, max_nodes=None, threads=None) -> Fluxmap:
+        """Tabulate the muon flux at the given position.
+
+        Each axis is given as a (min, max, nodes) tuple. Angular axes are
+        refined where the grammage varies by more than tolerance (relative)
+        between adjacent nodes, up to max_nodes per axis.
+        """
+
+        position = Position.parse(position)
+        assert(position.size is None)
+        axes = []
+        for value, default in (
+            (azimuth, (0, 360, 73)),
+            (elevation, (0, 90, 46)),
+            (energy, (1E-02, 1E+03, 51))
+        ):
+            value = default if value is None else value
+            axis = ffi.new("struct mulder_axis *")
+            axis.min, axis.max, axis.size = value
+            axes.append(axis[0])
+        if tolerance is None: tolerance = 0
+        assert(isinstance(tolerance, Number) and (tolerance >= 0))
+        if max_nodes is None: max_nodes = 0
+        assert(isinstance(max_nodes, Integral))
+
+        fluxmap = ffi.new("struct mulder_fluxmap *[1]")
+        with self._lock:
+            fluxmap[0] = lib.mulder_fluxmap_create(
+                self._fluxmeter[0],
+                position.numpy_array.tolist(),
+                *axes,
+                tolerance,
+                max_nodes
+            )
+            if fluxmap[0] == ffi.NULL:
+                raise LibraryError()
+            result = Fluxmap.__new__(Fluxmap)
+            result._fluxmap = ffi.gc(fluxmap, lib.mulder_fluxmap_destroy)
+            result._path = None
+            rc = lib.mulder_fluxmap_tabulate_v(
+                fluxmap[0],
+                self._fluxmeter[0],
+                _threads(threads)
+            )
         if rc != lib.MULDER_SUCCESS:
             raise LibraryError()
 
         return result
 
-    def intersect(self, position: Position,
-                        direction: Direction) -> Intersection:
+    def generate(self, position, azimuth=None, elevation=None, energy=None,
+                 events=None, chunk=None, histogram=None, pid=None,
+                 threads=None):
+        """Generate and tally Monte Carlo events, by chunks (iterator).
+
+        Observation directions and energies are sampled with the fluxmeter
+        PRNG, at the given position. Each variable is given as a fixed value,
+        a (min, max) range or a generator (see Prng). Events are generated,
+        transported and tallied by the C library. Thus, memory usage does not
+        depend on the number of events. The cumulated Tally is yielded after
+        each chunk of events.
+
+        Optionally, events can be histogrammed over one of the sampled
+        variables, as a (variable, bins) tuple.
+        """
+
+        position = Position.parse(position)
+        assert(position.size is None)
+        assert(isinstance(events, Integral))
+        if chunk is None: chunk = _GENERATE_CHUNK
+        assert(isinstance(chunk, Integral) and (chunk > 0))
+
+        # Set the C generator.
+        generator = ffi.new("struct mulder_generator *")
+        generator.pid = 0 if pid is None else pid
+        generator.position = position.numpy_array.tolist()
+        samplers = {
+            "azimuth": _sampler(
+                generator.azimuth,
+                (0, 360) if azimuth is None else azimuth,
+                lib.MULDER_UNIFORM
+            ),
+            "elevation": _sampler(
+                generator.elevation,
+                (0, 90) if elevation is None else elevation,
+                lib.MULDER_SIN_UNIFORM
+            ),
+            "energy": _sampler(
+                generator.energy,
+                (1E-02, 1E+03) if energy is None else energy,
+                lib.MULDER_LOG_UNIFORM
+            )
+        }
+
+        # Prepare the tally.
+        if histogram is None:
+            tally = Tally()
+        else:
+            variable, bins = histogram
+            edges = samplers[variable](numpy.linspace(0, 1, bins + 1))
+            tally = Tally(variable, edges)
+
+        # Loop over chunks of events.
+        pending = events
+        while pending > 0:
+            n = min(pending, chunk)
+            with self._lock:
+                rc = lib.mulder_fluxmeter_generate_v(
+                    self._fluxmeter[0],
+                    generator,
+                    n,
+                    tally._tally,
+                    _threads(threads)
+                )
+            if rc != lib.MULDER_SUCCESS:
+                raise LibraryError()
+            pending -= n
+            yield tally
+
+    def intersect(self, position: Position, direction: Direction,
+                  out=None, threads=None) -> Intersection:
         """Compute first intersection with topographic layer(s)."""
 
         assert(isinstance(position, Position))
         assert(isinstance(direction, Direction))
 
         size = commonsize(position, direction)
-        intersection = Intersection.empty(size)
-
-        rc = lib.mulder_fluxmeter_intersect_v(
-            self._fluxmeter[0],
-            size or 1,
-            (position.numpy_stride, direction.numpy_stride),
-            position.cffi_pointer,
-            direction.cffi_pointer,
-            intersection.cffi_pointer
-        )
+        intersection = _output(Intersection, size, out)
+
+        with self._lock:
+            rc = lib.mulder_fluxmeter_intersect_v(
+                self._fluxmeter[0],
+                size or 1,
+                (position.numpy_stride, direction.numpy_stride),
+                position.cffi_pointer,
+                direction.cffi_pointer,
+                intersection.cffi_pointer,
+                _threads(threads)
+            )
         if rc != lib.MULDER_SUCCESS:
             raise LibraryError()
 
         return intersection
 
-    def grammage(self, position: Position,
-                       direction: Direction) -> numpy.ndarray:
+    def grammage(self, position: Position, direction: Direction,
+                 out=None, threads=None) -> numpy.ndarray:
         """Compute grammage(s) (a.k.a. column depth) along line(s) of sight."""
 
         assert(isinstance(position, Position))
@@ -819,23 +1520,70 @@ class Fluxmeter:
 
         size = commonsize(position, direction)
         m = len(self.geometry.layers) + 1
-        if size is None:
-            grammage = numpy.empty(m)
+        shape = (m,) if size is None else (size, m)
+        if out is None:
+            grammage = numpy.empty(shape)
         else:
-            grammage = numpy.empty((size, m))
+            assert(out.shape == shape)
+            assert(out.dtype == numpy.float64)
+            assert(out.flags.c_contiguous)
+            grammage = out
+
+        with self._lock:
+            rc = lib.mulder_fluxmeter_grammage_v(
+                self._fluxmeter[0],
+                size or 1,
+                (position.numpy_stride, direction.numpy_stride),
+                position.cffi_pointer,
+                direction.cffi_pointer,
+                todouble(grammage),
+                _threads(threads)
+            )
+        if rc != lib.MULDER_SUCCESS:
+            raise LibraryError()
 
-        rc = lib.mulder_fluxmeter_grammage_v(
-            self._fluxmeter[0],
-            size or 1,
-            (position.numpy_stride, direction.numpy_stride),
-            position.cffi_pointer,
-            direction.cffi_pointer,
-            todouble(grammage)
+        return grammage
+
+    def image(self, position, grid: PixelGrid, direction, energy=None,
+              threads=None):
+        """Compute a camera image, i.e. grammages along pixels lines of sight.
+
+        The camera is located at position and points towards direction (see
+        PixelGrid). Rays are traced by bundles of neighbouring pixels. If an
+        energy is given, the flux at that energy is computed as well. Returns
+        grammage and flux values over grid nodes (flux is None if no energy
+        is given). See Grid.reshape for structuring them.
+        """
+
+        position = Position.parse(position)
+        assert(position.size is None)
+        assert(isinstance(grid, PixelGrid))
+        pixels = grid.direction(direction)
+        pixels = Direction(
+            azimuth = pixels.azimuth,
+            elevation = pixels.elevation
         )
+
+        height, width = grid.shape
+        grammage = numpy.empty(grid.size)
+        flux = None if energy is None else Flux.empty(grid.size)
+
+        with self._lock:
+            rc = lib.mulder_fluxmeter_image_v(
+                self._fluxmeter[0],
+                position.cffi_pointer,
+                width,
+                height,
+                pixels.cffi_pointer,
+                0 if energy is None else energy,
+                todouble(grammage),
+                ffi.NULL if flux is None else flux.cffi_pointer,
+                _threads(threads)
+            )
         if rc != lib.MULDER_SUCCESS:
             raise LibraryError()
 
-        return grammage
+        return grammage, flux
 
     def whereami(self, *args, **kwargs) -> numpy.ndarray:
         """Get geometric layer indice(s) for given location(s)."""
@@ -845,13 +1593,14 @@ class Fluxmeter:
         size = position._size or 1
         i = numpy.empty(size, dtype="i4")
 
-        rc = lib.mulder_fluxmeter_whereami_v(
-            self._fluxmeter[0],
-            size,
-            position.numpy_stride,
-            position.cffi_pointer,
-            toint(i)
-        )
+        with self._lock:
+            rc = lib.mulder_fluxmeter_whereami_v(
+                self._fluxmeter[0],
+                size,
+                position.numpy_stride,
+                position.cffi_pointer,
+                toint(i)
+            )
         if rc != lib.MULDER_SUCCESS:
             raise LibraryError()
 
@@ -109,6 +109,22 @@ def _is_regular(a):
     return dmax - dmin <= 1E-15 * amax
 
 
+"""Binary header of reference tables (little endian, format version 1)."""
+_TABLE_HEADER = numpy.dtype([
+    ("magic", "S8"),
+    ("version", "<u4"),
+    ("byte_order", "<u4"),
+    ("shape", "<i8", 3),
+    ("range", "<f8", 6),
+    ("offset", "<u8"),
+    ("layout", "<u4"),
+    ("reserved", "<u4")
+])
+
+"""Offset of tabulated data, aligned on a cache line."""
+_TABLE_OFFSET = 128
+
+
 class FluxGrid(Grid):
     """Specialised Grid, used for tabulating flux values."""
 
@@ -144,8 +160,17 @@ class FluxGrid(Grid):
 
         self._flux = Flux.zeros(self._size)
 
-    def create_table(self, path):
-        """Create a (reference) table from flux values at grid nodes."""
+    def create_table(self, path, layout=None):
+        """Create a (reference) table from flux values at grid nodes.
+
+        By default, flux values are stored per grid node ("nodes" layout).
+        Alternatively, log-flux values can be stored per grid cell ("cells"
+        layout). This layout is faster to interpolate, at the cost of a larger
+        table. Note that log-space interpolation is then used for all
+        dimensions.
+        """
+
+        if layout is None: layout = "nodes"
 
         # Format data.
         data = numpy.empty((self._size, 2), dtype="<f4")
@@ -153,32 +178,66 @@ class FluxGrid(Grid):
         data[:,0] = 0.5 * flux.value * (1 + flux.asymmetry)
         data[:,1] = 0.5 * flux.value * (1 - flux.asymmetry)
 
+        if layout == "nodes":
+            mask = None
+        elif layout == "cells":
+            data, mask = _table_cells(data.reshape(self._shape + (2,)))
+        else:
+            raise ValueError(f"bad layout ({layout})")
+
         # Prepare path.
         path = Path(path)
         path.parent.mkdir(parents=True, exist_ok=True)
 
         # Generate binary table file.
         with path.open("wb") as f:
-            dims = numpy.array(
-                self._shape[::-1],
-                dtype="i8"
-            )
-            dims.astype("<i8").tofile(f)
-
-            lims = numpy.array(
-                (
-                    self.energy[0],
-                    self.energy[-1],
-                    self.cos_theta[0],
-                    self.cos_theta[-1],
-                    self.height[0],
-                    self.height[-1]
-                ),
-                dtype="f8"
+            header = numpy.zeros(1, dtype=_TABLE_HEADER)
+            header["magic"] = b"MULDERTB"
+            header["version"] = 1
+            header["byte_order"] = 0x01020304
+            header["shape"] = self._shape[::-1]
+            header["range"] = (
+                self.energy[0],
+                self.energy[-1],
+                self.cos_theta[0],
+                self.cos_theta[-1],
+                self.height[0],
+                self.height[-1]
             )
-            lims.astype("<f8").tofile(f)
+            header["offset"] = _TABLE_OFFSET
+            header["layout"] = 0 if mask is None else 1
+            header.tofile(f)
+            f.write(bytes(_TABLE_OFFSET - _TABLE_HEADER.itemsize))
 
             data.flatten().tofile(f)
+            if mask is not None:
+                mask.flatten().tofile(f)
+
+
+def _table_cells(values):
+    """Reorganise node values as log values at cell corners, with a mask."""
+
+    def corners(n):
+        if n > 1:
+            return (slice(0, n - 1), slice(1, n))
+        else:
+            return (slice(0, 1), slice(0, 1))
+
+    nh, nc, nk, _ = values.shape
+    cells = numpy.stack(
+        [values[h, c, k] for h in corners(nh) for c in corners(nc)
+                         for k in corners(nk)],
+        axis=-2
+    )
+
+    positive = cells > 0
+    mask = numpy.all(positive, axis=-2)
+    mask = (mask[...,0] | (mask[...,1] << 1)).astype("u1")
+
+    data = numpy.full(cells.shape, -numpy.inf, dtype="<f4")
+    data[positive] = numpy.log(cells[positive])
+
+    return data, mask
 
 
 class MapGrid(Grid):
@@ -231,6 +290,55 @@ class MapGrid(Grid):
             raise LibraryError()
 
 
+class MapWriter:
+    """Streaming Turtle map writer, e.g. for large maps.
+
+    Heights are written by chunks of rows (along increasing y), thus in
+    bounded memory. If tile is given, path is a directory where tiles (with
+    shared edges) are written as separate PNG maps. Note that these cannot be
+    loaded as a Turtle stack, which only reads geographic .hgt or .tif tiles.
+    """
+
+    def __init__(self, path, x, y, projection=None, zrange=None, tile=None):
+
+        nx, (xmin, xmax) = x[2], x[:2]
+        ny, (ymin, ymax) = y[2], y[:2]
+        zmin, zmax = (0, 0) if zrange is None else zrange
+
+        # Prepare path directory.
+        directory = Path(path) if tile else Path(path).parent
+        directory.mkdir(parents=True, exist_ok=True)
+
+        writer = lib.mulder_map_begin(tostr(str(path)), tostr(projection),
+            nx, ny, xmin, xmax, ymin, ymax, zmin, zmax, tile or 0)
+        if writer == ffi.NULL:
+            raise LibraryError()
+        self._writer = ffi.new("struct mulder_map_writer *[1]", (writer,))
+        self._writer = ffi.gc(self._writer, lib.mulder_map_writer_destroy)
+        self._nx = nx
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, *args):
+        if exc_type is None:
+            self.close()
+
+    def close(self):
+        """Finalize the map."""
+        rc = lib.mulder_map_finalize(self._writer[0])
+        if rc != lib.MULDER_SUCCESS:
+            raise LibraryError()
+
+    def write(self, rows):
+        """Write rows of heights."""
+        rows = numpy.ascontiguousarray(rows, dtype="f8").reshape(-1, self._nx)
+        rc = lib.mulder_map_write_rows(
+            self._writer[0], rows.shape[0], todouble(rows))
+        if rc != lib.MULDER_SUCCESS:
+            raise LibraryError()
+
+
 class PixelGrid(Grid):
     """Specialised Grid for converting pixel coordinates to angular ones."""
 
@@ -1,14 +1,59 @@
 """Physics related utilities.
 """
 
+from concurrent.futures import ProcessPoolExecutor
+import hashlib
 import os
 from pathlib import Path
+import shutil
+import tempfile
+import xml.etree.ElementTree as ElementTree
 
-from .ffi import lib, tostr
+from .ffi import lib, LibraryError, tostr
+from .version import version
 
 
-def generate_physics(path, destination=None):
-    """Generate physics tables for Pumas."""
+def _tabulate(path, destination):
+    """Compute energy loss tables for a Materials Description File."""
+
+    rc = lib.mulder_generate_physics(
+        tostr(path),
+        tostr(destination),
+        tostr(None),
+        0
+    )
+    if rc != lib.MULDER_SUCCESS:
+        raise LibraryError()
+
+
+def _split_materials(path, directory):
+    """Split a Materials Description File per base material.
+
+    Composite materials are skipped, since Pumas computes them from their
+    components.
+    """
+
+    root = ElementTree.parse(path).getroot()
+    elements = [e for e in root if e.tag == "element"]
+    paths = []
+    for material in root:
+        if material.tag != "material": continue
+        name = material.get("name")
+        split = ElementTree.Element(root.tag, root.attrib)
+        split.extend(elements)
+        split.append(material)
+        split_path = str(Path(directory) / f"{name}.xml")
+        ElementTree.ElementTree(split).write(split_path)
+        paths.append(split_path)
+    return paths
+
+
+def generate_physics(path, destination=None, dump=None, threads=None):
+    """Generate physics tables for Pumas.
+
+    Energy loss tables are computed per base material, over concurrent
+    processes, and then gathered in a single physics dump.
+    """
 
     pathdir = str(Path(path).parent)
     if destination is None:
@@ -17,15 +62,66 @@ def generate_physics(path, destination=None):
     if not os.path.exists(destination):
         os.makedirs(destination)
 
-    dump = str(Path(destination) / Path(path).with_suffix(".pumas").name)
+    if dump is None:
+        dump = str(Path(destination) / Path(path).with_suffix(".pumas").name)
+
+    if threads is None:
+        threads = os.cpu_count() or 1
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        paths = _split_materials(path, tmpdir)
+        if (threads > 1) and (len(paths) > 1):
+            with ProcessPoolExecutor(min(threads, len(paths))) as executor:
+                futures = [executor.submit(_tabulate, p, destination) \
+                           for p in paths]
+                for future in futures:
+                    future.result()
+            tabulated = 1
+        else:
+            tabulated = 0
 
     rc = lib.mulder_generate_physics(
         tostr(path),
         tostr(destination),
-        tostr(dump)
+        tostr(dump),
+        tabulated
     )
     if rc != lib.MULDER_SUCCESS:
         raise LibraryError()
 
     if pathdir != destination:
         shutil.copy(path, destination)
+
+
+def physics_cache(path, cache=None, threads=None):
+    """Get the physics dump for a Materials Description File.
+
+    Dumps are cached by content hash (of the materials file and of the
+    library version). Thus, they are generated once per materials set, and
+    then shared between fluxmeters, jobs and processes.
+    """
+
+    with open(path, "rb") as f:
+        digest = hashlib.sha256(f.read())
+    digest.update(version.encode())
+    key = digest.hexdigest()[:16]
+
+    if cache is None:
+        cache = os.environ.get("MULDER_CACHE")
+        if cache is None:
+            cache = Path(os.environ.get("XDG_CACHE_HOME",
+                Path.home() / ".cache")) / "mulder"
+    cache = Path(cache)
+    dump = cache / f"{Path(path).stem}-{key}.pumas"
+    if dump.exists():
+        return str(dump)
+
+    # Generate tables in a private directory, and publish the dump atomically
+    # (e.g. for concurrent jobs).
+    cache.mkdir(parents=True, exist_ok=True)
+    with tempfile.TemporaryDirectory(dir=cache) as tmpdir:
+        tmpdump = str(Path(tmpdir) / dump.name)
+        generate_physics(path, tmpdir, tmpdump, threads)
+        os.replace(tmpdump, dump)
+
+    return str(dump)
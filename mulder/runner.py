@@ -0,0 +1,259 @@
+"""Sharded flux computations, e.g. for distributing a flux map over nodes.
+
+A job is described by a JSON spec, e.g.
+
+    {
+        "geometry": [{"material": "Rock", "model": "map.png"}],
+        "geomagnet": false,
+        "physics": null,
+        "reference": null,
+        "mode": "continuous",
+        "seed": 1,
+        "position": [45, 3, 0],
+        "azimuth": [0, 360, 73],
+        "elevation": [0, 90, 46],
+        "energy": [1E-02, 1E+03, 51],
+        "events": null,
+        "precision": null
+    }
+
+The (azimuth, elevation, energy) grid is flattened in row major order (energy
+varying the fastest) and partitioned into contiguous shards, each with its own
+Philox stream. Each shard is written as a standalone .npz file, published
+atomically. Thus, completed shards serve as checkpoints, and an interrupted
+run only recomputes missing shards. Relative paths in the spec (models,
+physics and reference) are resolved w.r.t. the spec's directory.
+"""
+
+import hashlib
+import json
+import os
+from pathlib import Path
+import socket
+
+import numpy
+
+from .core import Fluxmeter, Geomagnet, Reference
+
+
+"""Partial results format version."""
+_FORMAT_VERSION = 1
+
+
+def load_spec(path):
+    """Load a job spec, returning its content and its hash."""
+
+    with open(path, "rb") as f:
+        data = f.read()
+    spec = json.loads(data)
+    key = hashlib.sha256(
+        json.dumps(spec, sort_keys=True).encode()).hexdigest()[:16]
+    return spec, key
+
+
+def grid(spec):
+    """Get the grid nodes of a job."""
+
+    def axis(name, default, log=False):
+        xmin, xmax, n = spec.get(name, default)
+        return numpy.geomspace(xmin, xmax, n) if log else \
+               numpy.linspace(xmin, xmax, n)
+
+    return (
+        axis("azimuth", (0, 360, 73)),
+        axis("elevation", (0, 90, 46)),
+        axis("energy", (1E-02, 1E+03, 51), log=True)
+    )
+
+
+def shard_range(size, shards, shard):
+    """Get the [start, stop) range of a shard (balanced partition)."""
+
+    assert(0 <= shard < shards)
+    block, extra = divmod(size, shards)
+    start = shard * block + min(shard, extra)
+    stop = start + block + (1 if shard < extra else 0)
+    return start, stop
+
+
+def shard_seed(seed, shard):
+    """Get the (deterministic) PRNG seed of a shard."""
+
+    sequence = numpy.random.SeedSequence((seed, shard))
+    return int(sequence.generate_state(1, dtype="u8")[0])
+
+
+def _resolve(path, base):
+    """Resolve a spec path w.r.t. the spec's directory."""
+
+    if isinstance(path, (list, tuple)):
+        return [_resolve(p, base) for p in path]
+    elif isinstance(path, str):
+        return str(Path(base) / path)
+    else:
+        return path
+
+
+def _fluxmeter(spec, base):
+    """Create the fluxmeter of a job."""
+
+    geometry = []
+    for layer in spec.get("geometry") or []:
+        if isinstance(layer, dict) and ("model" in layer):
+            layer = dict(layer, model=_resolve(layer["model"], base))
+        geometry.append(layer)
+    fluxmeter = Fluxmeter(*geometry,
+                          physics=_resolve(spec.get("physics"), base))
+    geomagnet = spec.get("geomagnet")
+    if isinstance(geomagnet, dict):
+        if "model" in geomagnet:
+            geomagnet = dict(geomagnet,
+                             model=_resolve(geomagnet["model"], base))
+        geomagnet = Geomagnet(**geomagnet)
+    fluxmeter.geometry.geomagnet = geomagnet
+    reference = spec.get("reference")
+    if reference is not None:
+        fluxmeter.reference = Reference(_resolve(reference, base))
+    fluxmeter.mode = spec.get("mode", "continuous")
+    fluxmeter.prng.algorithm = "philox"
+    return fluxmeter
+
+
+def _shard_path(output, shard, shards):
+    return Path(output) / f"shard-{shard:05d}-of-{shards:05d}.npz"
+
+
+def _tmp_suffix():
+    """Suffix of temporary files (unique over nodes sharing a filesystem)."""
+    return f".{socket.gethostname()}.{os.getpid()}"
+
+
+def run(spec_path, output, shards=1, shard=None, threads=None):
+    """Run a job, or a single shard of it.
+
+    Completed shards are skipped. Returns the indices of computed shards.
+    """
+
+    spec, key = load_spec(spec_path)
+    azimuth, elevation, energy = grid(spec)
+    shape = (azimuth.size, elevation.size, energy.size)
+    size = azimuth.size * elevation.size * energy.size
+    assert(0 < shards <= size)
+
+    output = Path(output)
+    output.mkdir(parents=True, exist_ok=True)
+    manifest = output / "manifest.json"
+    content = {
+        "version": _FORMAT_VERSION,
+        "spec": spec,
+        "key": key,
+        "shards": shards
+    }
+    try:
+        # Create the manifest exclusively, such that concurrent first runs
+        # agree on a single job.
+        fd = os.open(manifest, os.O_CREAT | os.O_EXCL | os.O_WRONLY, 0o644)
+    except FileExistsError:
+        with manifest.open() as f:
+            previous = json.load(f)
+        if (previous["key"] != key) or (previous["shards"] != shards):
+            raise ValueError(f"inconsistent job in {output}")
+    else:
+        with os.fdopen(fd, "w") as f:
+            json.dump(content, f, indent=4)
+
+    fluxmeter = None
+    position = spec.get("position", (0, 0, 0))
+    events = spec.get("events")
+    seed = spec.get("seed", 0)
+    computed = []
+    for i in range(shards) if shard is None else (shard,):
+        path = _shard_path(output, i, shards)
+        if path.exists(): continue
+
+        if fluxmeter is None:
+            fluxmeter = _fluxmeter(spec, Path(spec_path).parent)
+        fluxmeter.prng.seed = shard_seed(seed, i)
+
+        start, stop = shard_range(size, shards, i)
+        ia, ie, ik = numpy.unravel_index(numpy.arange(start, stop), shape)
+        kwargs = dict(
+            latitude = position[0],
+            longitude = position[1],
+            height = position[2],
+            azimuth = azimuth[ia],
+            elevation = elevation[ie],
+            energy = energy[ik],
+            threads = threads
+        )
+        if events is None:
+            flux = fluxmeter.flux(**kwargs)
+            variance = numpy.zeros(stop - start)
+        else:
+            estimate = fluxmeter.estimate(
+                events=events, precision=spec.get("precision"), **kwargs)
+            flux, variance = estimate.flux, estimate.variance
+
+        tmp = path.with_suffix(f"{_tmp_suffix()}.npz")
+        numpy.savez(
+            tmp,
+            key = key,
+            start = start,
+            stop = stop,
+            seed = shard_seed(seed, i),
+            value = flux.value,
+            asymmetry = flux.asymmetry,
+            variance = variance
+        )
+        os.replace(tmp, path)
+        computed.append(i)
+
+    return computed
+
+
+def merge(output, path=None):
+    """Merge the shards of a job into a single .npz file.
+
+    Missing shards raise an error, listing them.
+    """
+
+    output = Path(output)
+    with (output / "manifest.json").open() as f:
+        manifest = json.load(f)
+    if manifest["version"] != _FORMAT_VERSION:
+        raise ValueError(f"bad format version ({manifest['version']})")
+    key, shards = manifest["key"], manifest["shards"]
+    azimuth, elevation, energy = grid(manifest["spec"])
+    shape = (azimuth.size, elevation.size, energy.size)
+    size = azimuth.size * elevation.size * energy.size
+
+    missing = [i for i in range(shards) \
+               if not _shard_path(output, i, shards).exists()]
+    if missing:
+        raise ValueError(f"missing shard(s) ({missing})")
+
+    value = numpy.empty(size)
+    asymmetry = numpy.empty(size)
+    variance = numpy.empty(size)
+    for i in range(shards):
+        with numpy.load(_shard_path(output, i, shards)) as data:
+            start, stop = shard_range(size, shards, i)
+            if (str(data["key"]) != key) or (int(data["start"]) != start) or \
+               (int(data["stop"]) != stop):
+                raise ValueError(f"inconsistent shard ({i})")
+            value[start:stop] = data["value"]
+            asymmetry[start:stop] = data["asymmetry"]
+            variance[start:stop] = data["variance"]
+
+    if path is None:
+        path = output / "flux.npz"
+    numpy.savez(
+        path,
+        azimuth = azimuth,
+        elevation = elevation,
+        energy = energy,
+        value = value.reshape(shape),
+        asymmetry = asymmetry.reshape(shape),
+        variance = variance.reshape(shape)
+    )
+    return path
@@ -223,6 +223,19 @@ class ReducedFlux(Flux):
         return other.__add__(self)
 
 
+@arrayclass
+class Estimate:
+    """Container for Monte Carlo estimates of the muon flux."""
+
+    ctype = "struct mulder_estimate *"
+
+    properties = (
+        ("flux",     Flux, "Mean flux."),
+        ("variance", "f8", "Variance of the mean flux value."),
+        ("events",   "i8", "Number of transported events.")
+    )
+
+
 @arrayclass
 class Position(Algebraic):
     """Observation position, using geographic coordinates (GPS like)."""
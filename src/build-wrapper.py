@@ -52,7 +52,7 @@ ffi = FFI()
 ffi.set_source("mulder.wrapper", source(),
     extra_link_args=rpath(),
     extra_objects=objects(),
-    libraries=["mulder",],
+    libraries=["mulder", "pthread"],
     library_dirs=["lib",],
 )
 ffi.cdef(definitions())
@@ -1,11 +1,25 @@
+/* POSIX features (e.g. clock_gettime) */
+#define _POSIX_C_SOURCE 200809L
+
 /* C standard library */
 #include <float.h>
+#include <limits.h>
 #include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+/* POSIX */
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 /* Custom libraries */
 #include "gull.h"
@@ -44,13 +58,25 @@ static void default_error(const char * message)
 void (*mulder_error)(const char * message) = &default_error;
 
 
+/* Raise an error, counting errors per thread (e.g. for stopping loops on the
+ * first error)
+ */
+static __thread unsigned long n_errors = 0;
+
+static void raise_error(const char * message)
+{
+        n_errors++;
+        mulder_error(message);
+}
+
+
 /* Formated error */
 #define MULDER_ERROR(FORMAT, EXTRA_SIZE, ...)                                  \
 {                                                                              \
         const char format[] = FORMAT ;                                         \
         char msg[sizeof(format) + EXTRA_SIZE];                                 \
         sprintf(msg, format, __VA_ARGS__);                                     \
-        mulder_error(msg);                                                     \
+        raise_error(msg);                                                      \
 }
 
 
@@ -60,7 +86,7 @@ static void pumas_error(
     pumas_function_t * caller,
     const char * message)
 {
-        mulder_error(message);
+        raise_error(message);
 }
 
 static pumas_handler_cb * pumas_default_error = NULL;
@@ -70,12 +96,51 @@ static void turtle_error(
     turtle_function_t * function,
     const char * message)
 {
-        mulder_error(message);
+        raise_error(message);
 }
 
 static turtle_error_handler_t * turtle_default_error = NULL;
 
 
+/* Catching of Pumas errors. Since the catch state is global, catch sections
+ * are serialised (using a recursive lock, since sections might nest). When
+ * leaving a section, the previous catch state is restored.
+ */
+static pthread_mutex_t catch_mutex;
+static pthread_once_t catch_once = PTHREAD_ONCE_INIT;
+static int catch_enabled = 0;
+
+static void catch_initialise(void)
+{
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&catch_mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+}
+
+static int catch_begin(void)
+{
+        pthread_once(&catch_once, &catch_initialise);
+        pthread_mutex_lock(&catch_mutex);
+        const int previous = catch_enabled;
+        catch_enabled = 1;
+        pumas_error_catch(1);
+        return previous;
+}
+
+/* Leave a catch section, raising caught errors (if any) if raise is true,
+ * or silently discarding them otherwise
+ */
+static void catch_end(int previous, int raise)
+{
+        if (raise) pumas_error_raise();
+        pumas_error_catch(previous);
+        catch_enabled = previous;
+        pthread_mutex_unlock(&catch_mutex);
+}
+
+
 /* Library initialisation (automatic when loaded, assuming gcc, clang, etc.) */
 #ifndef _MULDER_CONSTRUCTOR
 __attribute__((__constructor__)) static
@@ -135,15 +200,39 @@ static void init_ptr(void ** loc, void * ptr)
 struct layer {
         struct mulder_layer api;
         struct turtle_map * map;
+        struct turtle_stack * stack;
+        /* Fallback maps, e.g. coarser far-field ones (by priority order) */
+        int n_fallbacks;
+        struct turtle_map ** fallbacks;
 };
 
 
+/* Default number of resident tiles, for stacks of maps */
+#define STACK_SIZE 8
+
+
 struct mulder_layer * mulder_layer_create(
     const char * material,
     const char * model,
     double offset)
 {
+        /* Directories are loaded as stacks of maps */
+        struct stat st;
+        if ((model != NULL) && (stat(model, &st) == 0) &&
+            S_ISDIR(st.st_mode)) {
+                const double zrange[2] = {0., 0.};
+                return mulder_layer_create_stack(
+                    material, model, offset, STACK_SIZE, zrange);
+        }
+
         struct layer * layer = malloc(sizeof *layer);
+        if (layer == NULL) {
+                raise_error("could not allocate memory");
+                return NULL;
+        }
+        layer->stack = NULL;
+        layer->n_fallbacks = 0;
+        layer->fallbacks = NULL;
 
         /* Load the map */
         if (model == NULL) {
@@ -202,12 +291,259 @@ struct mulder_layer * mulder_layer_create(
 }
 
 
+/* Lock for stacks of maps, since tiles are loaded on the fly */
+static pthread_mutex_t stack_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int stack_lock(void)
+{
+        return pthread_mutex_lock(&stack_mutex);
+}
+
+static int stack_unlock(void)
+{
+        return pthread_mutex_unlock(&stack_mutex);
+}
+
+
+/* Elevation bounds of a stack of maps, scanning tiles one by one (i.e.
+ * without keeping them in memory)
+ */
+static int stack_zrange(const char * path, double zrange[2])
+{
+        DIR * dir = opendir(path);
+        if (dir == NULL) {
+                MULDER_ERROR("could not open %s", strlen(path), path);
+                return -1;
+        }
+
+        const int n = strlen(path);
+        char * filename = NULL;
+        int found = 0, rc = 0;
+        struct dirent * entry;
+        while ((entry = readdir(dir)) != NULL) {
+                /* Tiles formats supported by Turtle stacks */
+                const char * ext = strrchr(entry->d_name, '.');
+                if ((ext == NULL) || ((strcmp(ext, ".hgt") != 0) &&
+                    (strcmp(ext, ".tif") != 0))) {
+                        continue;
+                }
+
+                const int size = n + strlen(entry->d_name) + 2;
+                char * tmp = realloc(filename, size);
+                if (tmp == NULL) {
+                        raise_error("could not allocate memory");
+                        rc = -1;
+                        break;
+                }
+                filename = tmp;
+                sprintf(filename, "%s/%s", path, entry->d_name);
+
+                struct turtle_map * map;
+                if (turtle_map_load(&map, filename) != TURTLE_RETURN_SUCCESS) {
+                        rc = -1;
+                        break;
+                }
+                struct turtle_map_info info;
+                const char * projection;
+                turtle_map_meta(map, &info, &projection);
+                turtle_map_destroy(&map);
+
+                if (!found || (info.z[0] < zrange[0])) zrange[0] = info.z[0];
+                if (!found || (info.z[1] > zrange[1])) zrange[1] = info.z[1];
+                found = 1;
+        }
+        closedir(dir);
+        free(filename);
+
+        if (!found) zrange[0] = zrange[1] = 0.;
+        return rc;
+}
+
+
+struct mulder_layer * mulder_layer_create_stack(
+    const char * material,
+    const char * path,
+    double offset,
+    int size,
+    const double zrange[2])
+{
+        if (size <= 0) {
+                MULDER_ERROR("bad stack size (%d)", 16, size);
+                return NULL;
+        }
+
+        /* Get elevation bounds, scanning tiles if not provided */
+        double z[2] = {0., 0.};
+        if ((zrange != NULL) && (zrange[0] < zrange[1])) {
+                z[0] = zrange[0];
+                z[1] = zrange[1];
+        } else if (stack_zrange(path, z) != 0) {
+                return NULL;
+        }
+
+        struct layer * layer = malloc(sizeof *layer);
+        if (layer == NULL) {
+                raise_error("could not allocate memory");
+                return NULL;
+        }
+        layer->map = NULL;
+        layer->n_fallbacks = 0;
+        layer->fallbacks = NULL;
+
+        /* Index the stack (tiles are loaded lazily) */
+        if (turtle_stack_create(&layer->stack, path, size, &stack_lock,
+            &stack_unlock) != TURTLE_RETURN_SUCCESS) {
+                free(layer);
+                return NULL;
+        }
+        init_string((void **)&layer->api.model, path);
+
+        /* Fetch stack metadata (using geographic coordinates) */
+        int shape[2];
+        double latitude[2], longitude[2];
+        turtle_stack_info(layer->stack, shape, latitude, longitude);
+
+        init_string((void **)&layer->api.encoding, "stack");
+        init_ptr((void **)&layer->api.projection, NULL);
+        init_int((int *)&layer->api.nx, shape[1]);
+        init_int((int *)&layer->api.ny, shape[0]);
+        init_double((double *)&layer->api.xmin, longitude[0]);
+        init_double((double *)&layer->api.xmax, longitude[1]);
+        init_double((double *)&layer->api.ymin, latitude[0]);
+        init_double((double *)&layer->api.ymax, latitude[1]);
+        init_double((double *)&layer->api.zmin, z[0] + offset);
+        init_double((double *)&layer->api.zmax, z[1] + offset);
+
+        /* Initialise remaining non mutable settings */
+        init_string((void **)&layer->api.material, material);
+        init_double((double *)&layer->api.offset, offset);
+
+        /* Initialise mutable propertie(s) */
+        layer->api.density = 0.;
+
+        return &layer->api;
+}
+
+
+struct mulder_layer * mulder_layer_create_multires(
+    const char * material,
+    int size,
+    const char * models[],
+    double offset)
+{
+        if (size < 1) {
+                MULDER_ERROR("bad number of models (%d)", 16, size);
+                return NULL;
+        }
+
+        /* Load the primary map */
+        struct mulder_layer * api = mulder_layer_create(
+            material, models[0], offset);
+        if (api == NULL) return NULL;
+        struct layer * layer = (void *)api;
+        if ((layer->map == NULL) || (size == 1)) {
+                if (size > 1) {
+                        raise_error("bad primary model (expected a map)");
+                        mulder_layer_destroy(&api);
+                }
+                return api;
+        }
+
+        /* Load fallback maps */
+        layer->fallbacks = calloc(size - 1, sizeof *layer->fallbacks);
+        if (layer->fallbacks == NULL) {
+                raise_error("could not allocate memory");
+                mulder_layer_destroy(&api);
+                return NULL;
+        }
+        double zmin = layer->api.zmin, zmax = layer->api.zmax;
+        int i;
+        for (i = 1; i < size; i++) {
+                struct turtle_map ** map = layer->fallbacks + i - 1;
+                if (turtle_map_load(map, models[i]) !=
+                    TURTLE_RETURN_SUCCESS) {
+                        mulder_layer_destroy(&api);
+                        return NULL;
+                }
+                layer->n_fallbacks++;
+
+                struct turtle_map_info info;
+                const char * projection;
+                turtle_map_meta(*map, &info, &projection);
+                if (info.z[0] + offset < zmin) zmin = info.z[0] + offset;
+                if (info.z[1] + offset > zmax) zmax = info.z[1] + offset;
+        }
+        init_double((double *)&layer->api.zmin, zmin);
+        init_double((double *)&layer->api.zmax, zmax);
+
+        return api;
+}
+
+
+/* Get the map covering a location, and the corresponding map coordinates.
+ *
+ * The location is expressed w.r.t. the primary map. If no map covers it, NULL
+ * is returned.
+ */
+static struct turtle_map * layer_map(
+    const struct layer * l,
+    struct mulder_projection * projection,
+    double * elevation)
+{
+        int inside;
+        turtle_map_elevation(l->map, projection->x, projection->y, elevation,
+            &inside);
+        if (inside || (l->n_fallbacks == 0)) {
+                return inside ? l->map : NULL;
+        }
+
+        /* Get geographic coordinates */
+        double latitude, longitude;
+        const struct turtle_projection * p = turtle_map_projection(l->map);
+        if (p == NULL) {
+                longitude = projection->x;
+                latitude = projection->y;
+        } else {
+                turtle_projection_unproject(p, projection->x, projection->y,
+                    &latitude, &longitude);
+        }
+
+        /* Check fallback maps (by priority order) */
+        int i;
+        for (i = 0; i < l->n_fallbacks; i++) {
+                struct turtle_map * map = l->fallbacks[i];
+                double x, y;
+                p = turtle_map_projection(map);
+                if (p == NULL) {
+                        x = longitude;
+                        y = latitude;
+                } else {
+                        turtle_projection_project(p, latitude, longitude,
+                            &x, &y);
+                }
+                turtle_map_elevation(map, x, y, elevation, &inside);
+                if (inside) {
+                        projection->x = x;
+                        projection->y = y;
+                        return map;
+                }
+        }
+        return NULL;
+}
+
+
 void mulder_layer_destroy(struct mulder_layer ** layer)
 {
         if ((layer == NULL) || (*layer == NULL)) return;
 
         struct layer * l = (void *)(*layer);
         turtle_map_destroy(&l->map);
+        turtle_stack_destroy(&l->stack);
+        int i;
+        for (i = 0; i < l->n_fallbacks; i++) {
+                turtle_map_destroy(l->fallbacks + i);
+        }
+        free(l->fallbacks);
         free((void *)l->api.material);
         free((void *)l->api.model);
         free((void *)l->api.encoding);
@@ -222,19 +558,24 @@ double mulder_layer_height(
     const struct mulder_projection projection)
 {
         struct layer * l = (void *)layer;
-        if (l->map == NULL) {
-                return layer->offset;
-        } else {
+        if (l->stack != NULL) {
                 double z;
                 int inside;
-                turtle_map_elevation(
-                    l->map,
-                    projection.x,
+                turtle_stack_elevation(
+                    l->stack,
                     projection.y,
+                    projection.x,
                     &z,
                     &inside
                 );
                 return inside ? z + layer->offset : ZMIN;
+        } else if (l->map == NULL) {
+                return layer->offset;
+        } else {
+                double z;
+                struct mulder_projection p = projection;
+                return (layer_map(l, &p, &z) != NULL) ?
+                    z + layer->offset : ZMIN;
         }
 }
 
@@ -245,26 +586,315 @@ struct mulder_projection mulder_layer_gradient(
 {
         struct mulder_projection gradient;
         struct layer * l = (void *)layer;
-        if (l->map == NULL) {
-                gradient.x = gradient.y = 0.;
-        } else {
+        if (l->stack != NULL) {
                 int inside;
-                turtle_map_gradient(
-                    l->map,
-                    projection.x,
+                turtle_stack_gradient(
+                    l->stack,
                     projection.y,
-                    &gradient.x,
+                    projection.x,
                     &gradient.y,
+                    &gradient.x,
                     &inside
                 );
                 if (!inside) {
                         gradient.x = gradient.y = 0.;
                 }
+        } else if (l->map == NULL) {
+                gradient.x = gradient.y = 0.;
+        } else {
+                /* Fallback maps are used only if they have the same
+                 * projection, since the gradient is w.r.t. map coordinates
+                 */
+                double z;
+                struct mulder_projection p = projection;
+                struct turtle_map * map = layer_map(l, &p, &z);
+                if ((map != NULL) && (map != l->map)) {
+                        struct turtle_map_info info;
+                        const char * p0, * p1;
+                        turtle_map_meta(l->map, &info, &p0);
+                        turtle_map_meta(map, &info, &p1);
+                        if ((p0 != p1) && ((p0 == NULL) || (p1 == NULL) ||
+                            (strcmp(p0, p1) != 0))) {
+                                map = NULL;
+                        }
+                }
+
+                int inside = 0;
+                if (map != NULL) {
+                        turtle_map_gradient(
+                            map,
+                            p.x,
+                            p.y,
+                            &gradient.x,
+                            &gradient.y,
+                            &inside
+                        );
+                }
+                if (!inside) {
+                        gradient.x = gradient.y = 0.;
+                }
         }
         return gradient;
 }
 
 
+/* Batched evaluation of map layers.
+ *
+ * Map nodes are decoded by tiles, which are cached over a batch (using a
+ * direct mapping). Then, map locations are processed by chunks. Cells are
+ * gathered first, and bilinear interpolations are then vectorized (see
+ * map_interpolate_v, below). Locations outside of the layer's map (e.g. within
+ * fallback maps) are resolved individually.
+ */
+#define MAP_TILE 16
+#define MAP_TILE_NODES ((MAP_TILE + 1) * (MAP_TILE + 1))
+#define MAP_TILES 128
+#define MAP_CHUNK 256
+
+struct map_tiles {
+        struct turtle_map * map;
+        int nx;
+        int ny;
+        int ntx;
+        double x0;
+        double y0;
+        double dx;
+        double dy;
+        int keys[MAP_TILES];
+        double nodes[MAP_TILES][MAP_TILE_NODES];
+};
+
+/* Gathered map cells, for a chunk of locations */
+struct map_cells {
+        int size;
+        int outside[MAP_CHUNK];
+        double hx[MAP_CHUNK];
+        double hy[MAP_CHUNK];
+        double z[4][MAP_CHUNK];
+};
+
+static void map_interpolate_v(struct map_cells * cells, double offset,
+    double * height);
+
+static void map_differentiate_v(struct map_cells * cells, double dx,
+    double dy, struct mulder_projection * gradient);
+
+static struct map_tiles * map_tiles_create(const struct layer * l)
+{
+        if ((l->stack != NULL) || (l->map == NULL)) return NULL;
+        struct turtle_map_info info;
+        const char * projection;
+        turtle_map_meta(l->map, &info, &projection);
+        if ((info.nx < 2) || (info.ny < 2)) return NULL;
+
+        struct map_tiles * tiles = malloc(sizeof *tiles);
+        if (tiles == NULL) return NULL; /* fallback to individual calls */
+        tiles->map = l->map;
+        tiles->nx = info.nx;
+        tiles->ny = info.ny;
+        tiles->ntx = (info.nx - 2) / MAP_TILE + 1;
+        tiles->x0 = info.x[0];
+        tiles->y0 = info.y[0];
+        tiles->dx = (info.x[1] - info.x[0]) / (info.nx - 1);
+        tiles->dy = (info.y[1] - info.y[0]) / (info.ny - 1);
+        int i;
+        for (i = 0; i < MAP_TILES; i++) tiles->keys[i] = -1;
+        return tiles;
+}
+
+static const double * map_tiles_get(struct map_tiles * tiles, int tx, int ty)
+{
+        const int key = ty * tiles->ntx + tx;
+        const int slot = key % MAP_TILES;
+        double * nodes = tiles->nodes[slot];
+        if (tiles->keys[slot] != key) {
+                const int ix0 = tx * MAP_TILE, iy0 = ty * MAP_TILE;
+                int ix1 = ix0 + MAP_TILE, iy1 = iy0 + MAP_TILE;
+                if (ix1 > tiles->nx - 1) ix1 = tiles->nx - 1;
+                if (iy1 > tiles->ny - 1) iy1 = tiles->ny - 1;
+                int ix, iy;
+                for (iy = iy0; iy <= iy1; iy++) {
+                        double * row = nodes + (iy - iy0) * (MAP_TILE + 1);
+                        for (ix = ix0; ix <= ix1; ix++) {
+                                double x, y;
+                                turtle_map_node(tiles->map, ix, iy, &x, &y,
+                                    row + ix - ix0);
+                        }
+                }
+                tiles->keys[slot] = key;
+        }
+        return nodes;
+}
+
+static void map_gather(
+    struct map_tiles * tiles,
+    int size,
+    int stride,
+    const struct mulder_projection * projection,
+    struct map_cells * cells)
+{
+        cells->size = size;
+        int i;
+        for (i = 0; i < size; i++, projection = (void *)projection + stride) {
+                const double hx = (projection->x - tiles->x0) / tiles->dx;
+                const double hy = (projection->y - tiles->y0) / tiles->dy;
+                if ((hx < 0.) || (hx > tiles->nx - 1) || (hy < 0.) ||
+                    (hy > tiles->ny - 1)) {
+                        cells->outside[i] = 1;
+                        cells->hx[i] = cells->hy[i] = 0.;
+                        cells->z[0][i] = cells->z[1][i] = 0.;
+                        cells->z[2][i] = cells->z[3][i] = 0.;
+                        continue;
+                }
+                int ix = (int)hx, iy = (int)hy;
+                if (ix > tiles->nx - 2) ix = tiles->nx - 2;
+                if (iy > tiles->ny - 2) iy = tiles->ny - 2;
+                const int tx = ix / MAP_TILE, ty = iy / MAP_TILE;
+                const double * nodes = map_tiles_get(tiles, tx, ty);
+                const double * z = nodes + (iy - ty * MAP_TILE) *
+                    (MAP_TILE + 1) + ix - tx * MAP_TILE;
+                cells->outside[i] = 0;
+                cells->hx[i] = hx - ix;
+                cells->hy[i] = hy - iy;
+                cells->z[0][i] = z[0];
+                cells->z[1][i] = z[1];
+                cells->z[2][i] = z[MAP_TILE + 1];
+                cells->z[3][i] = z[MAP_TILE + 2];
+        }
+}
+
+void mulder_layer_height_batch(
+    const struct mulder_layer * layer,
+    int size,
+    int stride,
+    const struct mulder_projection * projection,
+    double * height)
+{
+        const struct layer * l = (void *)layer;
+        struct map_tiles * tiles = map_tiles_create(l);
+        if (tiles == NULL) {
+                for (; size > 0; size--, height++) {
+                        *height = mulder_layer_height(layer, *projection);
+                        projection = (void *)projection + stride;
+                }
+                return;
+        }
+
+        struct map_cells cells;
+        while (size > 0) {
+                const int n = (size > MAP_CHUNK) ? MAP_CHUNK : size;
+                map_gather(tiles, n, stride, projection, &cells);
+                map_interpolate_v(&cells, layer->offset, height);
+                int i;
+                for (i = 0; i < n; i++) {
+                        if (cells.outside[i]) {
+                                const struct mulder_projection * pi =
+                                    (void *)projection + i * stride;
+                                height[i] = mulder_layer_height(layer, *pi);
+                        }
+                }
+                size -= n;
+                height += n;
+                projection = (void *)projection + n * stride;
+        }
+        free(tiles);
+}
+
+void mulder_layer_gradient_batch(
+    const struct mulder_layer * layer,
+    int size,
+    int stride,
+    const struct mulder_projection * projection,
+    struct mulder_projection * gradient)
+{
+        const struct layer * l = (void *)layer;
+        struct map_tiles * tiles = map_tiles_create(l);
+        if (tiles == NULL) {
+                for (; size > 0; size--, gradient++) {
+                        *gradient = mulder_layer_gradient(layer, *projection);
+                        projection = (void *)projection + stride;
+                }
+                return;
+        }
+
+        struct map_cells cells;
+        while (size > 0) {
+                const int n = (size > MAP_CHUNK) ? MAP_CHUNK : size;
+                map_gather(tiles, n, stride, projection, &cells);
+                map_differentiate_v(&cells, tiles->dx, tiles->dy, gradient);
+                int i;
+                for (i = 0; i < n; i++) {
+                        if (cells.outside[i]) {
+                                const struct mulder_projection * pi =
+                                    (void *)projection + i * stride;
+                                gradient[i] = mulder_layer_gradient(
+                                    layer, *pi);
+                        }
+                }
+                size -= n;
+                gradient += n;
+                projection = (void *)projection + n * stride;
+        }
+        free(tiles);
+}
+
+void mulder_layer_height_grid(
+    const struct mulder_layer * layer,
+    int nx,
+    int ny,
+    double xmin,
+    double xmax,
+    double ymin,
+    double ymax,
+    double * height)
+{
+        if ((nx <= 0) || (ny <= 0)) return;
+        const double dx = (nx > 1) ? (xmax - xmin) / (nx - 1) : 0.;
+        const double dy = (ny > 1) ? (ymax - ymin) / (ny - 1) : 0.;
+
+        const struct layer * l = (void *)layer;
+        struct map_tiles * tiles = map_tiles_create(l);
+        struct mulder_projection projection[MAP_CHUNK];
+        struct map_cells cells;
+        int iy;
+        for (iy = 0; iy < ny; iy++) {
+                /* Rows are processed by chunks, using incremental (regular)
+                 * coordinates
+                 */
+                const double y = ymin + iy * dy;
+                int ix = 0;
+                while (ix < nx) {
+                        const int n = (nx - ix > MAP_CHUNK) ?
+                            MAP_CHUNK : nx - ix;
+                        int i;
+                        for (i = 0; i < n; i++) {
+                                projection[i].x = xmin + (ix + i) * dx;
+                                projection[i].y = y;
+                        }
+                        if (tiles == NULL) {
+                                for (i = 0; i < n; i++) {
+                                        height[i] = mulder_layer_height(
+                                            layer, projection[i]);
+                                }
+                        } else {
+                                map_gather(tiles, n, sizeof *projection,
+                                    projection, &cells);
+                                map_interpolate_v(&cells, layer->offset,
+                                    height);
+                                for (i = 0; i < n; i++) {
+                                        if (!cells.outside[i]) continue;
+                                        height[i] = mulder_layer_height(
+                                            layer, projection[i]);
+                                }
+                        }
+                        ix += n;
+                        height += n;
+                }
+        }
+        free(tiles);
+}
+
+
 struct mulder_position mulder_layer_position(
     const struct mulder_layer * layer,
     const struct mulder_projection projection)
@@ -329,6 +959,13 @@ struct geomagnet {
         int iid;
         struct gull_snapshot * snapshot;
         double * workspace;
+
+        /* Field grid (optional), over geodetic coordinates */
+        int grid_shape[3];
+        double grid_min[3];
+        double grid_max[3];
+        double grid_inv[3];
+        double * grid; /* ECEF components of the field, at grid nodes */
 };
 
 
@@ -341,7 +978,7 @@ struct mulder_geomagnet * mulder_geomagnet_create(
         static int iid = 0; /* Instance ID */
         struct geomagnet * geomagnet = malloc(sizeof *geomagnet);
         if (geomagnet == NULL) {
-                mulder_error("could not allocate memory");
+                raise_error("could not allocate memory");
                 return NULL;
         } else {
                 geomagnet->iid = iid++;
@@ -353,11 +990,11 @@ struct mulder_geomagnet * mulder_geomagnet_create(
         if (rc != GULL_RETURN_SUCCESS) {
                 free(geomagnet);
                 if (rc == GULL_RETURN_MEMORY_ERROR) {
-                        mulder_error("could not allocate memory");
+                        raise_error("could not allocate memory");
                 } else if (rc == GULL_RETURN_PATH_ERROR) {
                         MULDER_ERROR("could not open %s", strlen(model), model);
                 } else if (rc == GULL_RETURN_MISSING_DATA) {
-                        mulder_error("no data for the given date");
+                        raise_error("no data for the given date");
                 }
                 return NULL;
         }
@@ -382,27 +1019,178 @@ struct mulder_geomagnet * mulder_geomagnet_create(
         /* Initialise workspace */
         geomagnet->workspace = NULL;
 
+        /* No field grid, by default */
+        memset(geomagnet->grid_shape, 0x0, sizeof geomagnet->grid_shape);
+        geomagnet->grid = NULL;
+
         return &geomagnet->api;
 }
 
 
-void mulder_geomagnet_destroy(struct mulder_geomagnet ** geomagnet)
+/* Geomagnetic field, tabulated over a geodetic grid */
+static void enu_to_ecef(
+    double latitude,
+    double longitude,
+    const double enu[3],
+    double ecef[3]);
+
+struct mulder_geomagnet * mulder_geomagnet_create_grid(
+    const char * model,
+    int day,
+    int month,
+    int year,
+    const struct mulder_position min,
+    const struct mulder_position max,
+    const int shape[3])
 {
-        if ((geomagnet == NULL) || (*geomagnet == NULL)) return;
+        /* Check the grid */
+        const double xmin[3] = {min.latitude, min.longitude, min.height};
+        const double xmax[3] = {max.latitude, max.longitude, max.height};
+        int i, size = 3;
+        for (i = 0; i < 3; i++) {
+                if ((shape[i] < 2) || (shape[i] > INT_MAX / size)) {
+                        MULDER_ERROR("bad grid shape (%d)", 16, shape[i]);
+                        return NULL;
+                }
+                size *= shape[i];
+                if (!(xmin[i] < xmax[i])) {
+                        raise_error("bad grid range");
+                        return NULL;
+                }
+        }
+        if ((xmin[0] < -90.) || (xmax[0] > 90.)) {
+                raise_error("bad grid range");
+                return NULL;
+        }
 
-        struct geomagnet * g = (void *)(*geomagnet);
-        gull_snapshot_destroy(&g->snapshot);
-        free(g->workspace);
-        free((void *)g->api.model);
-        free(g);
-        *geomagnet = NULL;
-}
+        /* Load the snapshot */
+        struct mulder_geomagnet * api = mulder_geomagnet_create(
+            model, day, month, year);
+        if (api == NULL) return NULL;
+        struct geomagnet * geomagnet = (void *)api;
+
+        geomagnet->grid = malloc(size * sizeof *geomagnet->grid);
+        if (geomagnet->grid == NULL) {
+                raise_error("could not allocate memory");
+                mulder_geomagnet_destroy(&api);
+                return NULL;
+        }
 
+        /* Tabulate the field (in ECEF frame) */
+        double dx[3];
+        for (i = 0; i < 3; i++) {
+                geomagnet->grid_shape[i] = shape[i];
+                geomagnet->grid_min[i] = xmin[i];
+                geomagnet->grid_max[i] = xmax[i];
+                dx[i] = (xmax[i] - xmin[i]) / (shape[i] - 1);
+                geomagnet->grid_inv[i] = 1. / dx[i];
+        }
 
-struct mulder_enu mulder_geomagnet_field(
-    const struct mulder_geomagnet * geomagnet,
-    const struct mulder_position position)
-{
+        double * field = geomagnet->grid;
+        for (i = 0; i < shape[0]; i++) {
+                const double latitude = xmin[0] + i * dx[0];
+                int j;
+                for (j = 0; j < shape[1]; j++) {
+                        const double longitude = xmin[1] + j * dx[1];
+                        int k;
+                        for (k = 0; k < shape[2]; k++, field += 3) {
+                                const double height = xmin[2] + k * dx[2];
+                                double enu[3];
+                                if (gull_snapshot_field(
+                                    geomagnet->snapshot,
+                                    latitude,
+                                    longitude,
+                                    height,
+                                    enu,
+                                    &geomagnet->workspace) !=
+                                    GULL_RETURN_SUCCESS) {
+                                        raise_error(
+                                            "bad grid range (out of model)");
+                                        mulder_geomagnet_destroy(&api);
+                                        return NULL;
+                                }
+                                enu_to_ecef(latitude, longitude, enu, field);
+                        }
+                }
+        }
+
+        return api;
+}
+
+
+/* Trilinear interpolation of the field grid (in ECEF frame) */
+static int geomagnet_grid_field(
+    const struct geomagnet * geomagnet,
+    double latitude,
+    double longitude,
+    double height,
+    double ecef[3])
+{
+        if (geomagnet->grid == NULL) return -1;
+
+        /* Wrap the longitude into the grid range, modulo 360 deg */
+        double x[3] = {latitude, longitude, height};
+        const double dx = fmod(x[1] - geomagnet->grid_min[1], 360.);
+        x[1] = geomagnet->grid_min[1] + ((dx < 0.) ? dx + 360. : dx);
+
+        int index[3];
+        double h[3];
+        int i;
+        for (i = 0; i < 3; i++) {
+                if ((x[i] < geomagnet->grid_min[i]) ||
+                    (x[i] > geomagnet->grid_max[i])) {
+                        return -1;
+                }
+                const double tmp =
+                    (x[i] - geomagnet->grid_min[i]) * geomagnet->grid_inv[i];
+                int j = (int)tmp;
+                if (j > geomagnet->grid_shape[i] - 2) {
+                        j = geomagnet->grid_shape[i] - 2;
+                }
+                index[i] = j;
+                h[i] = tmp - j;
+        }
+
+        const int n1 = geomagnet->grid_shape[1];
+        const int n2 = geomagnet->grid_shape[2];
+        const double * const f000 = geomagnet->grid +
+            3 * ((index[0] * n1 + index[1]) * n2 + index[2]);
+        const double * const f100 = f000 + 3 * n1 * n2;
+        const double * const f010 = f000 + 3 * n2;
+        const double * const f110 = f100 + 3 * n2;
+
+        for (i = 0; i < 3; i++) {
+                const double f00 = f000[i] * (1. - h[2]) + f000[i + 3] * h[2];
+                const double f01 = f010[i] * (1. - h[2]) + f010[i + 3] * h[2];
+                const double f10 = f100[i] * (1. - h[2]) + f100[i + 3] * h[2];
+                const double f11 = f110[i] * (1. - h[2]) + f110[i + 3] * h[2];
+                const double f0 = f00 * (1. - h[1]) + f01 * h[1];
+                const double f1 = f10 * (1. - h[1]) + f11 * h[1];
+                ecef[i] = f0 * (1. - h[0]) + f1 * h[0];
+        }
+
+        return 0;
+}
+
+
+void mulder_geomagnet_destroy(struct mulder_geomagnet ** geomagnet)
+{
+        if ((geomagnet == NULL) || (*geomagnet == NULL)) return;
+
+        struct geomagnet * g = (void *)(*geomagnet);
+        gull_snapshot_destroy(&g->snapshot);
+        free(g->workspace);
+        free(g->grid);
+        free((void *)g->api.model);
+        free(g);
+        *geomagnet = NULL;
+}
+
+
+struct mulder_enu mulder_geomagnet_field(
+    const struct mulder_geomagnet * geomagnet,
+    const struct mulder_position position)
+{
         struct geomagnet * g = (void *)geomagnet;
         struct mulder_enu enu;
         enum gull_return rc = gull_snapshot_field(
@@ -431,7 +1219,7 @@ struct mulder_geometry * mulder_geometry_create(
         struct mulder_geometry * geometry = malloc(
             (sizeof *geometry) + size * (sizeof *layers));
         if (geometry == NULL) {
-                mulder_error("could not allocate geometry");
+                raise_error("could not allocate geometry");
                 return NULL;
         }
 
@@ -459,25 +1247,103 @@ void mulder_geometry_destroy(struct mulder_geometry ** geometry)
 }
 
 
-/* Internal data layout of a fluxmeter */
+/* Pumas physics, shared between fluxmeters (using a registry) */
+struct physics {
+        struct physics * next;
+        struct pumas_physics * pumas;
+        int references;
+        /* File identifiers (the modification time is in ns, since a dump
+         * might be rewritten within the same second)
+         */
+        dev_t device;
+        ino_t inode;
+        off_t size;
+        long long mtime;
+};
+
+
+/* Column index of a layered geometry, for locating points (see whereami) */
+struct column_index;
+
+/* Tabulated CSDA properties of geometry materials */
+struct csda_tables;
+
+
+/* Immutable data shared between a fluxmeter and its sessions */
+struct fluxmeter_shared {
+        int references;
+        struct physics * physics;
+        double zmax;
+        struct column_index * columns; /* might be NULL */
+        struct csda_tables * csda; /* might be NULL */
+        /* Empty geometry placeholder */
+        struct mulder_geometry empty_geometry;
+};
+
+
+/* Antithetic sampling modes, for random deviates drawn by Pumas */
+enum antithetic_mode {
+        ANTITHETIC_DISABLED = 0,
+        ANTITHETIC_RECORD,
+        ANTITHETIC_REPLAY
+};
+
+
+/* Cache of Turtle steppers, indexed by a reference height */
+#define STEPPER_CACHE 4
+
+struct stepper_cache {
+        int size;
+        int next; /* next slot to recycle, once full */
+        double height[STEPPER_CACHE];
+        struct turtle_stepper * stepper[STEPPER_CACHE];
+};
+
+
+/* Counter based PRNG (Philox4x32-10). The 128-bit counter is made of a
+ * 64-bit draw index and of a 64-bit substream index.
+ */
+struct philox {
+        struct mulder_prng api;
+        uint32_t key[2];
+        uint64_t draw;
+        uint64_t substream;
+        double buffer; /* second double of the last block, if available */
+        int buffered;
+        /* Main stream state (saved while a substream is selected) */
+        uint64_t main_draw;
+        double main_buffer;
+        int main_buffered;
+};
+
+
+/* Internal data layout of a fluxmeter (session) */
+struct state;
+
 struct fluxmeter {
         struct mulder_fluxmeter api;
         struct mulder_prng prng;
+        struct philox philox;
+        struct fluxmeter_shared * shared;
         /* Pumas related objects */
         struct pumas_physics * physics;
         struct pumas_context * context;
         double (*context_random)(struct pumas_context * context);
-        /* Steppers related data */
+        /* Steppers related data (current steppers belong to caches) */
         struct turtle_stepper * layers_stepper;
         struct turtle_stepper * opensky_stepper;
-        double zmax;
+        struct stepper_cache layers_steppers;
+        struct stepper_cache opensky_steppers;
         double ztop;
         double zref;
         double zref_min;
         double zref_max;
         int use_external_layer;
-        /* Empty geometry placeholder */
-        struct mulder_geometry empty_geometry;
+        /* Transport kernel, specialised per batch (see init_batch) */
+        int (*transport_backward)(
+            struct fluxmeter * fluxmeter,
+            struct state * state,
+            int underground);
         /* Defaukt reference placeholder */
         struct mulder_reference default_reference;
         /* Geomagnet related data */
@@ -486,12 +1352,43 @@ struct fluxmeter {
         double geomagnet_field[3];
         double geomagnet_position[3];
         int use_geomagnet;
+        /* Antithetic sampling (see mulder_fluxmeter_estimate) */
+        enum antithetic_mode antithetic;
+        int antithetic_size;
+        int antithetic_index;
+        int antithetic_capacity;
+        double * antithetic_values;
+        /* Persistent sessions (see mulder_fluxmeter_session_get) */
+        int n_sessions;
+        struct mulder_fluxmeter ** sessions;
         /* Layers data */
         struct pumas_medium atmosphere_medium;
         struct pumas_medium layers_media[];
 };
 
 
+/* Instrumentation (no-op if disabled) */
+#define STATS_COUNT(FLUXMETER, FIELD)                                          \
+do {                                                                           \
+        if ((FLUXMETER)->api.stats != NULL) (FLUXMETER)->api.stats->FIELD++;   \
+} while (0)
+
+#define STATS_TIME(FLUXMETER, FIELD, T0)                                       \
+do {                                                                           \
+        if ((FLUXMETER)->api.stats != NULL) {                                  \
+                (FLUXMETER)->api.stats->FIELD += stats_clock(FLUXMETER) - T0;  \
+        }                                                                      \
+} while (0)
+
+static double stats_clock(const struct fluxmeter * fluxmeter)
+{
+        if (fluxmeter->api.stats == NULL) return 0.;
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + 1E-09 * ts.tv_nsec;
+}
+
+
 /* Prototypes of local functions & data for the fluxmeter implementation */
 static double layers_locals(
     struct pumas_medium * medium,
@@ -499,13 +1396,29 @@ static double layers_locals(
     struct pumas_locals * locals
 );
 
-static double atmosphere_locals(
+/* Callbacks are specialised w.r.t. the geomagnet usage (atmosphere) and
+ * w.r.t. the external layer usage (layers). See init_batch and init_state.
+ */
+static double atmosphere_locals_plain(
+    struct pumas_medium * medium,
+    struct pumas_state * state,
+    struct pumas_locals * locals
+);
+
+static double atmosphere_locals_geomagnet(
     struct pumas_medium * medium,
     struct pumas_state * state,
     struct pumas_locals * locals
 );
 
-static enum pumas_step layers_geometry(
+static enum pumas_step layers_geometry_internal(
+    struct pumas_context * context,
+    struct pumas_state * state,
+    struct pumas_medium ** medium,
+    double * step
+);
+
+static enum pumas_step layers_geometry_external(
     struct pumas_context * context,
     struct pumas_state * state,
     struct pumas_medium ** medium,
@@ -521,6 +1434,18 @@ static enum pumas_step opensky_geometry(
 
 static void update_steppers(struct fluxmeter * fluxmeter);
 
+static void stepper_cache_clear(struct stepper_cache * cache);
+
+static struct physics * physics_acquire(const char * path);
+
+static void physics_release(struct physics ** physics);
+
+static void initialise_session(struct fluxmeter * fluxmeter);
+
+static void session_sync(
+    struct fluxmeter * session,
+    const struct fluxmeter * parent);
+
 static double random_pumas(struct pumas_context * context);
 
 static unsigned long get_seed(struct mulder_prng * prng);
@@ -532,6 +1457,18 @@ static void set_seed(
 
 static double uniform01(struct mulder_prng * prng);
 
+static void philox_initialise(struct philox * philox, unsigned long seed);
+
+static struct column_index * column_index_create(
+    const struct mulder_geometry * geometry);
+
+static void column_index_destroy(struct column_index ** index);
+
+static struct csda_tables * csda_tables_create(
+    const struct fluxmeter * fluxmeter);
+
+static void csda_tables_destroy(struct csda_tables ** tables);
+
 static struct mulder_reference default_reference;
 
 
@@ -541,67 +1478,58 @@ struct mulder_fluxmeter * mulder_fluxmeter_create(
     struct mulder_geometry * geometry)
 {
         /* Allocate memory */
-        struct fluxmeter * fluxmeter;
+        const int size = (geometry == NULL) ? 0 : geometry->size;
+        struct fluxmeter * fluxmeter = malloc(
+            (sizeof *fluxmeter) + size * (sizeof *fluxmeter->layers_media));
+        struct fluxmeter_shared * shared = malloc(sizeof *shared);
+        if ((fluxmeter == NULL) || (shared == NULL)) {
+                free(fluxmeter);
+                free(shared);
+                raise_error("could not allocate memory");
+                return NULL;
+        }
+        fluxmeter->n_sessions = 0;
+        fluxmeter->sessions = NULL;
+        shared->references = 1;
         if (geometry == NULL) {
-                fluxmeter = malloc(sizeof *fluxmeter);
-                geometry = &fluxmeter->empty_geometry;
+                geometry = &shared->empty_geometry;
                 geometry->geomagnet = NULL;
                 geometry->atmosphere = &default_atmosphere;
                 init_int((int *)&geometry->size, 0);
-        } else {
-                fluxmeter = malloc(
-                    (sizeof *fluxmeter) +
-                    geometry->size * (sizeof *fluxmeter->layers_media)
-                );
         }
-        const int size = geometry->size;
 
-        /* Initialise PUMAS related data */
-        FILE * fid = fopen(physics, "r");
-        if (fid == NULL) {
-                free(fluxmeter);
-                MULDER_ERROR(
-                    "could not open physics (%s)",
-                    strlen(physics),
-                    physics
-                );
-                return NULL;
-        }
-        pumas_error_catch(1);
-        if (pumas_physics_load(&fluxmeter->physics, fid) !=
-            PUMAS_RETURN_SUCCESS) {
-                fclose(fid);
+        /* Initialise PUMAS related data (physics are shared between
+         * fluxmeters, if already loaded)
+         */
+        shared->physics = physics_acquire(physics);
+        if (shared->physics == NULL) {
+                free(shared);
                 free(fluxmeter);
-                pumas_error_raise();
                 return NULL;
         }
-        fclose(fid);
-        pumas_error_catch(0);
-        pumas_context_create(&fluxmeter->context, fluxmeter->physics, 0);
-
-        fluxmeter->context->user_data = fluxmeter;
-        fluxmeter->context_random = fluxmeter->context->random;
-        fluxmeter->context->random = &random_pumas;
-        fluxmeter->context->mode.scattering = PUMAS_MODE_DISABLED;
-        fluxmeter->context->mode.decay = PUMAS_MODE_DISABLED;
+        fluxmeter->physics = shared->physics->pumas;
 
         struct mulder_layer * const * layers = geometry->layers;
         int i;
-        fluxmeter->zmax = ZMIN;
+        shared->zmax = ZMIN;
         for (i = 0; i < size; i++) {
-                pumas_error_catch(1);
+                const int caught = catch_begin();
                 if (pumas_physics_material_index(fluxmeter->physics,
                     layers[i]->material, &fluxmeter->layers_media[i].material)
                     != PUMAS_RETURN_SUCCESS) {
+                        catch_end(caught, 1);
+                        physics_release(&shared->physics);
+                        free(shared);
                         free(fluxmeter);
-                        pumas_error_raise();
                         return NULL;
                 }
-                pumas_error_catch(0);
+                catch_end(caught, 0);
                 fluxmeter->layers_media[i].locals = &layers_locals;
-                if (layers[i]->zmax > fluxmeter->zmax) {
-                        fluxmeter->zmax = layers[i]->zmax;
+                if (layers[i]->zmax > shared->zmax) {
+                        shared->zmax = layers[i]->zmax;
                 } else if (layers[i]->zmin < ZMIN) {
+                        physics_release(&shared->physics);
+                        free(shared);
                         free(fluxmeter);
                         MULDER_ERROR(
                             "bad layer height (%g)",
@@ -612,23 +1540,36 @@ struct mulder_fluxmeter * mulder_fluxmeter_create(
                 }
         }
 
-        pumas_error_catch(1);
+        const int caught = catch_begin();
         if (pumas_physics_material_index(fluxmeter->physics,
             "Air", &fluxmeter->atmosphere_medium.material) !=
             PUMAS_RETURN_SUCCESS) {
+                catch_end(caught, 1);
+                physics_release(&shared->physics);
+                free(shared);
                 free(fluxmeter);
-                pumas_error_raise();
                 return NULL;
         }
-        pumas_error_catch(0);
-        fluxmeter->atmosphere_medium.locals = &atmosphere_locals;
+        catch_end(caught, 0);
+        fluxmeter->atmosphere_medium.locals = &atmosphere_locals_plain;
+
+        /* Index layers by columns (if applicable) */
+        shared->columns = column_index_create(geometry);
+
+        /* Tabulate CSDA properties of materials */
+        shared->csda = csda_tables_create(fluxmeter);
 
         /* Initialise non-mutable settings */
+        fluxmeter->shared = shared;
         init_string((void **)&fluxmeter->api.physics, physics);
         init_ptr((void **)&fluxmeter->api.geometry, geometry);
 
         /* Initialise transport mode etc. */
         fluxmeter->api.mode = MULDER_CONTINUOUS;
+        fluxmeter->api.stats = NULL;
+        fluxmeter->api.share_underground = 0;
+        fluxmeter->api.use_ranges = 0;
+        fluxmeter->api.use_pruning = 0;
 
         /* Initialise reference flux */
         memcpy(
@@ -637,159 +1578,775 @@ struct mulder_fluxmeter * mulder_fluxmeter_create(
             sizeof default_reference
         );
         fluxmeter->api.reference = &fluxmeter->default_reference;
-        fluxmeter->zref = 0.;
-        fluxmeter->zref_min = DBL_MAX;
-        fluxmeter->zref_max = -DBL_MAX;
-
-        /* Initialise Turtle stepper(s) */
-        fluxmeter->layers_stepper = NULL;
-        fluxmeter->opensky_stepper = NULL;
-        fluxmeter->use_external_layer = 0;
-        update_steppers(fluxmeter);
 
         /* Initialise PRNG API */
         fluxmeter->api.prng = &fluxmeter->prng;
         fluxmeter->prng.get_seed = &get_seed;
         fluxmeter->prng.set_seed = &set_seed;
         fluxmeter->prng.uniform01 = &uniform01;
+        fluxmeter->prng.uniform01_v = NULL;
+        fluxmeter->prng.set_substream = NULL;
 
-        /* Initialise geomagnet */
-        fluxmeter->current_geomagnet = NULL;
-        fluxmeter->geomagnet_workspace = NULL;
-        memset(fluxmeter->geomagnet_field, 0x0,
-            sizeof(fluxmeter->geomagnet_field));
-        memset(fluxmeter->geomagnet_position, 0x0,
-            sizeof(fluxmeter->geomagnet_position));
-        fluxmeter->use_geomagnet = 0;
+        /* Initialise session data (Pumas context, steppers, etc.) */
+        initialise_session(fluxmeter);
+
+        /* Initialise the Philox PRNG (seeded from the Pumas one) */
+        philox_initialise(&fluxmeter->philox, get_seed(&fluxmeter->prng));
 
         return &fluxmeter->api;
 }
 
 
-void mulder_fluxmeter_destroy(struct mulder_fluxmeter ** fluxmeter)
+/* Library entry point for getting built-in PRNGs */
+struct mulder_prng * mulder_fluxmeter_prng(
+    struct mulder_fluxmeter * fluxmeter,
+    enum mulder_prng_type type)
 {
-        if ((fluxmeter == NULL) || (*fluxmeter == NULL)) return;
-        struct fluxmeter * f = (void *)(*fluxmeter);
+        struct fluxmeter * f = (void *)fluxmeter;
+        if (type == MULDER_MERSENNE_TWISTER) {
+                return &f->prng;
+        } else if (type == MULDER_PHILOX) {
+                return &f->philox.api;
+        } else {
+                MULDER_ERROR("bad PRNG type (%d)", 16, (int)type);
+                return NULL;
+        }
+}
 
-        pumas_context_destroy(&f->context);
-        pumas_physics_destroy(&f->physics);
-        turtle_stepper_destroy(&f->layers_stepper);
-        turtle_stepper_destroy(&f->opensky_stepper);
 
-        free((void *)f->api.physics);
-        free(f->physics);
-        free(f->geomagnet_workspace);
-        free(f);
-        *fluxmeter = NULL;
+/* Library entry point for creating a fluxmeter session */
+struct mulder_fluxmeter * mulder_fluxmeter_session_create(
+    struct mulder_fluxmeter * fluxmeter)
+{
+        /* Copy the parent's data */
+        struct fluxmeter * parent = (void *)fluxmeter;
+        const size_t size = (sizeof *parent) +
+            fluxmeter->geometry->size * (sizeof *parent->layers_media);
+        struct fluxmeter * f = malloc(size);
+        if (f == NULL) {
+                raise_error("could not allocate memory");
+                return NULL;
+        }
+        memcpy(f, parent, size);
+
+        /* Share immutable data */
+        __sync_add_and_fetch(&f->shared->references, 1);
+        init_string((void **)&f->api.physics, fluxmeter->physics);
+
+        /* Mirror mutable settings, using own placeholders if needed */
+        session_sync(f, parent);
+        f->n_sessions = 0;
+        f->sessions = NULL;
+
+        /* Initialise session data (Pumas context, steppers, etc.), without
+         * counting into the parent's counters
+         */
+        struct mulder_stats * stats = f->api.stats;
+        f->api.stats = NULL;
+        initialise_session(f);
+        f->api.stats = stats;
+
+        return &f->api;
 }
 
 
-/* Update Turtle steppers for the layered & opensky geometries */
-static void update_steppers(struct fluxmeter * fluxmeter)
+struct mulder_fluxmeter * mulder_fluxmeter_session_get(
+    struct mulder_fluxmeter * fluxmeter,
+    int index)
 {
-        /* Reset history (local transform) */
-        if (fluxmeter->layers_stepper != NULL) {
-                turtle_stepper_reset(fluxmeter->layers_stepper);
+        struct fluxmeter * parent = (void *)fluxmeter;
+        if (index < 0) {
+                MULDER_ERROR("bad session index (%d)", 16, index);
+                return NULL;
+        } else if (index >= parent->n_sessions) {
+                const int n = index + 1;
+                struct mulder_fluxmeter ** sessions = realloc(
+                    parent->sessions, n * sizeof *sessions);
+                if (sessions == NULL) {
+                        raise_error("could not allocate memory");
+                        return NULL;
+                }
+                memset(sessions + parent->n_sessions, 0x0,
+                    (n - parent->n_sessions) * sizeof *sessions);
+                parent->sessions = sessions;
+                parent->n_sessions = n;
         }
-        if (fluxmeter->opensky_stepper != NULL) {
-                turtle_stepper_reset(fluxmeter->opensky_stepper);
+
+        struct mulder_fluxmeter ** session = parent->sessions + index;
+        if (*session == NULL) {
+                *session = mulder_fluxmeter_session_create(fluxmeter);
+        } else {
+                session_sync((void *)(*session), parent);
         }
+        return *session;
+}
 
-        const struct mulder_reference * const reference =
-            fluxmeter->api.reference;
-        if ((fluxmeter->zref_min == reference->height_min) &&
-            (fluxmeter->zref_max == reference->height_max)) {
-                return; /* geometry is already up-to-date */
+
+int mulder_fluxmeter_prng_owned(const struct mulder_fluxmeter * fluxmeter)
+{
+        const struct fluxmeter * f = (void *)fluxmeter;
+        return (fluxmeter->prng == &f->prng) ||
+            (fluxmeter->prng == &f->philox.api);
+}
+
+
+/* Mirror the mutable settings of a parent fluxmeter */
+static void session_sync(
+    struct fluxmeter * session,
+    const struct fluxmeter * parent)
+{
+        const struct mulder_fluxmeter * api = &parent->api;
+        session->api.mode = api->mode;
+        session->api.share_underground = api->share_underground;
+        session->api.use_ranges = api->use_ranges;
+        session->api.use_pruning = api->use_pruning;
+        session->api.stats = api->stats;
+
+        if (api->reference == &parent->default_reference) {
+                session->api.reference = &session->default_reference;
         } else {
-                fluxmeter->zref_min = reference->height_min;
-                fluxmeter->zref_max = reference->height_max;
+                session->api.reference = api->reference;
         }
-        double zref_min = reference->height_min;
-        double zref_max = reference->height_max;
-        if (zref_min > zref_max) {
-                const double tmp = zref_min;
-                zref_min = zref_max;
-                zref_max = tmp;
+        if (api->prng == &parent->prng) {
+                session->api.prng = &session->prng;
+        } else if (api->prng == &parent->philox.api) {
+                /* Mirror the parent's key and stream state as well */
+                session->philox = parent->philox;
+                session->api.prng = &session->philox.api;
+        } else {
+                session->api.prng = api->prng;
         }
+}
 
-        /* Destroy previous steppers */
-        turtle_stepper_destroy(&fluxmeter->layers_stepper);
-        turtle_stepper_destroy(&fluxmeter->opensky_stepper);
 
-        /* Create stepper for the layered geometry */
-        turtle_stepper_create(&fluxmeter->layers_stepper);
-        turtle_stepper_add_flat(fluxmeter->layers_stepper, ZMIN);
+void mulder_fluxmeter_destroy(struct mulder_fluxmeter ** fluxmeter)
+{
+        if ((fluxmeter == NULL) || (*fluxmeter == NULL)) return;
+        struct fluxmeter * f = (void *)(*fluxmeter);
 
-        struct mulder_geometry * geometry = fluxmeter->api.geometry;
         int i;
-        for (i = 0; i < geometry->size; i++) {
-                turtle_stepper_add_layer(fluxmeter->layers_stepper);
-                struct layer * l = (void *)geometry->layers[i];
-                if (l->api.model == NULL) {
-                        turtle_stepper_add_flat(
-                            fluxmeter->layers_stepper, l->api.offset);
-                } else {
-                        turtle_stepper_add_map(
-                            fluxmeter->layers_stepper, l->map, l->api.offset);
-                }
+        for (i = 0; i < f->n_sessions; i++) {
+                mulder_fluxmeter_destroy(f->sessions + i);
         }
+        free(f->sessions);
 
-        if (fluxmeter->zmax <= zref_min) {
-                fluxmeter->ztop = zref_min;
-                fluxmeter->zref = zref_min;
-        } else if (fluxmeter->zmax <= zref_max) {
-                fluxmeter->ztop = fluxmeter->zmax;
-                fluxmeter->zref = fluxmeter->zmax;
-        } else {
-                fluxmeter->ztop = fluxmeter->zmax;
-                fluxmeter->zref = zref_max;
+        pumas_context_destroy(&f->context);
+        stepper_cache_clear(&f->layers_steppers);
+        stepper_cache_clear(&f->opensky_steppers);
+        f->layers_stepper = NULL;
+        f->opensky_stepper = NULL;
+
+        if (__sync_sub_and_fetch(&f->shared->references, 1) == 0) {
+                physics_release(&f->shared->physics);
+                column_index_destroy(&f->shared->columns);
+                csda_tables_destroy(&f->shared->csda);
+                free(f->shared);
         }
 
-        turtle_stepper_add_layer(fluxmeter->layers_stepper);
-        turtle_stepper_add_flat(fluxmeter->layers_stepper, fluxmeter->ztop);
+        free((void *)f->api.physics);
+        free(f->geomagnet_workspace);
+        free(f->antithetic_values);
+        free(f);
+        *fluxmeter = NULL;
+}
+
+
+/* Initialise the session data of a fluxmeter (i.e. mutable data) */
+static void initialise_session(struct fluxmeter * fluxmeter)
+{
+        /* Create a Pumas context */
+        pumas_context_create(&fluxmeter->context, fluxmeter->physics, 0);
+
+        fluxmeter->context->user_data = fluxmeter;
+        fluxmeter->context_random = fluxmeter->context->random;
+        fluxmeter->context->random = &random_pumas;
+        fluxmeter->context->mode.scattering = PUMAS_MODE_DISABLED;
+        fluxmeter->context->mode.decay = PUMAS_MODE_DISABLED;
 
-        turtle_stepper_add_layer(fluxmeter->layers_stepper);
-        turtle_stepper_add_flat(fluxmeter->layers_stepper, ZMAX);
+        /* Initialise Turtle stepper(s) */
+        fluxmeter->layers_stepper = NULL;
+        fluxmeter->opensky_stepper = NULL;
+        memset(&fluxmeter->layers_steppers, 0x0,
+            sizeof(fluxmeter->layers_steppers));
+        memset(&fluxmeter->opensky_steppers, 0x0,
+            sizeof(fluxmeter->opensky_steppers));
+        fluxmeter->zref = 0.;
+        fluxmeter->zref_min = DBL_MAX;
+        fluxmeter->zref_max = -DBL_MAX;
+        fluxmeter->use_external_layer = 0;
+        update_steppers(fluxmeter);
 
-        /* Create stepper for the opensky geometry */
-        turtle_stepper_create(&fluxmeter->opensky_stepper);
-        turtle_stepper_add_flat(fluxmeter->opensky_stepper, fluxmeter->zref);
+        /* Initialise geomagnet cache */
+        fluxmeter->current_geomagnet = NULL;
+        fluxmeter->geomagnet_workspace = NULL;
+        memset(fluxmeter->geomagnet_field, 0x0,
+            sizeof(fluxmeter->geomagnet_field));
+        memset(fluxmeter->geomagnet_position, 0x0,
+            sizeof(fluxmeter->geomagnet_position));
+        fluxmeter->use_geomagnet = 0;
 
-        turtle_stepper_add_layer(fluxmeter->opensky_stepper);
-        turtle_stepper_add_flat(fluxmeter->opensky_stepper, ZMAX);
+        /* Initialise antithetic sampling data */
+        fluxmeter->antithetic = ANTITHETIC_DISABLED;
+        fluxmeter->antithetic_size = 0;
+        fluxmeter->antithetic_index = 0;
+        fluxmeter->antithetic_capacity = 0;
+        fluxmeter->antithetic_values = NULL;
 }
 
 
-/* Wrapper for a pumas Monte Carlo state */
-struct state {
-        struct pumas_state api;
-        struct fluxmeter * fluxmeter;
-};
+/* Registry of loaded physics */
+static struct physics * physics_registry = NULL;
 
+static pthread_mutex_t physics_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* Muon flux computation */
-static struct state init_event(
-    struct fluxmeter * fluxmeter,
-    enum mulder_pid pid,
-    struct mulder_position position,
-    struct mulder_direction direction,
-    double energy,
-    double weight
-);
 
-static struct mulder_state transport_event(
-    struct fluxmeter * fluxmeter,
+/* Modification time of a file, in ns */
+static long long stat_mtime(const struct stat * st)
+{
+#ifdef __APPLE__
+        const struct timespec * ts = &st->st_mtimespec;
+#else
+        const struct timespec * ts = &st->st_mtim;
+#endif
+        return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+
+/* Get physics from the registry, or load them if not already done */
+static struct physics * physics_acquire(const char * path)
+{
+        struct stat st;
+        if (stat(path, &st) != 0) {
+                MULDER_ERROR(
+                    "could not open physics (%s)",
+                    strlen(path),
+                    path
+                );
+                return NULL;
+        }
+
+        pthread_mutex_lock(&physics_mutex);
+        struct physics * physics;
+        for (physics = physics_registry; physics != NULL;
+             physics = physics->next) {
+                if ((physics->device == st.st_dev) &&
+                    (physics->inode == st.st_ino) &&
+                    (physics->size == st.st_size) &&
+                    (physics->mtime == stat_mtime(&st))) {
+                        physics->references++;
+                        goto exit;
+                }
+        }
+
+        FILE * fid = fopen(path, "r");
+        if (fid == NULL) {
+                MULDER_ERROR(
+                    "could not open physics (%s)",
+                    strlen(path),
+                    path
+                );
+                goto exit;
+        }
+        physics = malloc(sizeof *physics);
+        if (physics == NULL) {
+                fclose(fid);
+                raise_error("could not allocate memory");
+                goto exit;
+        }
+        const int caught = catch_begin();
+        if (pumas_physics_load(&physics->pumas, fid) !=
+            PUMAS_RETURN_SUCCESS) {
+                fclose(fid);
+                free(physics);
+                physics = NULL;
+                catch_end(caught, 1);
+                goto exit;
+        }
+        fclose(fid);
+        catch_end(caught, 0);
+
+        physics->references = 1;
+        physics->device = st.st_dev;
+        physics->inode = st.st_ino;
+        physics->size = st.st_size;
+        physics->mtime = stat_mtime(&st);
+        physics->next = physics_registry;
+        physics_registry = physics;
+exit:
+        pthread_mutex_unlock(&physics_mutex);
+        return physics;
+}
+
+
+/* Release physics, unloading them if no more used */
+static void physics_release(struct physics ** physics)
+{
+        if ((physics == NULL) || (*physics == NULL)) return;
+
+        pthread_mutex_lock(&physics_mutex);
+        struct physics * p = *physics;
+        if (--p->references == 0) {
+                struct physics ** link;
+                for (link = &physics_registry; *link != NULL;
+                     link = &(*link)->next) {
+                        if (*link == p) {
+                                *link = p->next;
+                                break;
+                        }
+                }
+                pumas_physics_destroy(&p->pumas);
+                free(p);
+        }
+        pthread_mutex_unlock(&physics_mutex);
+        *physics = NULL;
+}
+
+
+/* Tabulated CSDA properties, for fast lookups.
+ *
+ * Stopping powers, ranges and proper times are tabulated for the materials of
+ * the geometry, using log-spaced kinetic energies. Values are interpolated
+ * linearly in log-log. Outside of tables, Pumas is called instead.
+ */
+#define CSDA_EMIN 1E-02
+#define CSDA_DECADES 7
+#define CSDA_PER_DECADE 100
+#define CSDA_SIZE (CSDA_DECADES * CSDA_PER_DECADE + 1)
+
+struct csda_table {
+        double log_dedx[CSDA_SIZE];
+        double log_range[CSDA_SIZE];
+        double log_time[CSDA_SIZE];
+};
+
+struct csda_tables {
+        int size;
+        struct csda_table * tables[]; /* by Pumas index, NULL if missing */
+};
+
+static struct csda_table * csda_table_create(
+    struct pumas_physics * physics,
+    int material)
+{
+        struct csda_table * table = malloc(sizeof *table);
+        if (table == NULL) return NULL;
+
+        int i;
+        for (i = 0; i < CSDA_SIZE; i++) {
+                const double energy = CSDA_EMIN *
+                    pow(10., i / (double)CSDA_PER_DECADE);
+                double dedx, range, time;
+                if ((pumas_physics_property_stopping_power(physics,
+                        PUMAS_MODE_CSDA, material, energy, &dedx) !=
+                        PUMAS_RETURN_SUCCESS) ||
+                    (pumas_physics_property_range(physics,
+                        PUMAS_MODE_CSDA, material, energy, &range) !=
+                        PUMAS_RETURN_SUCCESS) ||
+                    (pumas_physics_property_proper_time(physics,
+                        PUMAS_MODE_CSDA, material, energy, &time) !=
+                        PUMAS_RETURN_SUCCESS) ||
+                    (dedx <= 0.) || (range <= 0.) || (time <= 0.) ||
+                    ((i > 0) && (log(range) <= table->log_range[i - 1]))) {
+                        free(table);
+                        return NULL;
+                }
+                table->log_dedx[i] = log(dedx);
+                table->log_range[i] = log(range);
+                table->log_time[i] = log(time);
+        }
+        return table;
+}
+
+static struct csda_tables * csda_tables_create(
+    const struct fluxmeter * fluxmeter)
+{
+        const int size = pumas_physics_material_length(fluxmeter->physics);
+        if (size <= 0) return NULL;
+        struct csda_tables * tables = calloc(
+            1, sizeof *tables + size * sizeof *tables->tables);
+        if (tables == NULL) return NULL; /* tables are optional */
+        tables->size = size;
+
+        /* Missing tables (e.g. out of Pumas range) fall back to Pumas */
+        const int caught = catch_begin();
+        const int n = fluxmeter->api.geometry->size;
+        int i;
+        for (i = 0; i <= n; i++) {
+                const int material = (i < n) ?
+                    fluxmeter->layers_media[i].material :
+                    fluxmeter->atmosphere_medium.material;
+                if ((material < 0) || (material >= size) ||
+                    (tables->tables[material] != NULL)) continue;
+                tables->tables[material] = csda_table_create(
+                    fluxmeter->physics, material);
+        }
+        catch_end(caught, 0);
+
+        return tables;
+}
+
+static void csda_tables_destroy(struct csda_tables ** tables)
+{
+        if ((tables == NULL) || (*tables == NULL)) return;
+        int i;
+        for (i = 0; i < (*tables)->size; i++) {
+                free((*tables)->tables[i]);
+        }
+        free(*tables);
+        *tables = NULL;
+}
+
+static const struct csda_table * csda_table(
+    const struct fluxmeter * f,
+    int material)
+{
+        const struct csda_tables * tables = f->shared->csda;
+        return ((tables != NULL) && (material >= 0) &&
+            (material < tables->size)) ? tables->tables[material] : NULL;
+}
+
+/* Interpolate a table column, returning 0 outside of the table */
+static int csda_interpolate(
+    const double * column,
+    double energy,
+    double * value)
+{
+        const double h = log10(energy / CSDA_EMIN) * CSDA_PER_DECADE;
+        if (!(h >= 0.) || (h > CSDA_SIZE - 1)) return 0;
+        int i = (int)h;
+        if (i > CSDA_SIZE - 2) i = CSDA_SIZE - 2;
+        const double u = h - i;
+        *value = exp(column[i] * (1. - u) + column[i + 1] * u);
+        return 1;
+}
+
+static enum pumas_return csda_stopping_power(
+    const struct fluxmeter * f,
+    int material,
+    double energy,
+    double * dedx)
+{
+        const struct csda_table * table = csda_table(f, material);
+        if ((table != NULL) &&
+            csda_interpolate(table->log_dedx, energy, dedx)) {
+                return PUMAS_RETURN_SUCCESS;
+        } else {
+                return pumas_physics_property_stopping_power(f->physics,
+                    PUMAS_MODE_CSDA, material, energy, dedx);
+        }
+}
+
+static enum pumas_return csda_range(
+    const struct fluxmeter * f,
+    int material,
+    double energy,
+    double * range)
+{
+        const struct csda_table * table = csda_table(f, material);
+        if ((table != NULL) &&
+            csda_interpolate(table->log_range, energy, range)) {
+                return PUMAS_RETURN_SUCCESS;
+        } else {
+                return pumas_physics_property_range(f->physics,
+                    PUMAS_MODE_CSDA, material, energy, range);
+        }
+}
+
+static enum pumas_return csda_proper_time(
+    const struct fluxmeter * f,
+    int material,
+    double energy,
+    double * time)
+{
+        const struct csda_table * table = csda_table(f, material);
+        if ((table != NULL) &&
+            csda_interpolate(table->log_time, energy, time)) {
+                return PUMAS_RETURN_SUCCESS;
+        } else {
+                return pumas_physics_property_proper_time(f->physics,
+                    PUMAS_MODE_CSDA, material, energy, time);
+        }
+}
+
+/* Kinetic energy from range, inverting the (monotone) range table */
+static enum pumas_return csda_kinetic_energy(
+    const struct fluxmeter * f,
+    int material,
+    double range,
+    double * energy)
+{
+        const struct csda_table * table = csda_table(f, material);
+        const double r = (range > 0.) ? log(range) : -DBL_MAX;
+        if ((table != NULL) && (r >= table->log_range[0]) &&
+            (r <= table->log_range[CSDA_SIZE - 1])) {
+                int lo = 0, hi = CSDA_SIZE - 1;
+                while (hi - lo > 1) {
+                        const int mid = (lo + hi) / 2;
+                        if (table->log_range[mid] > r) hi = mid;
+                        else lo = mid;
+                }
+                const double u = (r - table->log_range[lo]) /
+                    (table->log_range[hi] - table->log_range[lo]);
+                *energy = CSDA_EMIN * pow(10.,
+                    (lo + u) / (double)CSDA_PER_DECADE);
+                return PUMAS_RETURN_SUCCESS;
+        }
+        return pumas_physics_property_kinetic_energy(f->physics,
+            PUMAS_MODE_CSDA, material, range, energy);
+}
+
+
+/* Turtle steppers for the layered & opensky geometries.
+ *
+ * The layered geometry depends on reference heights only through its top
+ * height (ztop), while the opensky geometry depends only on the reference
+ * height (zref). Thus, steppers are cached w.r.t. these heights. When a
+ * reference is changed, e.g. when scanning several references, cached
+ * steppers are reused instead of rebuilding the layered geometry.
+ */
+static struct turtle_stepper * stepper_cache_get(
+    struct stepper_cache * cache,
+    double height)
+{
+        int i;
+        for (i = 0; i < cache->size; i++) {
+                if (cache->height[i] == height) return cache->stepper[i];
+        }
+        return NULL;
+}
+
+static void stepper_cache_add(
+    struct stepper_cache * cache,
+    double height,
+    struct turtle_stepper * stepper,
+    const struct turtle_stepper * current)
+{
+        int i;
+        if (cache->size < STEPPER_CACHE) {
+                i = cache->size++;
+        } else {
+                /* Recycle the oldest slot, keeping the current stepper */
+                i = cache->next;
+                if (cache->stepper[i] == current) {
+                        i = (i + 1) % STEPPER_CACHE;
+                }
+                cache->next = (i + 1) % STEPPER_CACHE;
+                turtle_stepper_destroy(&cache->stepper[i]);
+        }
+        cache->height[i] = height;
+        cache->stepper[i] = stepper;
+}
+
+static void stepper_cache_clear(struct stepper_cache * cache)
+{
+        int i;
+        for (i = 0; i < cache->size; i++) {
+                turtle_stepper_destroy(&cache->stepper[i]);
+        }
+        cache->size = 0;
+        cache->next = 0;
+}
+
+static struct turtle_stepper * create_layers_stepper(
+    struct fluxmeter * fluxmeter,
+    double ztop)
+{
+        struct turtle_stepper * stepper;
+        turtle_stepper_create(&stepper);
+        turtle_stepper_add_flat(stepper, ZMIN);
+
+        struct mulder_geometry * geometry = fluxmeter->api.geometry;
+        int i;
+        for (i = 0; i < geometry->size; i++) {
+                turtle_stepper_add_layer(stepper);
+                struct layer * l = (void *)geometry->layers[i];
+                if (l->stack != NULL) {
+                        turtle_stepper_add_stack(stepper, l->stack,
+                            l->api.offset);
+                } else if (l->api.model == NULL) {
+                        turtle_stepper_add_flat(stepper, l->api.offset);
+                } else {
+                        turtle_stepper_add_map(stepper, l->map,
+                            l->api.offset);
+
+                        /* Fallback maps are used where previous ones do not
+                         * apply, e.g. far from the observer
+                         */
+                        int j;
+                        for (j = 0; j < l->n_fallbacks; j++) {
+                                turtle_stepper_add_map(stepper,
+                                    l->fallbacks[j], l->api.offset);
+                        }
+                }
+        }
+
+        turtle_stepper_add_layer(stepper);
+        turtle_stepper_add_flat(stepper, ztop);
+
+        turtle_stepper_add_layer(stepper);
+        turtle_stepper_add_flat(stepper, ZMAX);
+
+        return stepper;
+}
+
+static struct turtle_stepper * create_opensky_stepper(double zref)
+{
+        struct turtle_stepper * stepper;
+        turtle_stepper_create(&stepper);
+        turtle_stepper_add_flat(stepper, zref);
+
+        turtle_stepper_add_layer(stepper);
+        turtle_stepper_add_flat(stepper, ZMAX);
+
+        return stepper;
+}
+
+static void rebuild_steppers(struct fluxmeter * fluxmeter)
+{
+        const struct mulder_reference * const reference =
+            fluxmeter->api.reference;
+        fluxmeter->zref_min = reference->height_min;
+        fluxmeter->zref_max = reference->height_max;
+        STATS_COUNT(fluxmeter, stepper_updates);
+
+        double zref_min = reference->height_min;
+        double zref_max = reference->height_max;
+        if (zref_min > zref_max) {
+                const double tmp = zref_min;
+                zref_min = zref_max;
+                zref_max = tmp;
+        }
+
+        if (fluxmeter->shared->zmax <= zref_min) {
+                fluxmeter->ztop = zref_min;
+                fluxmeter->zref = zref_min;
+        } else if (fluxmeter->shared->zmax <= zref_max) {
+                fluxmeter->ztop = fluxmeter->shared->zmax;
+                fluxmeter->zref = fluxmeter->shared->zmax;
+        } else {
+                fluxmeter->ztop = fluxmeter->shared->zmax;
+                fluxmeter->zref = zref_max;
+        }
+
+        /* Fetch steppers from caches, or create them */
+        struct turtle_stepper * stepper = stepper_cache_get(
+            &fluxmeter->layers_steppers, fluxmeter->ztop);
+        if (stepper == NULL) {
+                stepper = create_layers_stepper(fluxmeter, fluxmeter->ztop);
+                stepper_cache_add(&fluxmeter->layers_steppers,
+                    fluxmeter->ztop, stepper, fluxmeter->layers_stepper);
+        }
+        fluxmeter->layers_stepper = stepper;
+
+        stepper = stepper_cache_get(
+            &fluxmeter->opensky_steppers, fluxmeter->zref);
+        if (stepper == NULL) {
+                stepper = create_opensky_stepper(fluxmeter->zref);
+                stepper_cache_add(&fluxmeter->opensky_steppers,
+                    fluxmeter->zref, stepper, fluxmeter->opensky_stepper);
+        }
+        fluxmeter->opensky_stepper = stepper;
+
+        /* Reset history (local transform) */
+        turtle_stepper_reset(fluxmeter->layers_stepper);
+        turtle_stepper_reset(fluxmeter->opensky_stepper);
+}
+
+/* Update Turtle steppers, if the reference heights have changed. Otherwise,
+ * only the steppers history is reset.
+ */
+static void update_steppers(struct fluxmeter * fluxmeter)
+{
+        const struct mulder_reference * const reference =
+            fluxmeter->api.reference;
+        if ((fluxmeter->zref_min != reference->height_min) ||
+            (fluxmeter->zref_max != reference->height_max)) {
+                rebuild_steppers(fluxmeter);
+        } else {
+                /* Reset history (local transform) */
+                turtle_stepper_reset(fluxmeter->layers_stepper);
+                turtle_stepper_reset(fluxmeter->opensky_stepper);
+        }
+}
+
+
+/* Wrapper for a pumas Monte Carlo state */
+struct state {
+        struct pumas_state api;
+        struct fluxmeter * fluxmeter;
+};
+
+
+/* Muon flux computation */
+static void init_batch(struct fluxmeter * fluxmeter);
+
+static struct state init_state(
+    struct fluxmeter * fluxmeter,
+    enum mulder_pid pid,
+    double height,
+    const double position[3],
+    const double direction[3],
+    double energy,
+    double weight
+);
+
+static struct state init_event(
+    struct fluxmeter * fluxmeter,
+    enum mulder_pid pid,
+    struct mulder_position position,
+    struct mulder_direction direction,
+    double energy,
+    double weight
+);
+
+static struct mulder_state transport_event(
+    struct fluxmeter * fluxmeter,
     struct mulder_position position,
     struct state state
 );
 
+static int transport_backward_continuous(
+    struct fluxmeter * fluxmeter,
+    struct state * state,
+    int underground
+);
+
+static int transport_backward_mixed(
+    struct fluxmeter * fluxmeter,
+    struct state * state,
+    int underground
+);
+
+static int transport_backward_discrete(
+    struct fluxmeter * fluxmeter,
+    struct state * state,
+    int underground
+);
+
+/* Sample the reference flux (with instrumentation) */
+static struct mulder_flux sample_reference(
+    struct fluxmeter * f,
+    struct mulder_state state)
+{
+        const double t0 = stats_clock(f);
+        struct mulder_flux result = mulder_state_flux(state, f->api.reference);
+        STATS_TIME(f, time_reference, t0);
+        return result;
+}
+
+static struct mulder_flux flux_event(
+    struct fluxmeter * f,
+    const struct mulder_state initial,
+    struct state s);
+
+static int prune_event(struct fluxmeter * f, const struct state * s);
+
 struct mulder_flux mulder_fluxmeter_flux(
     struct mulder_fluxmeter * fluxmeter,
     const struct mulder_state initial)
 {
         /* Initialise the geometry etc. */
         struct fluxmeter * f = (void *)fluxmeter;
-        struct mulder_flux result = {0.};
         struct state s = init_event(
             f,
             MULDER_MUON,
@@ -798,12 +2355,28 @@ struct mulder_flux mulder_fluxmeter_flux(
             initial.energy,
             initial.weight
         );
+        return flux_event(f, initial, s);
+}
+
+static struct mulder_flux flux_event(
+    struct fluxmeter * f,
+    const struct mulder_state initial,
+    struct state s)
+{
+        struct mulder_flux result = {0.};
         if (s.api.weight <= 0.) {
                 return result;
         }
 
+        /* Reject hopeless events before any transport (see prune_event) */
+        if (f->api.use_pruning && (f->api.mode != MULDER_DISCRETE) &&
+            (initial.position.height < f->ztop - FLT_EPSILON) &&
+            prune_event(f, &s)) {
+                STATS_COUNT(f, pruned);
+                return result;
+        }
+
         /* Sample the reference flux */
-        struct mulder_reference * reference = f->api.reference;
         if (initial.pid == MULDER_ANY) {
                 if (f->api.geometry->geomagnet == NULL) {
                         struct mulder_state state =
@@ -812,13 +2385,40 @@ struct mulder_flux mulder_fluxmeter_flux(
                                 return result;
                         }
                         state.pid = MULDER_ANY;
-                        return mulder_state_flux(state, reference);
+                        return sample_reference(f, state);
                 } else {
+                        struct mulder_position start = initial.position;
+                        if (f->api.share_underground &&
+                            (start.height < f->ztop - FLT_EPSILON)) {
+                                /* Transport the underground leg once, for
+                                 * both charges (no field in layers media)
+                                 */
+                                const int rc = f->transport_backward(f, &s, 1);
+                                if (rc < 0) {
+                                        return result;
+                                } else if (rc == 0) {
+                                        /* The geometry was exited directly
+                                         * (expected to be at ztop)
+                                         */
+                                        turtle_ecef_to_geodetic(
+                                            s.api.position,
+                                            &start.latitude,
+                                            &start.longitude,
+                                            &start.height);
+                                        if (fabs(start.height - f->ztop) >
+                                            1E-04) {
+                                                return result;
+                                        }
+                                        start.height = f->ztop;
+                                }
+                                turtle_stepper_reset(f->layers_stepper);
+                        }
+
                         s.api.charge = -1.;
                         struct mulder_state s0 =
-                            transport_event(f, initial.position, s);
-                        struct mulder_flux r0 = mulder_state_flux(
-                            s0, reference);
+                            transport_event(f, start, s);
+                        struct mulder_flux r0 = sample_reference(
+                            f, s0);
 
                         /* Reset steppers for numeric consistency. */
                         turtle_stepper_reset(f->layers_stepper);
@@ -826,9 +2426,9 @@ struct mulder_flux mulder_fluxmeter_flux(
 
                         s.api.charge = 1.;
                         struct mulder_state s1 =
-                            transport_event(f, initial.position, s);
-                        struct mulder_flux r1 = mulder_state_flux(
-                            s1, reference);
+                            transport_event(f, start, s);
+                        struct mulder_flux r1 = sample_reference(
+                            f, s1);
 
                         const double tmp = r0.value + r1.value;
                         if (tmp > 0.) {
@@ -848,8 +2448,91 @@ struct mulder_flux mulder_fluxmeter_flux(
                 if (state.weight <= 0.) {
                         return result;
                 }
-                return mulder_state_flux(state, reference);
+                return sample_reference(f, state);
+        }
+}
+
+
+/* Flux estimate, averaging several Monte Carlo events.
+ *
+ * Samples are accumulated using Welford's algorithm. With antithetic
+ * sampling, a sample is the average of a pair of events, where the second
+ * event replays the random deviates of the first one as 1 - u. Note that
+ * extra deviates of the second event (if any) are drawn independently.
+ */
+#define ESTIMATE_MIN_SAMPLES 16
+
+struct mulder_estimate mulder_fluxmeter_estimate(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_state state,
+    double precision,
+    long max_events,
+    int antithetic)
+{
+        struct fluxmeter * f = (void *)fluxmeter;
+        struct mulder_estimate estimate = {{0.}};
+        if (max_events <= 0) {
+                MULDER_ERROR("bad number of events (%ld)", 32, max_events);
+                return estimate;
+        }
+
+        if (fluxmeter->mode == MULDER_CONTINUOUS) {
+                /* Deterministic transport */
+                estimate.flux = mulder_fluxmeter_flux(fluxmeter, state);
+                estimate.events = 1;
+                return estimate;
+        }
+
+        long samples = 0;
+        double mean = 0., m2 = 0., mean_charge = 0.;
+        while (estimate.events < max_events) {
+                /* Sample the flux */
+                double value, charge;
+                if (antithetic && (estimate.events + 1 < max_events)) {
+                        f->antithetic = ANTITHETIC_RECORD;
+                        f->antithetic_size = 0;
+                        const struct mulder_flux f0 =
+                            mulder_fluxmeter_flux(fluxmeter, state);
+                        if (f->antithetic == ANTITHETIC_RECORD) {
+                                f->antithetic = ANTITHETIC_REPLAY;
+                        }
+                        f->antithetic_index = 0;
+                        const struct mulder_flux f1 =
+                            mulder_fluxmeter_flux(fluxmeter, state);
+                        f->antithetic = ANTITHETIC_DISABLED;
+                        value = 0.5 * (f0.value + f1.value);
+                        charge = 0.5 * (f0.value * f0.asymmetry +
+                            f1.value * f1.asymmetry);
+                        estimate.events += 2;
+                } else {
+                        const struct mulder_flux f0 =
+                            mulder_fluxmeter_flux(fluxmeter, state);
+                        value = f0.value;
+                        charge = f0.value * f0.asymmetry;
+                        estimate.events++;
+                }
+
+                /* Update statistics */
+                samples++;
+                const double delta = value - mean;
+                mean += delta / samples;
+                m2 += delta * (value - mean);
+                mean_charge += (charge - mean_charge) / samples;
+
+                /* Check the precision */
+                if ((precision > 0.) && (samples >= ESTIMATE_MIN_SAMPLES) &&
+                    (mean > 0.)) {
+                        const double variance = m2 / (samples - 1) / samples;
+                        if (variance <= precision * precision * mean * mean) {
+                                break;
+                        }
+                }
         }
+
+        estimate.flux.value = mean;
+        estimate.flux.asymmetry = (mean > 0.) ? mean_charge / mean : 0.;
+        estimate.variance = (samples > 1) ? m2 / (samples - 1) / samples : 0.;
+        return estimate;
 }
 
 
@@ -872,24 +2555,26 @@ struct mulder_flux mulder_state_flux(
 }
 
 
-struct mulder_state mulder_fluxmeter_transport(
+static int transport_pid(struct fluxmeter * f, enum mulder_pid * pid);
+
+static struct mulder_state transport_state(
+    struct fluxmeter * f,
+    const struct mulder_state state,
+    struct state s);
+
+struct mulder_state mulder_fluxmeter_transport(
     struct mulder_fluxmeter * fluxmeter,
     const struct mulder_state state)
 {
         /* Check pid */
+        struct fluxmeter * f = (void *)fluxmeter;
         enum mulder_pid pid = state.pid;
-        if (pid == MULDER_ANY) {
-                if (fluxmeter->geometry->geomagnet == NULL) {
-                        pid = MULDER_MUON;
-                } else if (fluxmeter->mode == MULDER_CONTINUOUS) {
-                        MULDER_ERROR("bad pid (%d)", 16, (int)state.pid);
-                        struct mulder_state tmp = {0.};
-                        return tmp;
-                }
+        if (transport_pid(f, &pid) != 0) {
+                struct mulder_state tmp = {0.};
+                return tmp;
         }
 
         /* Initialise the geometry etc. */
-        struct fluxmeter * f = (void *)fluxmeter;
         struct state s = init_event(
             f,
             pid,
@@ -898,17 +2583,39 @@ struct mulder_state mulder_fluxmeter_transport(
             state.energy,
             state.weight
         );
+
+        /* Transport state */
+        return transport_state(f, state, s);
+}
+
+static int transport_pid(struct fluxmeter * f, enum mulder_pid * pid)
+{
+        if (*pid == MULDER_ANY) {
+                if (f->api.geometry->geomagnet == NULL) {
+                        *pid = MULDER_MUON;
+                } else if (f->api.mode == MULDER_CONTINUOUS) {
+                        MULDER_ERROR("bad pid (%d)", 16, (int)*pid);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+static struct mulder_state transport_state(
+    struct fluxmeter * f,
+    const struct mulder_state state,
+    struct state s)
+{
         if (s.api.weight <= 0.) {
                 struct mulder_state tmp = {0.};
                 return tmp;
         }
 
-        /* Transport state */
         struct mulder_state result = transport_event(f, state.position, s);
 
         /* Restore pid, if needed */
         if ((state.pid == MULDER_ANY) &&
-            (fluxmeter->geometry->geomagnet == NULL)) {
+            (f->api.geometry->geomagnet == NULL)) {
                 result.pid = MULDER_ANY;
         }
 
@@ -916,6 +2623,321 @@ struct mulder_state mulder_fluxmeter_transport(
 }
 
 
+/* Batched computations, over columns of observation states.
+ *
+ * States are processed by blocks. Per-call settings (steppers and geomagnet)
+ * are checked once per call, and coordinates conversions are done per block
+ * (see batch_ecef below).
+ */
+#define BATCH_SIZE 32
+
+struct batch {
+        int size;
+        int pid[BATCH_SIZE];
+        double latitude[BATCH_SIZE];
+        double longitude[BATCH_SIZE];
+        double height[BATCH_SIZE];
+        double azimuth[BATCH_SIZE];
+        double elevation[BATCH_SIZE];
+        double energy[BATCH_SIZE];
+        double weight[BATCH_SIZE];
+
+        /* ECEF coordinates */
+        double position[3][BATCH_SIZE];
+        double direction[3][BATCH_SIZE];
+};
+
+static void batch_ecef(struct batch * batch);
+
+static void batch_load(
+    struct batch * batch,
+    const struct mulder_states * states,
+    int offset,
+    int size)
+{
+        const int * s = states->strides;
+        batch->size = size;
+        int i;
+        for (i = 0; i < size; i++) {
+                const int j = offset + i;
+                batch->pid[i] = (states->pid == NULL) ? MULDER_ANY :
+                    *(int *)((void *)states->pid + j * s[0]);
+                batch->latitude[i] =
+                    *(double *)((void *)states->latitude + j * s[1]);
+                batch->longitude[i] =
+                    *(double *)((void *)states->longitude + j * s[2]);
+                batch->height[i] =
+                    *(double *)((void *)states->height + j * s[3]);
+                batch->azimuth[i] =
+                    *(double *)((void *)states->azimuth + j * s[4]);
+                batch->elevation[i] =
+                    *(double *)((void *)states->elevation + j * s[5]);
+                batch->energy[i] =
+                    *(double *)((void *)states->energy + j * s[6]);
+                batch->weight[i] = (states->weight == NULL) ? 1. :
+                    *(double *)((void *)states->weight + j * s[7]);
+        }
+        batch_ecef(batch);
+}
+
+static struct mulder_state batch_get(const struct batch * batch, int i)
+{
+        struct mulder_state state = {
+                .pid = batch->pid[i],
+                .position = {
+                    batch->latitude[i],
+                    batch->longitude[i],
+                    batch->height[i]
+                },
+                .direction = {batch->azimuth[i], batch->elevation[i]},
+                .energy = batch->energy[i],
+                .weight = batch->weight[i]
+        };
+        return state;
+}
+
+static struct state batch_init(
+    struct fluxmeter * f,
+    const struct batch * batch,
+    int i,
+    enum mulder_pid pid)
+{
+        const double position[3] = {
+            batch->position[0][i],
+            batch->position[1][i],
+            batch->position[2][i]
+        };
+        const double direction[3] = {
+            batch->direction[0][i],
+            batch->direction[1][i],
+            batch->direction[2][i]
+        };
+        return init_state(f, pid, batch->height[i], position, direction,
+            batch->energy[i], batch->weight[i]);
+}
+
+static void batch_store(
+    struct mulder_states * states,
+    int index,
+    const struct mulder_state * state)
+{
+        const int * s = states->strides;
+        if (states->pid != NULL) {
+                *(int *)((void *)states->pid + index * s[0]) = state->pid;
+        }
+        *(double *)((void *)states->latitude + index * s[1]) =
+            state->position.latitude;
+        *(double *)((void *)states->longitude + index * s[2]) =
+            state->position.longitude;
+        *(double *)((void *)states->height + index * s[3]) =
+            state->position.height;
+        *(double *)((void *)states->azimuth + index * s[4]) =
+            state->direction.azimuth;
+        *(double *)((void *)states->elevation + index * s[5]) =
+            state->direction.elevation;
+        *(double *)((void *)states->energy + index * s[6]) = state->energy;
+        if (states->weight != NULL) {
+                *(double *)((void *)states->weight + index * s[7]) =
+                    state->weight;
+        }
+}
+
+void mulder_fluxmeter_flux_batch(
+    struct mulder_fluxmeter * fluxmeter,
+    int size,
+    const struct mulder_states * states,
+    struct mulder_flux * flux)
+{
+        struct fluxmeter * f = (void *)fluxmeter;
+        init_batch(f);
+
+        struct batch batch;
+        int offset;
+        for (offset = 0; offset < size; offset += BATCH_SIZE) {
+                const int n = (size - offset < BATCH_SIZE) ?
+                    size - offset : BATCH_SIZE;
+                batch_load(&batch, states, offset, n);
+                int i;
+                for (i = 0; i < n; i++, flux++) {
+                        struct state s = batch_init(f, &batch, i,
+                            MULDER_MUON);
+                        *flux = flux_event(f, batch_get(&batch, i), s);
+                }
+        }
+}
+
+void mulder_fluxmeter_transport_batch(
+    struct mulder_fluxmeter * fluxmeter,
+    int events,
+    int size,
+    const struct mulder_states * in,
+    struct mulder_states * out)
+{
+        struct fluxmeter * f = (void *)fluxmeter;
+        init_batch(f);
+
+        struct batch batch;
+        int offset, index = 0;
+        for (offset = 0; offset < size; offset += BATCH_SIZE) {
+                const int n = (size - offset < BATCH_SIZE) ?
+                    size - offset : BATCH_SIZE;
+                batch_load(&batch, in, offset, n);
+                int i;
+                for (i = 0; i < n; i++) {
+                        const struct mulder_state state =
+                            batch_get(&batch, i);
+                        enum mulder_pid pid = state.pid;
+                        const int rc = transport_pid(f, &pid);
+                        int j;
+                        for (j = 0; j < events; j++, index++) {
+                                struct mulder_state result = {0.};
+                                if (rc == 0) {
+                                        struct state s = batch_init(
+                                            f, &batch, i, pid);
+                                        result = transport_state(
+                                            f, state, s);
+                                }
+                                batch_store(out, index, &result);
+                        }
+                }
+        }
+}
+
+
+/* Monte Carlo generation of observation states */
+static int generate_check(const struct mulder_sampler * sampler,
+    const char * name)
+{
+        switch (sampler->sampling) {
+        case MULDER_FIXED:
+        case MULDER_UNIFORM:
+        case MULDER_SIN_UNIFORM:
+                return 0;
+        case MULDER_LOG_UNIFORM:
+                if (sampler->min * sampler->max > 0.) return 0;
+                MULDER_ERROR("bad %s range (%g, %g)", 64, name, sampler->min,
+                    sampler->max);
+                return -1;
+        default:
+                MULDER_ERROR("bad %s sampling (%d)", 48, name,
+                    (int)sampler->sampling);
+                return -1;
+        }
+}
+
+/* Sample a value from a uniform deviate u, updating the weight (1 / PDF) */
+static double generate_value(
+    const struct mulder_sampler * sampler,
+    double u,
+    double * weight)
+{
+        switch (sampler->sampling) {
+        case MULDER_UNIFORM: {
+                        const double dx = sampler->max - sampler->min;
+                        *weight *= fabs(dx);
+                        return sampler->min + dx * u;
+                }
+        case MULDER_LOG_UNIFORM: {
+                        const double rx = log(sampler->max / sampler->min);
+                        const double x = sampler->min * exp(rx * u);
+                        *weight *= fabs(rx * x);
+                        return x;
+                }
+        case MULDER_SIN_UNIFORM: {
+                        const double deg = M_PI / 180.;
+                        const double s0 = sin(sampler->min * deg);
+                        const double ds = sin(sampler->max * deg) - s0;
+                        *weight *= fabs(ds);
+                        return asin(s0 + ds * u) / deg;
+                }
+        default:
+                return sampler->min;
+        }
+}
+
+static double generate_deviate(
+    struct mulder_prng * prng,
+    const struct mulder_sampler * sampler)
+{
+        return (sampler->sampling == MULDER_FIXED) ?
+            0. : prng->uniform01(prng);
+}
+
+void mulder_fluxmeter_generate(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_generator * generator,
+    long events,
+    struct mulder_tally * tally)
+{
+        if ((generate_check(&generator->azimuth, "azimuth") != 0) ||
+            (generate_check(&generator->elevation, "elevation") != 0) ||
+            (generate_check(&generator->energy, "energy") != 0)) {
+                return;
+        }
+        if ((tally->bins > 0) && ((tally->variable < MULDER_AZIMUTH) ||
+            (tally->variable > MULDER_ENERGY))) {
+                MULDER_ERROR("bad histogram variable (%d)", 16,
+                    (int)tally->variable);
+                return;
+        }
+
+        struct fluxmeter * f = (void *)fluxmeter;
+        init_batch(f);
+
+        struct mulder_prng * prng = fluxmeter->prng;
+        struct batch batch;
+        double deviate[BATCH_SIZE];
+        long offset;
+        for (offset = 0; offset < events; offset += BATCH_SIZE) {
+                /* Generate a block of states */
+                const int n = (events - offset < BATCH_SIZE) ?
+                    (int)(events - offset) : BATCH_SIZE;
+                batch.size = n;
+                int i;
+                for (i = 0; i < n; i++) {
+                        double u[3];
+                        u[0] = generate_deviate(prng, &generator->azimuth);
+                        u[1] = generate_deviate(prng, &generator->elevation);
+                        u[2] = generate_deviate(prng, &generator->energy);
+                        deviate[i] = (tally->bins > 0) ?
+                            u[tally->variable] : 0.;
+
+                        double weight = 1.;
+                        batch.pid[i] = generator->pid;
+                        batch.latitude[i] = generator->position.latitude;
+                        batch.longitude[i] = generator->position.longitude;
+                        batch.height[i] = generator->position.height;
+                        batch.azimuth[i] = generate_value(
+                            &generator->azimuth, u[0], &weight);
+                        batch.elevation[i] = generate_value(
+                            &generator->elevation, u[1], &weight);
+                        batch.energy[i] = generate_value(
+                            &generator->energy, u[2], &weight);
+                        batch.weight[i] = weight;
+                }
+                batch_ecef(&batch);
+
+                /* Transport and tally */
+                for (i = 0; i < n; i++) {
+                        struct state s = batch_init(f, &batch, i,
+                            MULDER_MUON);
+                        const struct mulder_flux flux = flux_event(
+                            f, batch_get(&batch, i), s);
+                        tally->events++;
+                        tally->sum += flux.value;
+                        tally->sum2 += flux.value * flux.value;
+                        tally->asymmetry += flux.value * flux.asymmetry;
+                        if (tally->bins > 0) {
+                                int k = (int)(deviate[i] * tally->bins);
+                                if (k >= tally->bins) k = tally->bins - 1;
+                                tally->values[k] += flux.value;
+                                tally->squares[k] += flux.value * flux.value;
+                        }
+                }
+        }
+}
+
+
 /* Low level sampling routines */
 static int check_geomagnet(struct fluxmeter * fluxmeter)
 {
@@ -932,20 +2954,8 @@ static int check_geomagnet(struct fluxmeter * fluxmeter)
         }
 }
 
-static struct state init_event(
-    struct fluxmeter * f,
-    enum mulder_pid pid,
-    const struct mulder_position position,
-    const struct mulder_direction direction,
-    double energy,
-    double weight)
+static void init_batch(struct fluxmeter * f)
 {
-        struct state s = {.api = {.weight = 0.}};
-        if (energy <= 0.) {
-                MULDER_ERROR("bad kinetic energy (%g)", 32, energy);
-                return s;
-        }
-
         /* Update Turtle steppers (if the reference heights have changed) */
         update_steppers(f);
 
@@ -960,8 +2970,52 @@ static struct state init_event(
         }
         f->use_geomagnet = (f->current_geomagnet != NULL);
 
+        /* Select specialised kernels, for this batch */
+        f->atmosphere_medium.locals = f->use_geomagnet ?
+            &atmosphere_locals_geomagnet : &atmosphere_locals_plain;
+        if (f->api.mode == MULDER_CONTINUOUS) {
+                f->transport_backward = &transport_backward_continuous;
+        } else if (f->api.mode == MULDER_MIXED) {
+                f->transport_backward = &transport_backward_mixed;
+        } else {
+                f->transport_backward = &transport_backward_discrete;
+        }
+}
+
+static struct state init_state(
+    struct fluxmeter * f,
+    enum mulder_pid pid,
+    double height,
+    const double position[3],
+    const double direction[3],
+    double energy,
+    double weight)
+{
+        struct state s = {.api = {.weight = 0.}};
+        if (energy <= 0.) {
+                STATS_COUNT(f, failed_energy);
+                MULDER_ERROR("bad kinetic energy (%g)", 32, energy);
+                return s;
+        }
+
+        /* Reset steppers history, for numeric consistency between batched
+         * and unbatched computations (see update_steppers)
+         */
+        if (f->layers_stepper != NULL) {
+                turtle_stepper_reset(f->layers_stepper);
+        }
+        if (f->opensky_stepper != NULL) {
+                turtle_stepper_reset(f->opensky_stepper);
+        }
+
+        /* Invalidate the geomagnetic field cache (at Earth center), such that
+         * results do not depend on previously processed events, e.g. when
+         * dispatched over threads
+         */
+        memset(f->geomagnet_position, 0x0, sizeof f->geomagnet_position);
+
         f->context->event = PUMAS_EVENT_LIMIT_ENERGY;
-        f->use_external_layer = (position.height >= f->ztop + FLT_EPSILON);
+        f->use_external_layer = (height >= f->ztop + FLT_EPSILON);
 
         /* Initialise the muon state */
         s.api.energy = energy;
@@ -976,156 +3030,268 @@ static struct state init_event(
                 s.api.charge = (pid == MULDER_MUON) ? -1. : 1.;
         }
 
-        turtle_ecef_from_geodetic(position.latitude, position.longitude,
-            position.height, s.api.position);
-        turtle_ecef_from_horizontal(
-            position.latitude, position.longitude, direction.azimuth,
-            direction.elevation, s.api.direction);
-
         int i;
         for (i = 0; i < 3; i++) {
+                s.api.position[i] = position[i];
                 /* Revert direction, due to observer convention */
-                s.api.direction[i] = -s.api.direction[i];
+                s.api.direction[i] = -direction[i];
         }
 
         return s;
 }
 
-static struct mulder_state transport_event(
+static struct state init_event(
     struct fluxmeter * f,
-    struct mulder_position position,
-    struct state s)
+    enum mulder_pid pid,
+    const struct mulder_position position,
+    const struct mulder_direction direction,
+    double energy,
+    double weight)
 {
-        if (position.height < f->ztop - FLT_EPSILON) {
-                /* Transport backward with Pumas */
-                f->context->limit.energy = f->api.reference->energy_max;
-                if (f->api.mode == MULDER_CONTINUOUS) {
-                        f->context->mode.energy_loss = PUMAS_MODE_CSDA;
-                        f->context->mode.scattering = PUMAS_MODE_DISABLED;
-                } else if (f->api.mode == MULDER_MIXED) {
+        init_batch(f);
+
+        double r[3], u[3];
+        turtle_ecef_from_geodetic(position.latitude, position.longitude,
+            position.height, r);
+        turtle_ecef_from_horizontal(
+            position.latitude, position.longitude, direction.azimuth,
+            direction.elevation, u);
+
+        return init_state(f, pid, position.height, r, u, energy, weight);
+}
+
+/* Backward transport through the layered geometry, using Pumas.
+ *
+ * If underground is true, the transport stops when the muon enters the
+ * atmosphere, in which case 1 is returned. Otherwise, 0 is returned when the
+ * muon exits the layered geometry, or -1 on failure.
+ *
+ * The transport mode is a compile time constant for transport kernels (see
+ * below), in order to discard irrelevant branches.
+ */
+static int transport_ranges(
+    struct fluxmeter * f,
+    struct state * s,
+    int underground);
+
+static inline int transport_backward(
+    struct fluxmeter * f,
+    struct state * s,
+    int underground,
+    const enum mulder_mode mode)
+{
+        const double t0 = stats_clock(f);
+        if ((mode == MULDER_CONTINUOUS) && f->api.use_ranges &&
+            (underground || (!f->use_geomagnet &&
+            (f->api.geometry->atmosphere == &default_atmosphere)))) {
+                /* Straight lines, without Pumas stepping (see below) */
+                const int rc = transport_ranges(f, s, underground);
+                STATS_TIME(f, time_underground, t0);
+                return rc;
+        }
+
+        f->context->limit.energy = f->api.reference->energy_max;
+        if (mode == MULDER_CONTINUOUS) {
+                f->context->mode.energy_loss = PUMAS_MODE_CSDA;
+                f->context->mode.scattering = PUMAS_MODE_DISABLED;
+        } else if (mode == MULDER_MIXED) {
+                f->context->mode.energy_loss = PUMAS_MODE_MIXED;
+                f->context->mode.scattering = PUMAS_MODE_DISABLED;
+        } else {
+                /* Detailed mode */
+                if (s->api.energy <= 1E+01 - FLT_EPSILON) {
+                        f->context->mode.energy_loss = PUMAS_MODE_STRAGGLED;
+                        f->context->mode.scattering = PUMAS_MODE_MIXED;
+                        f->context->limit.energy = 1E+01;
+                } else if (s->api.energy <= 1E+02 - FLT_EPSILON) {
                         f->context->mode.energy_loss = PUMAS_MODE_MIXED;
-                        f->context->mode.scattering = PUMAS_MODE_DISABLED;
+                        f->context->mode.scattering = PUMAS_MODE_MIXED;
+                        f->context->limit.energy = 1E+02;
                 } else {
-                        /* Detailed mode */
-                        if (s.api.energy <= 1E+01 - FLT_EPSILON) {
+                        /* Mixed mode is used */
+                        f->context->mode.energy_loss = PUMAS_MODE_MIXED;
+                        f->context->mode.scattering = PUMAS_MODE_DISABLED;
+                }
+        }
+        f->context->medium = f->use_external_layer ?
+            &layers_geometry_external : &layers_geometry_internal;
+        f->context->mode.direction = PUMAS_MODE_BACKWARD;
+        f->context->event = underground ?
+            PUMAS_EVENT_LIMIT_ENERGY | PUMAS_EVENT_MEDIUM :
+            PUMAS_EVENT_LIMIT_ENERGY;
+
+        int rc = 0;
+        enum pumas_event event;
+        struct pumas_medium * media[2];
+        for (;;) {
+                STATS_COUNT(f, transports);
+                if (pumas_context_transport(
+                    f->context, &s->api, &event, media)
+                    != PUMAS_RETURN_SUCCESS) {
+                        STATS_COUNT(f, failed_transport);
+                        rc = -1;
+                        break;
+                }
+                if ((mode == MULDER_DISCRETE) &&
+                    (event == PUMAS_EVENT_LIMIT_ENERGY)) {
+                        if (s->api.energy >=
+                            f->api.reference->energy_max - FLT_EPSILON) {
+                                STATS_COUNT(f, failed_limit);
+                                rc = -1;
+                                break;
+                        } else if (s->api.energy >= 1E+02 - FLT_EPSILON) {
                                 f->context->mode.energy_loss =
-                                    PUMAS_MODE_STRAGGLED;
+                                    PUMAS_MODE_MIXED;
                                 f->context->mode.scattering =
+                                    PUMAS_MODE_DISABLED;
+                                f->context->limit.energy =
+                                    f->api.reference->energy_max;
+                                continue;
+                        } else {
+                                f->context->mode.energy_loss =
                                     PUMAS_MODE_MIXED;
-                                f->context->limit.energy = 1E+01;
-                        } else if (s.api.energy <= 1E+02 - FLT_EPSILON) {
-                                f->context->mode.energy_loss = PUMAS_MODE_MIXED;
                                 f->context->mode.scattering =
                                     PUMAS_MODE_MIXED;
                                 f->context->limit.energy = 1E+02;
-                        } else {
-                                /* Mixed mode is used */
-                                f->context->mode.energy_loss = PUMAS_MODE_MIXED;
-                                f->context->mode.scattering =
-                                    PUMAS_MODE_DISABLED;
+                                continue;
                         }
+                } else if (event != PUMAS_EVENT_MEDIUM) {
+                        STATS_COUNT(f, failed_limit);
+                        rc = -1;
+                        break;
+                } else if (underground && (media[1] != NULL)) {
+                        if (media[1] == &f->atmosphere_medium) {
+                                rc = 1;
+                                break;
+                        }
+                        continue; /* change of topography layer */
+                } else {
+                        break;
                 }
-                f->context->medium = &layers_geometry;
-                f->context->mode.direction = PUMAS_MODE_BACKWARD;
+        }
+
+        f->context->event = PUMAS_EVENT_LIMIT_ENERGY;
+        STATS_TIME(f, time_underground, t0);
+        return rc;
+}
+
+#define TRANSPORT_BACKWARD(NAME, MODE)                                         \
+static int NAME(struct fluxmeter * f, struct state * s, int underground)       \
+{                                                                              \
+        return transport_backward(f, s, underground, MODE);                    \
+}
+
+TRANSPORT_BACKWARD(transport_backward_continuous, MULDER_CONTINUOUS)
+TRANSPORT_BACKWARD(transport_backward_mixed, MULDER_MIXED)
+TRANSPORT_BACKWARD(transport_backward_discrete, MULDER_DISCRETE)
+
+
+/* Forward CSDA transport over the opensky segment, for straight lines */
+static int opensky_csda(
+    struct fluxmeter * f,
+    struct pumas_state * state,
+    double height);
 
+/* Forward CSDA transport over the opensky segment, down to the reference
+ * height. On success, 0 is returned and the position is updated.
+ */
+static int transport_forward(
+    struct fluxmeter * f,
+    struct state * s,
+    struct mulder_position * position)
+{
+        /* Backup proper time and kinetic energy */
+        const double t0 = s->api.time;
+        const double e0 = s->api.energy;
+        s->api.time = 0.;
+
+        f->context->mode.energy_loss = PUMAS_MODE_CSDA;
+        f->context->mode.scattering = PUMAS_MODE_DISABLED;
+        f->context->medium = &opensky_geometry;
+        f->context->mode.direction = PUMAS_MODE_FORWARD;
+        f->context->limit.energy = f->api.reference->energy_min;
+
+        if ((f->api.geometry->atmosphere == &default_atmosphere) &&
+            !f->use_geomagnet) {
+                /* Straight line, thus the opensky segment can be integrated
+                 * in one go
+                 */
+                if (opensky_csda(f, &s->api, position->height) != 0) {
+                        return -1;
+                }
+        } else {
                 enum pumas_event event;
-                for (;;) {
-                        if (pumas_context_transport(
-                            f->context, &s.api, &event, NULL)
-                            != PUMAS_RETURN_SUCCESS) {
-                                struct mulder_state state = {0.};
-                                return state;
-                        }
-                        if ((f->api.mode == MULDER_DISCRETE) &&
-                            (event == PUMAS_EVENT_LIMIT_ENERGY)) {
-                                if (s.api.energy >=
-                                    f->api.reference->energy_max -
-                                    FLT_EPSILON) {
-                                        struct mulder_state state = {0.};
-                                        return state;
-                                } else if (s.api.energy >=
-                                    1E+02 - FLT_EPSILON) {
-                                        f->context->mode.energy_loss =
-                                            PUMAS_MODE_MIXED;
-                                        f->context->mode.scattering =
-                                            PUMAS_MODE_DISABLED;
-                                        f->context->limit.energy =
-                                            f->api.reference->energy_max;
-                                        continue;
-                                } else {
-                                        f->context->mode.energy_loss =
-                                            PUMAS_MODE_MIXED;
-                                        f->context->mode.scattering =
-                                            PUMAS_MODE_MIXED;
-                                        f->context->limit.energy = 1E+02;
-                                        continue;
-                                }
-                        } else if (event != PUMAS_EVENT_MEDIUM) {
-                                struct mulder_state state = {0.};
-                                return state;
-                        } else {
-                                break;
-                        }
+                STATS_COUNT(f, transports);
+                if (pumas_context_transport(f->context, &s->api, &event, NULL)
+                    != PUMAS_RETURN_SUCCESS) {
+                        STATS_COUNT(f, failed_transport);
+                        return -1;
+                }
+                if (event != PUMAS_EVENT_MEDIUM) {
+                        STATS_COUNT(f, failed_limit);
+                        return -1;
+                }
+        }
+
+        /* Get coordinates at end location (expected to be at zref) */
+        turtle_ecef_to_geodetic(s->api.position, &position->latitude,
+            &position->longitude, &position->height);
+        if (fabs(position->height - f->zref) > 1E-04) {
+                STATS_COUNT(f, failed_location);
+                return -1;
+        } else {
+                position->height = f->zref;
+                /* due to potential rounding errors */
+        }
+
+        /* Update proper time and Jacobian weight */
+        s->api.time = t0 - s->api.time;
+
+        const int material = f->atmosphere_medium.material;
+        double dedx0, dedx1;
+        csda_stopping_power(f, material, e0, &dedx0);
+        csda_stopping_power(f, material, s->api.energy, &dedx1);
+        if ((dedx0 <= 0.) || (dedx1 <= 0.)) {
+                STATS_COUNT(f, failed_stopping);
+                return -1;
+        }
+        s->api.weight *= dedx1 / dedx0;
+
+        return 0;
+}
+
+
+static struct mulder_state transport_event(
+    struct fluxmeter * f,
+    struct mulder_position position,
+    struct state s)
+{
+        if (position.height < f->ztop - FLT_EPSILON) {
+                /* Transport backward with Pumas */
+                if (f->transport_backward(f, &s, 0) != 0) {
+                        struct mulder_state state = {0.};
+                        return state;
                 }
 
                 /* Get coordinates at end location (expected to be at ztop) */
                 turtle_ecef_to_geodetic(s.api.position, &position.latitude,
                     &position.longitude, &position.height);
                 if (fabs(position.height - f->ztop) > 1E-04) {
+                        STATS_COUNT(f, failed_location);
                         struct mulder_state state = {0.};
                         return state;
                 }
         }
 
         if (position.height > f->api.reference->height_max + FLT_EPSILON) {
-                /* Backup proper time and kinetic energy */
-                const double t0 = s.api.time;
-                const double e0 = s.api.energy;
-                s.api.time = 0.;
-
                 /* Transport forward to reference height using CSDA */
-                f->context->mode.energy_loss = PUMAS_MODE_CSDA;
-                f->context->mode.scattering = PUMAS_MODE_DISABLED;
-                f->context->medium = &opensky_geometry;
-                f->context->mode.direction = PUMAS_MODE_FORWARD;
-                f->context->limit.energy = f->api.reference->energy_min;
-
-                enum pumas_event event;
-                if (pumas_context_transport(f->context, &s.api, &event, NULL)
-                    != PUMAS_RETURN_SUCCESS) {
-                        struct mulder_state state = {0.};
-                        return state;
-                }
-                if (event != PUMAS_EVENT_MEDIUM) {
-                        struct mulder_state state = {0.};
-                        return state;
-                }
-
-                /* Get coordinates at end location (expected to be at zref) */
-                turtle_ecef_to_geodetic(s.api.position, &position.latitude,
-                    &position.longitude, &position.height);
-                if (fabs(position.height - f->zref) > 1E-04) {
-                        struct mulder_state state = {0.};
-                        return state;
-                } else {
-                        position.height = f->zref;
-                        /* due to potential rounding errors */
-                }
-
-                /* Update proper time and Jacobian weight */
-                s.api.time = t0 - s.api.time;
-
-                const int material = f->atmosphere_medium.material;
-                double dedx0, dedx1;
-                pumas_physics_property_stopping_power(f->physics,
-                    PUMAS_MODE_CSDA, material, e0, &dedx0);
-                pumas_physics_property_stopping_power(f->physics,
-                    PUMAS_MODE_CSDA, material, s.api.energy, &dedx1);
-                if ((dedx0 <= 0.) || (dedx1 <= 0.)) {
+                const double t0 = stats_clock(f);
+                const int rc = transport_forward(f, &s, &position);
+                STATS_TIME(f, time_opensky, t0);
+                if (rc != 0) {
                         struct mulder_state state = {0.};
                         return state;
                 }
-                s.api.weight *= dedx1 / dedx0;
         } else if (fabs(position.height - f->zref) <= 10 * FLT_EPSILON) {
                 position.height = f->zref; /* due to rounding errors */
         }
@@ -1154,48 +3320,56 @@ static struct mulder_state transport_event(
 }
 
 
-/* Compute first intersection with topographic layer(s) */
-static struct state init_tracking(
+/* Geometry-only tracer, stepping Turtle directly (i.e. without Pumas) */
+struct tracer {
+        struct fluxmeter * fluxmeter;
+        double position[3];
+        double direction[3];
+        double height;
+        int medium;
+        int use_external_layer;
+};
+
+static void tracer_initialise(
+    struct tracer * tracer,
     struct fluxmeter * f,
     struct mulder_position position,
     struct mulder_direction direction);
 
+static double tracer_step(struct tracer * tracer, double * grammage);
+
+
+/* Compute first intersection with topographic layer(s) */
 struct mulder_intersection mulder_fluxmeter_intersect(
     struct mulder_fluxmeter * fluxmeter,
     const struct mulder_position position,
     const struct mulder_direction direction)
 {
-        /* Initialise the muon state */
+        /* Initialise the tracer */
         struct fluxmeter * f = (void *)fluxmeter;
-        struct state s = init_tracking(f, position, direction);
+        struct tracer t;
+        tracer_initialise(&t, f, position, direction);
 
-        /* Tracking with Pumas */
+        /* Step until the medium changes */
+        const double t0 = stats_clock(f);
         struct mulder_intersection intersection = {.layer = -1};
-
-        enum pumas_event event;
-        struct pumas_medium * media[2];
-        if (pumas_context_transport(f->context, &s.api, &event, media)
-            != PUMAS_RETURN_SUCCESS) {
-                return intersection;
+        const int medium = t.medium;
+        while (t.medium == medium) {
+                if (t.medium < 0) break;
+                tracer_step(&t, NULL);
         }
-        if (event != PUMAS_EVENT_MEDIUM) return intersection;
 
         /* Get coordinates at end location */
         turtle_ecef_to_geodetic(
-            s.api.position,
+            t.position,
             &intersection.position.latitude,
             &intersection.position.longitude,
             &intersection.position.height);
 
-        struct mulder_geometry * geometry = f->api.geometry;
-        if (media[1] == NULL) {
-                return intersection;
-        } else if (media[1] == &f->atmosphere_medium) {
-                intersection.layer = geometry->size;
-        } else {
-                ptrdiff_t i = media[1] - f->layers_media;
-                intersection.layer = (int)i;
+        if (t.medium != medium) {
+                intersection.layer = t.medium;
         }
+        STATS_TIME(f, time_geometry, t0);
         return intersection;
 }
 
@@ -1207,11 +3381,11 @@ double mulder_fluxmeter_grammage(
     const struct mulder_direction direction,
     double * grammage)
 {
-        /* Initialise the muon state */
+        /* Initialise the tracer */
         struct fluxmeter * f = (void *)fluxmeter;
-        struct state s = init_tracking(f, position, direction);
+        struct tracer t;
+        tracer_initialise(&t, f, position, direction);
 
-        /* Transport with Pumas */
         if (grammage != NULL) {
                 memset(
                     grammage,
@@ -1220,64 +3394,129 @@ double mulder_fluxmeter_grammage(
                 );
         }
 
-        double last_grammage = 0.;
-        for (;;) {
-                enum pumas_event event;
-                struct pumas_medium * media[2];
-                enum pumas_return rc = pumas_context_transport(
-                    f->context,
-                    &s.api,
-                    &event,
-                    media
-                );
-                if (rc != PUMAS_RETURN_SUCCESS) {
-                        return 0.;
-                }
+        /* Step until the geometry is exited */
+        const double t0 = stats_clock(f);
+        double total = 0.;
+        while (t.medium >= 0) {
+                total += tracer_step(&t, grammage);
+        }
+        STATS_TIME(f, time_geometry, t0);
 
-                if (grammage != NULL) {
-                        int i;
-                        if (media[0] == NULL) {
-                                break;
-                        } else if (media[0] == &f->atmosphere_medium) {
-                                i = f->api.geometry->size;
-                        } else {
-                                ptrdiff_t tmp = media[0] - f->layers_media;
-                                i = (int)tmp;
-                        }
-                        grammage[i] += s.api.grammage - last_grammage;
-                        last_grammage = s.api.grammage;
-                }
+        return total;
+}
 
-                if ((event != PUMAS_EVENT_MEDIUM) ||
-                    (media[1] == NULL)) {
-                        break;
+
+/* Trace a bundle of rays from a common position, e.g. camera pixels.
+ *
+ * The observer's frame and initial medium are computed once, and rays are
+ * traced by square tiles of pixels. Thus, successive rays cross the same map
+ * cells, which benefits to Turtle steppers (e.g. cached stack tiles). Note
+ * that this only applies to grammages. Fluxes are computed per pixel as by
+ * mulder_fluxmeter_flux, i.e. steppers are reset per event (see init_state).
+ */
+#define BUNDLE_TILE 8
+
+void mulder_fluxmeter_image(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_position position,
+    int width,
+    int height,
+    const struct mulder_direction * direction,
+    double energy,
+    double * grammage,
+    struct mulder_flux * flux)
+{
+        /* Shared observer frame (East, North, Up) and initial medium */
+        struct fluxmeter * f = (void *)fluxmeter;
+        const struct mulder_direction zenith = {0., 90.};
+        struct tracer t0;
+        tracer_initialise(&t0, f, position, zenith);
+        double east[3], north[3];
+        turtle_ecef_from_horizontal(position.latitude, position.longitude,
+            90., 0., east);
+        turtle_ecef_from_horizontal(position.latitude, position.longitude,
+            0., 0., north);
+        const double up[3] = {
+            t0.direction[0], t0.direction[1], t0.direction[2]
+        };
+        if (flux != NULL) init_batch(f);
+
+        const double t1 = stats_clock(f);
+        int i0, j0;
+        for (i0 = 0; i0 < height; i0 += BUNDLE_TILE) {
+                const int i1 = (i0 + BUNDLE_TILE < height) ?
+                    i0 + BUNDLE_TILE : height;
+                for (j0 = 0; j0 < width; j0 += BUNDLE_TILE) {
+                        const int j1 = (j0 + BUNDLE_TILE < width) ?
+                            j0 + BUNDLE_TILE : width;
+                        int i, j;
+                        for (i = i0; i < i1; i++) for (j = j0; j < j1; j++) {
+                                const int k = i * width + j;
+                                const struct mulder_direction d =
+                                    direction[k];
+                                const double az = d.azimuth * M_PI / 180.;
+                                const double el = d.elevation * M_PI / 180.;
+                                const double ch = cos(el) * cos(az);
+                                const double sh = cos(el) * sin(az);
+                                const double sv = sin(el);
+                                double u[3];
+                                int m;
+                                for (m = 0; m < 3; m++) {
+                                        u[m] = sh * east[m] + ch * north[m] +
+                                            sv * up[m];
+                                }
+
+                                if (grammage != NULL) {
+                                        struct tracer t = t0;
+                                        memcpy(t.direction, u, sizeof u);
+                                        double total = 0.;
+                                        while (t.medium >= 0) {
+                                                total += tracer_step(&t,
+                                                    NULL);
+                                        }
+                                        grammage[k] = total;
+                                }
+
+                                if (flux != NULL) {
+                                        const struct mulder_state initial = {
+                                                .pid = MULDER_ANY,
+                                                .position = position,
+                                                .direction = d,
+                                                .energy = energy,
+                                                .weight = 1.
+                                        };
+                                        struct state s = init_state(f,
+                                            MULDER_MUON, position.height,
+                                            t0.position, u, energy, 1.);
+                                        flux[k] = flux_event(f, initial, s);
+                                }
+                        }
                 }
         }
-
-        return s.api.grammage;
+        if (flux == NULL) {
+                /* Otherwise, time is accounted per transport step */
+                STATS_TIME(f, time_geometry, t1);
+        }
 }
 
 
-/* Initialise fluxmeter for geometry tracking */
-static struct state init_tracking(
+/* Initialise a tracer, starting from the given location */
+static int tracer_medium(const struct tracer * tracer, int index);
+
+static void tracer_initialise(
+    struct tracer * tracer,
     struct fluxmeter * f,
     struct mulder_position position,
     struct mulder_direction direction)
 {
-        struct state s = {
-            .api = {
-                .charge = 1.,
-                .energy = 1.,
-                .weight = 1.
-            },
-            .fluxmeter = f
-        };
+        tracer->fluxmeter = f;
+        tracer->height = position.height;
 
         turtle_ecef_from_geodetic(
             position.latitude,
             position.longitude,
             position.height,
-            s.api.position
+            tracer->position
         );
 
         turtle_ecef_from_horizontal(
@@ -1285,50 +3524,20 @@ static struct state init_tracking(
             position.longitude,
             direction.azimuth,
             direction.elevation,
-            s.api.direction
+            tracer->direction
         );
 
         /* Update Turtle steppers (if the reference heights have changed) */
         update_steppers(f);
 
-        /* Disable geomagnetic field */
-        f->use_geomagnet = 0;
-
-        /* Transport with Pumas */
-        f->context->medium = &layers_geometry;
-        f->context->mode.direction = PUMAS_MODE_FORWARD;
-        f->context->mode.energy_loss = PUMAS_MODE_DISABLED;
-        f->context->event = PUMAS_EVENT_MEDIUM;
-        f->use_external_layer = (position.height >= f->ztop + FLT_EPSILON);
-
-        return s;
-}
-
-
-/* Geometry layer index for the given location */
-int mulder_fluxmeter_whereami(
-    struct mulder_fluxmeter * fluxmeter,
-    const struct mulder_position position)
-{
-        struct fluxmeter * f = (void *)fluxmeter;
-
-        /* Update Turtle steppers (if the reference heights have changed) */
-        update_steppers(f);
-
-        /* Get ECEF position */
-        double ecef[3];
-        turtle_ecef_from_geodetic(
-            position.latitude,
-            position.longitude,
-            position.height,
-            ecef
-        );
+        /* Locate the initial medium */
+        tracer->use_external_layer =
+            (position.height >= f->ztop + FLT_EPSILON);
 
-        /* Fetch location */
         int index[2];
         turtle_stepper_step(
             f->layers_stepper,
-            ecef,
+            tracer->position,
             NULL,
             NULL,
             NULL,
@@ -1337,620 +3546,2794 @@ int mulder_fluxmeter_whereami(
             NULL,
             index
         );
+        STATS_COUNT(f, steps);
+        tracer->medium = tracer_medium(tracer, index[0]);
+}
 
-        if (index > 0) {
-                const int top = f->api.geometry->size;
-                return (index[0] <= top) ? index[0] - 1 : top;
+
+/* Map a stepper index to a medium index, i.e. a layer index, the geometry
+ * size for the atmosphere or -1 outside of the geometry.
+ */
+static int tracer_medium(const struct tracer * tracer, int index)
+{
+        const int size = tracer->fluxmeter->api.geometry->size;
+        if ((index >= 1) && (index <= size)) {
+                return index - 1;
+        } else if (index == size + 1) {
+                return size;
+        } else if ((tracer->use_external_layer) && (index == size + 2)) {
+                return size;
         } else {
                 return -1;
         }
 }
 
 
-/* Callback for setting local properties of layers media */
-static double layers_locals(
-    struct pumas_medium * medium,
-    struct pumas_state * state,
-    struct pumas_locals * locals)
+/* Column depth over a straight atmospheric segment */
+static double us_standard_density(double height, double * lambda);
+static double us_standard_column(double h0, double h1);
+
+#define TRACER_EARTH_RADIUS 6371E+03
+#define TRACER_SAGITTA 1E-01
+#define TRACER_HEIGHT_STEP 1E+02
+#define TRACER_MAX_SEGMENTS 100000
+
+static double atmosphere_column(
+    struct mulder_atmosphere (*atmosphere)(double height),
+    double h0,
+    double h1,
+    double length)
 {
-        struct state * s = (void *)state;
-        struct fluxmeter * f = s->fluxmeter;
-        ptrdiff_t i = medium - f->layers_media;
-        if (i >= 0) {
-                locals->density = f->api.geometry->layers[i]->density;
-        } else {
-                MULDER_ERROR("bad medium index (%d)", 16, (int)i);
+        if (length <= 0.) return 0.;
+
+        /* Heights along the segment are modelled using a spherical Earth,
+         * anchored at both end points.
+         */
+        const double r0 = TRACER_EARTH_RADIUS + h0;
+        const double dh = h1 - h0;
+        double mu = (dh * (2. * r0 + dh) - length * length) /
+            (2. * r0 * length);
+        if (mu < -1.) mu = -1.;
+        else if (mu > 1.) mu = 1.;
+
+        /* Subdivide the segment, such that heights are linear per
+         * sub-segment, to a good approximation
+         */
+        const int analytic = (atmosphere == &default_atmosphere);
+        const double sagitta = length * length * (1. - mu * mu) / (8. * r0);
+        double tmp = (sagitta > TRACER_SAGITTA) ?
+            ceil(sqrt(sagitta / TRACER_SAGITTA)) : 1.;
+        if (!analytic) {
+                const double tmp1 = ceil(fabs(dh) / TRACER_HEIGHT_STEP);
+                if (tmp1 > tmp) tmp = tmp1;
         }
-        return 0.;
-}
+        const int n = (tmp < TRACER_MAX_SEGMENTS) ?
+            (int)tmp : TRACER_MAX_SEGMENTS;
+        const double ds = length / n;
 
+        double column = 0., ha = h0;
+        double rhoa = analytic ? 0. : atmosphere(h0).density;
+        int i;
+        for (i = 1; i <= n; i++) {
+                double hb;
+                if (i == n) {
+                        hb = h1;
+                } else {
+                        const double s = i * ds;
+                        hb = sqrt(r0 * r0 + 2. * r0 * mu * s + s * s) -
+                            TRACER_EARTH_RADIUS;
+                }
 
-/* CORSIKA parameterisation of the US standard atmospheric density */
-static double us_standard_function(double height, double lambda, double b)
-{
-        return 1E+01 * b / lambda * exp(-height / lambda);
+                if (analytic) {
+                        /* Integrate the exponential segments of the US
+                         * standard atmosphere
+                         */
+                        if (fabs(hb - ha) > 1E-03) {
+                                column += ds * us_standard_column(ha, hb) /
+                                    (hb - ha);
+                        } else {
+                                double lambda;
+                                column += ds * us_standard_density(
+                                    0.5 * (ha + hb), &lambda);
+                        }
+                } else {
+                        /* Assume an exponential density per sub-segment */
+                        const double rhob = atmosphere(hb).density;
+                        if ((rhoa > 0.) && (rhob > 0.) &&
+                            (fabs(rhob - rhoa) > 1E-09 * rhoa)) {
+                                column += ds * (rhob - rhoa) /
+                                    log(rhob / rhoa);
+                        } else {
+                                column += 0.5 * ds * (rhoa + rhob);
+                        }
+                        rhoa = rhob;
+                }
+                ha = hb;
+        }
+
+        return column;
 }
 
-static double us_standard_density(double height, double * lambda)
+
+/* Do a tracing step, returning the corresponding grammage */
+static double tracer_step(struct tracer * tracer, double * grammage)
 {
-        const double hc[4] = {
-            4.E+03, 1.E+04, 4.E+04, 1.E+05
-        };
-        const double bi[4] = {
-            1222.6562E+00, 1144.9069E+00, 1305.5948E+00, 540.1778E+00
-        };
-        const double ci[4] = {
-            994186.38E+00, 878153.55E+00, 636143.04E+00, 772170.16E+00
-        };
+        struct fluxmeter * f = tracer->fluxmeter;
+        const int medium = tracer->medium;
+        const double h0 = tracer->height;
 
-        /* Compute the local density */
-        int i;
-        for (i = 0; i < 4; i++) {
-                if (height < hc[i]) {
-                        const double lb = ci[i] * 1E-02;
-                        *lambda = lb;
-                        return us_standard_function(height, lb, bi[i]);
+        /* Step with Turtle, up to the next medium change (if any). Note that
+         * the final altitude is returned as well.
+         */
+        double step, h1;
+        int index[2];
+        turtle_stepper_step(
+            f->layers_stepper,
+            tracer->position,
+            tracer->direction,
+            NULL,
+            NULL,
+            &h1,
+            NULL,
+            &step,
+            index
+        );
+        STATS_COUNT(f, steps);
+        if (step <= FLT_EPSILON) {
+                /* Ensure progress, as in the Pumas locator */
+                int i;
+                for (i = 0; i < 3; i++) {
+                        tracer->position[i] +=
+                            (FLT_EPSILON - step) * tracer->direction[i];
                 }
+                step = FLT_EPSILON;
         }
+        tracer->height = h1;
+        tracer->medium = tracer_medium(tracer, index[0]);
 
-        *lambda = ci[3] * 1E-02;
-        return us_standard_function(hc[3], ci[3] * 1E-02, bi[3]);
+        /* Integrate the column depth over the step */
+        const int size = f->api.geometry->size;
+        double column;
+        if (medium < 0) {
+                return 0.;
+        } else if (medium < size) {
+                column = f->api.geometry->layers[medium]->density * step;
+        } else {
+                column = atmosphere_column(
+                    f->api.geometry->atmosphere, h0, h1, step);
+        }
+
+        if (grammage != NULL) grammage[medium] += column;
+        return column;
 }
 
 
-/* Default atmosphere callback */
-static struct mulder_atmosphere default_atmosphere(double height)
+/* Backward CSDA transport of the underground leg, using tabulated ranges.
+ *
+ * Without multiple scattering, CSDA muons follow straight lines. Thus, the
+ * geometry is traced with Turtle (see tracer_step), and the kinetic energy is
+ * updated per crossed medium, from CSDA ranges. This applies since layers have
+ * uniform densities, while ranges are w.r.t. the grammage. The proper time is
+ * estimated as in opensky_csda, and the weight is multiplied by the backward
+ * Jacobian factor, i.e. the ratio of stopping powers, per crossed medium.
+ * Return codes are those of transport_backward.
+ */
+static int transport_ranges(
+    struct fluxmeter * f,
+    struct state * s,
+    int underground)
 {
-        struct mulder_atmosphere atmosphere;
-        double lambda;
-        atmosphere.density = us_standard_density(height, &lambda);
-        atmosphere.gradient = atmosphere.density / lambda;
-        return atmosphere;
+        /* Initialise a tracer from the current state */
+        struct tracer t;
+        t.fluxmeter = f;
+        t.use_external_layer = 0;
+        int i;
+        for (i = 0; i < 3; i++) {
+                t.position[i] = s->api.position[i];
+                t.direction[i] = -s->api.direction[i];
+        }
+        double latitude, longitude;
+        turtle_ecef_to_geodetic(t.position, &latitude, &longitude, &t.height);
+
+        int index[2];
+        turtle_stepper_step(
+            f->layers_stepper,
+            t.position,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            index
+        );
+        STATS_COUNT(f, steps);
+        t.medium = tracer_medium(&t, index[0]);
+
+        /* Step through the geometry */
+        const int size = f->api.geometry->size;
+        const double energy_max = f->api.reference->energy_max;
+        int rc = 0;
+        while (t.medium >= 0) {
+                const int medium = t.medium;
+                const int material = (medium < size) ?
+                    f->layers_media[medium].material :
+                    f->atmosphere_medium.material;
+                double r[3];
+                for (i = 0; i < 3; i++) r[i] = t.position[i];
+                const double grammage = tracer_step(&t, NULL);
+                double distance = 0.;
+                for (i = 0; i < 3; i++) {
+                        const double d = t.position[i] - r[i];
+                        distance += d * d;
+                }
+                distance = sqrt(distance);
+
+                /* Update the kinetic energy and the proper time */
+                double r0, t0, e1, t1;
+                if ((csda_range(f, material, s->api.energy, &r0) !=
+                        PUMAS_RETURN_SUCCESS) ||
+                    (csda_kinetic_energy(f, material, r0 + grammage, &e1) !=
+                        PUMAS_RETURN_SUCCESS) ||
+                    (e1 >= energy_max)) {
+                        STATS_COUNT(f, failed_limit);
+                        rc = -1;
+                        break;
+                }
+                double gamma_inv;
+                if ((grammage > FLT_EPSILON) &&
+                    (csda_proper_time(f, material, s->api.energy, &t0) ==
+                        PUMAS_RETURN_SUCCESS) &&
+                    (csda_proper_time(f, material, e1, &t1) ==
+                        PUMAS_RETURN_SUCCESS)) {
+                        gamma_inv = (t1 - t0) / grammage;
+                } else {
+                        const double e = s->api.energy;
+                        gamma_inv = MUON_MASS / sqrt(e * (e + 2. * MUON_MASS));
+                }
+
+                /* Update the backward Jacobian weight, as Pumas does */
+                double dedx0, dedx1;
+                if ((csda_stopping_power(f, material, s->api.energy, &dedx0) !=
+                        PUMAS_RETURN_SUCCESS) ||
+                    (csda_stopping_power(f, material, e1, &dedx1) !=
+                        PUMAS_RETURN_SUCCESS) ||
+                    (dedx0 <= 0.) || (dedx1 <= 0.)) {
+                        STATS_COUNT(f, failed_stopping);
+                        rc = -1;
+                        break;
+                }
+                s->api.weight *= dedx1 / dedx0;
+
+                s->api.energy = e1;
+                s->api.distance += distance;
+                s->api.grammage += grammage;
+                s->api.time += distance * gamma_inv;
+
+                if (underground && (medium < size) && (t.medium == size)) {
+                        rc = 1; /* the atmosphere was entered */
+                        break;
+                }
+        }
+
+        for (i = 0; i < 3; i++) s->api.position[i] = t.position[i];
+        return rc;
 }
 
 
-/* Compute rotation matrix from ECEF to ENU */
-static void ecef_to_enu(
-    double latitude,
-    double longitude,
-    double declination,
-    double inclination,
-    double rotation[3][3])
+/* Energy pre-pass of the underground leg, for pruning events.
+ *
+ * The layers are traced along a straight line, as in transport_ranges, and the
+ * kinetic energy is increased per crossed layer from range tables. In
+ * continuous mode, CSDA ranges are used. In mixed mode, ranges are restricted
+ * to continuous losses, resulting in a lower bound of the energy at the
+ * surface. The discrete mode is not supported, since low energy straggling
+ * and multiple scattering invalidate this bound. Returns 1 if the minimal
+ * energy exceeds the reference energy_max, 0 otherwise.
+ */
+static int prune_event(struct fluxmeter * f, const struct state * s)
 {
-        turtle_ecef_from_horizontal(
-             latitude,
-             longitude,
-             90. + declination,
-             0.,
-             &rotation[0][0]
-        );
+        struct tracer t;
+        t.fluxmeter = f;
+        t.use_external_layer = 0;
+        int i;
+        for (i = 0; i < 3; i++) {
+                t.position[i] = s->api.position[i];
+                t.direction[i] = -s->api.direction[i];
+        }
+        double latitude, longitude;
+        turtle_ecef_to_geodetic(t.position, &latitude, &longitude, &t.height);
 
-        turtle_ecef_from_horizontal(
-            latitude,
-            longitude,
-            declination,
-            -inclination,
-            &rotation[1][0]
+        int index[2];
+        turtle_stepper_step(
+            f->layers_stepper,
+            t.position,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            index
         );
+        STATS_COUNT(f, steps);
+        t.medium = tracer_medium(&t, index[0]);
+
+        const int size = f->api.geometry->size;
+        const double energy_max = f->api.reference->energy_max;
+        const int csda = (f->api.mode == MULDER_CONTINUOUS);
+        double energy = s->api.energy;
+        int rc = 0;
+        while ((t.medium >= 0) && (t.medium < size)) {
+                const int material = f->layers_media[t.medium].material;
+                const double grammage = tracer_step(&t, NULL);
+                if (grammage <= 0.) continue;
+
+                double range;
+                enum pumas_return prc = csda ?
+                    csda_range(f, material, energy, &range) :
+                    pumas_physics_property_range(f->physics,
+                        PUMAS_MODE_MIXED, material, energy, &range);
+                if (prc == PUMAS_RETURN_SUCCESS) {
+                        prc = csda ?
+                            csda_kinetic_energy(
+                                f, material, range + grammage, &energy) :
+                            pumas_physics_property_kinetic_energy(f->physics,
+                                PUMAS_MODE_MIXED, material, range + grammage,
+                                &energy);
+                }
+                if (prc != PUMAS_RETURN_SUCCESS) {
+                        break; /* e.g. out of tables, let Pumas decide */
+                } else if (energy > energy_max) {
+                        rc = 1;
+                        break;
+                }
+        }
 
-        turtle_ecef_from_horizontal(
-            latitude,
-            longitude,
-            0.,
-            90. - inclination,
-            &rotation[2][0]
-        );
+        /* Reset the stepper for numeric consistency with the transport */
+        turtle_stepper_reset(f->layers_stepper);
+        return rc;
 }
 
 
-/* Callback for setting local properties of the atmosphere*/
-static double atmosphere_locals(
-    struct pumas_medium * medium,
+/* Forward CSDA transport over the opensky segment, for straight lines.
+ *
+ * The atmosphere grammage is integrated in one pass, using the tracer
+ * algorithm. Then, the final energy is obtained from CSDA range tables. The
+ * proper time is estimated with the grammage averaged inverse of the muon
+ * Lorentz factor, which is exact for negligible energy losses.
+ */
+static int opensky_csda(
+    struct fluxmeter * f,
     struct pumas_state * state,
-    struct pumas_locals * locals)
+    double height)
 {
-        /* Get local density */
-        struct state * s = (void *)state;
-        struct fluxmeter * f = s->fluxmeter;
-        double latitude, longitude, height;
-        turtle_ecef_to_geodetic(
+        /* Locate the initial medium */
+        int index[2];
+        turtle_stepper_step(
+            f->opensky_stepper,
             state->position,
-            &latitude,
-            &longitude,
-            &height
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            index
         );
-        struct mulder_atmosphere atmosphere =
-            f->api.geometry->atmosphere(height);
-        locals->density = atmosphere.density;
+        STATS_COUNT(f, steps);
+        if (index[0] != 1) {
+                STATS_COUNT(f, failed_location);
+                return -1;
+        }
 
-        double lambda;
-        if (fabs(atmosphere.gradient) > 1E-09 * atmosphere.density) {
-                double azimuth, elevation;
-                turtle_ecef_to_horizontal(
-                    latitude,
-                    longitude,
+        /* Step through the atmosphere with Turtle */
+        double grammage = 0., distance = 0.;
+        while (index[0] == 1) {
+                double step, h1;
+                turtle_stepper_step(
+                    f->opensky_stepper,
+                    state->position,
                     state->direction,
-                    &azimuth,
-                    &elevation
+                    NULL,
+                    NULL,
+                    &h1,
+                    NULL,
+                    &step,
+                    index
                 );
-                double c = fabs(sin(elevation * M_PI / 180));
-                if (c < 0.1) c = 0.1;
-                lambda = atmosphere.density / (c * atmosphere.gradient);
-        } else {
-                lambda = 1E+09;
+                STATS_COUNT(f, steps);
+                if (step <= FLT_EPSILON) {
+                        int i;
+                        for (i = 0; i < 3; i++) {
+                                state->position[i] +=
+                                    (FLT_EPSILON - step) * state->direction[i];
+                        }
+                        step = FLT_EPSILON;
+                }
+                grammage += atmosphere_column(
+                    f->api.geometry->atmosphere, height, h1, step);
+                distance += step;
+                height = h1;
+        }
+        if (fabs(height - f->zref) > 1E-04) {
+                /* The reference height was missed */
+                STATS_COUNT(f, failed_location);
+                return -1;
         }
 
-        if (!f->use_geomagnet) {
-                return lambda;
+        /* Update the kinetic energy, using CSDA ranges */
+        const int material = f->atmosphere_medium.material;
+        double r0, t0;
+        csda_range(f, material, state->energy, &r0);
+        csda_proper_time(f, material, state->energy, &t0);
+
+        const double r1 = r0 - grammage;
+        if (r1 <= 0.) {
+                STATS_COUNT(f, failed_limit);
+                return -1;
+        }
+        double e1, t1;
+        csda_kinetic_energy(f, material, r1, &e1);
+        if (e1 < f->api.reference->energy_min) {
+                STATS_COUNT(f, failed_limit);
+                return -1;
         }
+        csda_proper_time(f, material, e1, &t1);
 
-        /* Get local geomagnetic field */
-        double lambda_g = 1E+03;
-        double d2 = 0.;
-        int i;
-        for (i = 0; i < 3; i++) {
-                const double tmp =
-                    state->position[i] - f->geomagnet_position[i];
-                d2 += tmp * tmp;
+        /* Update the proper time */
+        double gamma_inv;
+        if (grammage > FLT_EPSILON) {
+                gamma_inv = (t0 - t1) / grammage;
+        } else {
+                gamma_inv = MUON_MASS / sqrt(state->energy *
+                    (state->energy + 2. * MUON_MASS));
         }
-        if (d2 > lambda_g * lambda_g) {
-                /* Get the local magnetic field (in ENU frame) */
-                double enu[3];
-                gull_snapshot_field(
-                    f->current_geomagnet->snapshot,
-                    latitude,
-                    longitude,
-                    height,
-                    enu,
-                    &f->geomagnet_workspace
-                );
 
-                /* Transform to ECEF (using transposed/inverse matrix) */
-                double rotation[3][3];
-                ecef_to_enu(
-                    latitude,
-                    longitude,
-                    0.,
-                    0.,
-                    rotation
-                );
+        state->energy = e1;
+        state->distance += distance;
+        state->grammage += grammage;
+        state->time += distance * gamma_inv;
 
-                int i;
-                double ecef[3] = {0., 0., 0.};
-                for (i = 0; i < 3; i++) {
-                        int j;
-                        for (j = 0; j < 3; j++) {
-                                ecef[i] += rotation[j][i] * enu[j];
+        return 0;
+}
+
+
+/* Column index of a layered geometry.
+ *
+ * The geometry is divided in columns, made of blocks of map cells. For each
+ * column, bounds of the layers top surfaces are tabulated, as prefix maxima
+ * over layers (bottom-up). Following Turtle's convention, a point belongs to
+ * the lowest layer whose top surface is above. Thus, this layer is bracketed
+ * by binary searches over tabulated bounds. Surfaces are only interpolated
+ * for the few layers that remain ambiguous (if any).
+ *
+ * The index applies to geometries made of flat layers and of single maps
+ * sharing the same grid. Otherwise, Turtle's stepper is used.
+ */
+#define COLUMN_BLOCK 8
+
+struct column_index {
+        int size;
+        /* Reference grid (if any map) */
+        const struct turtle_projection * projection;
+        int nx;
+        int ny;
+        double xmin;
+        double ymin;
+        double dx;
+        double dy;
+        /* Columns */
+        int cx;
+        int cy;
+        double * bounds; /* [cy][cx][size][2], i.e. lower and upper bounds */
+        /* Layers data */
+        struct turtle_map ** maps; /* NULL for flat layers */
+        double * offsets;
+};
+
+static struct column_index * column_index_create(
+    const struct mulder_geometry * geometry)
+{
+        const int size = geometry->size;
+        if (size <= 0) return NULL;
+
+        /* Check the geometry */
+        const struct layer * reference = NULL;
+        struct turtle_map_info info = {0};
+        const char * projection = NULL;
+        int i;
+        for (i = 0; i < size; i++) {
+                const struct layer * l = (void *)geometry->layers[i];
+                if ((l->stack != NULL) || (l->n_fallbacks > 0)) {
+                        return NULL;
+                } else if (l->map == NULL) {
+                        continue;
+                } else if (reference == NULL) {
+                        reference = l;
+                        turtle_map_meta(l->map, &info, &projection);
+                } else {
+                        struct turtle_map_info tmp;
+                        const char * p;
+                        turtle_map_meta(l->map, &tmp, &p);
+                        if ((tmp.nx != info.nx) || (tmp.ny != info.ny) ||
+                            (tmp.x[0] != info.x[0]) ||
+                            (tmp.x[1] != info.x[1]) ||
+                            (tmp.y[0] != info.y[0]) ||
+                            (tmp.y[1] != info.y[1]) ||
+                            ((p == NULL) != (projection == NULL)) ||
+                            ((p != NULL) && (strcmp(p, projection) != 0))) {
+                                return NULL;
                         }
                 }
+        }
+        if ((reference != NULL) && ((info.nx < 2) || (info.ny < 2))) {
+                return NULL;
+        }
 
-                /* Update the cache */
-                memcpy(
-                    f->geomagnet_field,
-                    ecef,
-                    sizeof f->geomagnet_field
-                );
-                memcpy(
-                    f->geomagnet_position,
-                    state->position,
-                    sizeof f->geomagnet_position
-                );
+        /* Allocate memory */
+        const int cx = (reference == NULL) ?
+            1 : (info.nx - 2) / COLUMN_BLOCK + 1;
+        const int cy = (reference == NULL) ?
+            1 : (info.ny - 2) / COLUMN_BLOCK + 1;
+        struct column_index * index = malloc(sizeof *index);
+        double * bounds = malloc(2 * (size_t)cx * cy * size * sizeof *bounds);
+        struct turtle_map ** maps = malloc(size * sizeof *maps);
+        double * offsets = malloc(size * sizeof *offsets);
+        if ((index == NULL) || (bounds == NULL) || (maps == NULL) ||
+            (offsets == NULL)) {
+                free(index);
+                free(bounds);
+                free(maps);
+                free(offsets);
+                return NULL; /* the index is optional */
         }
 
-        /* Fetch the cached geomagnetic field */
-        memcpy(
-            locals->magnet,
-            f->geomagnet_field,
-            sizeof locals->magnet
-        );
+        index->size = size;
+        index->cx = cx;
+        index->cy = cy;
+        index->bounds = bounds;
+        index->maps = maps;
+        index->offsets = offsets;
+        if (reference != NULL) {
+                index->projection = turtle_map_projection(reference->map);
+                index->nx = info.nx;
+                index->ny = info.ny;
+                index->xmin = info.x[0];
+                index->ymin = info.y[0];
+                index->dx = (info.x[1] - info.x[0]) / (info.nx - 1);
+                index->dy = (info.y[1] - info.y[0]) / (info.ny - 1);
+        } else {
+                index->projection = NULL;
+                index->nx = index->ny = 0;
+        }
+        for (i = 0; i < size; i++) {
+                const struct layer * l = (void *)geometry->layers[i];
+                maps[i] = l->map;
+                offsets[i] = l->api.offset;
+        }
 
-        lambda_g /= f->context->accuracy;
-        return (lambda < lambda_g) ? lambda : lambda_g;
+        /* Tabulate bounds. Note that bilinear interpolations lie within the
+         * range of cell nodes.
+         */
+        int bx, by;
+        for (by = 0; by < cy; by++) for (bx = 0; bx < cx; bx++) {
+                double * b = bounds + 2 * (by * cx + bx) * size;
+                double lower = -DBL_MAX, upper = -DBL_MAX;
+                for (i = 0; i < size; i++, b += 2) {
+                        double zmin = offsets[i], zmax = offsets[i];
+                        if (maps[i] != NULL) {
+                                const int ix0 = bx * COLUMN_BLOCK;
+                                const int iy0 = by * COLUMN_BLOCK;
+                                int ix1 = ix0 + COLUMN_BLOCK;
+                                int iy1 = iy0 + COLUMN_BLOCK;
+                                if (ix1 > info.nx - 1) ix1 = info.nx - 1;
+                                if (iy1 > info.ny - 1) iy1 = info.ny - 1;
+                                zmin = DBL_MAX;
+                                zmax = -DBL_MAX;
+                                int ix, iy;
+                                for (iy = iy0; iy <= iy1; iy++)
+                                for (ix = ix0; ix <= ix1; ix++) {
+                                        double x, y, z;
+                                        turtle_map_node(maps[i], ix, iy,
+                                            &x, &y, &z);
+                                        if (z < zmin) zmin = z;
+                                        if (z > zmax) zmax = z;
+                                }
+                                zmin += offsets[i];
+                                zmax += offsets[i];
+                        }
+                        if (zmin > lower) lower = zmin;
+                        if (zmax > upper) upper = zmax;
+                        b[0] = lower;
+                        b[1] = upper;
+                }
+        }
+
+        return index;
 }
 
+static void column_index_destroy(struct column_index ** index)
+{
+        if ((index == NULL) || (*index == NULL)) return;
+        free((*index)->bounds);
+        free((*index)->maps);
+        free((*index)->offsets);
+        free(*index);
+        *index = NULL;
+}
 
-/* Pumas locator for the layered geometry */
-static enum pumas_step layers_geometry(
-    struct pumas_context * context,
-    struct pumas_state * state,
-    struct pumas_medium ** medium_ptr,
-    double * step_ptr)
+/* First layer whose bound (lower or upper) is above height. Bounds are sorted,
+ * since they are prefix maxima.
+ */
+static int column_search(const double * bounds, int size, int which,
+    double height)
 {
-        struct state * s = (void *)state;
-        struct fluxmeter * f = s->fluxmeter;
+        int lo = 0, hi = size;
+        while (lo < hi) {
+                const int mid = (lo + hi) / 2;
+                if (bounds[2 * mid + which] > height) hi = mid;
+                else lo = mid + 1;
+        }
+        return lo;
+}
 
-        double step;
+/* Locate a point using the column index. On success, the layer index is
+ * returned, following Turtle's stepper numbering. Otherwise, -1 is returned.
+ */
+static int column_locate(
+    const struct column_index * index,
+    const struct mulder_position position)
+{
+        /* Note that points above the geometry are left to Turtle */
+        if ((position.height < ZMIN) || (position.height >= ZMAX)) {
+                return -1;
+        }
+
+        double x = 0., y = 0.;
+        int bx = 0, by = 0;
+        if (index->nx > 0) {
+                if (index->projection == NULL) {
+                        x = position.longitude;
+                        y = position.latitude;
+                } else {
+                        turtle_projection_project(index->projection,
+                            position.latitude, position.longitude, &x, &y);
+                }
+                const double hx = (x - index->xmin) / index->dx;
+                const double hy = (y - index->ymin) / index->dy;
+                if ((hx < 0.) || (hx > index->nx - 1) || (hy < 0.) ||
+                    (hy > index->ny - 1)) {
+                        return -1;
+                }
+                int ix = (int)hx, iy = (int)hy;
+                if (ix > index->nx - 2) ix = index->nx - 2;
+                if (iy > index->ny - 2) iy = index->ny - 2;
+                bx = ix / COLUMN_BLOCK;
+                by = iy / COLUMN_BLOCK;
+        }
+
+        /* Bracket the layer */
+        const int size = index->size;
+        const double * bounds =
+            index->bounds + 2 * (by * index->cx + bx) * size;
+        const double height = position.height;
+        int i = column_search(bounds, size, 1, height);
+        const int last = column_search(bounds, size, 0, height);
+
+        /* Resolve ambiguous layers */
+        for (; i < last; i++) {
+                double z = index->offsets[i];
+                if (index->maps[i] != NULL) {
+                        int inside;
+                        double elevation;
+                        turtle_map_elevation(index->maps[i], x, y,
+                            &elevation, &inside);
+                        if (!inside) return -1;
+                        z += elevation;
+                }
+                if (z > height) break;
+        }
+
+        return i + 1; /* the first Turtle layer is below ZMIN */
+}
+
+/* Geometry layer index for the given location */
+int mulder_fluxmeter_whereami(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_position position)
+{
+        struct fluxmeter * f = (void *)fluxmeter;
+
+        /* Use the column index, if available */
+        const struct column_index * columns = f->shared->columns;
+        if (columns != NULL) {
+                const int index = column_locate(columns, position);
+                if (index > 0) {
+                        const int top = f->api.geometry->size;
+                        return (index <= top) ? index - 1 : top;
+                }
+        }
+
+        /* Update Turtle steppers (if the reference heights have changed) */
+        update_steppers(f);
+
+        /* Get ECEF position */
+        double ecef[3];
+        turtle_ecef_from_geodetic(
+            position.latitude,
+            position.longitude,
+            position.height,
+            ecef
+        );
+
+        /* Fetch location */
         int index[2];
         turtle_stepper_step(
             f->layers_stepper,
-            state->position,
+            ecef,
+            NULL,
             NULL,
             NULL,
             NULL,
             NULL,
             NULL,
-            &step,
             index
         );
+        STATS_COUNT(f, steps);
 
-        if (step_ptr != NULL) {
-                *step_ptr = (step <= FLT_EPSILON) ? FLT_EPSILON : step;
+        if (index > 0) {
+                const int top = f->api.geometry->size;
+                return (index[0] <= top) ? index[0] - 1 : top;
+        } else {
+                return -1;
         }
+}
 
-        if (medium_ptr != NULL) {
-                if ((index[0] >= 1) && (index[0] <= f->api.geometry->size)) {
-                        *medium_ptr = f->layers_media + (index[0] - 1);
-                } else if (index[0] == f->api.geometry->size + 1) {
-                        *medium_ptr = &f->atmosphere_medium;
-                } else if ((f->use_external_layer) &&
-                           (index[0] == f->api.geometry->size + 2)) {
-                        *medium_ptr = &f->atmosphere_medium;
-                } else {
-                        *medium_ptr = NULL;
+
+/* Callback for setting local properties of layers media */
+static double layers_locals(
+    struct pumas_medium * medium,
+    struct pumas_state * state,
+    struct pumas_locals * locals)
+{
+        struct state * s = (void *)state;
+        struct fluxmeter * f = s->fluxmeter;
+        ptrdiff_t i = medium - f->layers_media;
+        if (i >= 0) {
+                locals->density = f->api.geometry->layers[i]->density;
+        } else {
+                MULDER_ERROR("bad medium index (%d)", 16, (int)i);
+        }
+        return 0.;
+}
+
+
+/* CORSIKA parameterisation of the US standard atmospheric density */
+static double us_standard_function(double height, double lambda, double b)
+{
+        return 1E+01 * b / lambda * exp(-height / lambda);
+}
+
+static const double us_standard_hc[4] = {
+    4.E+03, 1.E+04, 4.E+04, 1.E+05
+};
+
+static const double us_standard_bi[4] = {
+    1222.6562E+00, 1144.9069E+00, 1305.5948E+00, 540.1778E+00
+};
+
+static const double us_standard_ci[4] = {
+    994186.38E+00, 878153.55E+00, 636143.04E+00, 772170.16E+00
+};
+
+static double us_standard_density(double height, double * lambda)
+{
+        const double * const hc = us_standard_hc;
+        const double * const bi = us_standard_bi;
+        const double * const ci = us_standard_ci;
+
+        /* Compute the local density */
+        int i;
+        for (i = 0; i < 4; i++) {
+                if (height < hc[i]) {
+                        const double lb = ci[i] * 1E-02;
+                        *lambda = lb;
+                        return us_standard_function(height, lb, bi[i]);
                 }
         }
 
-        return PUMAS_STEP_CHECK;
+        *lambda = ci[3] * 1E-02;
+        return us_standard_function(hc[3], ci[3] * 1E-02, bi[3]);
 }
 
 
-/* Pumas locator for the opensky geometry */
-static enum pumas_step opensky_geometry(
-    struct pumas_context * context,
-    struct pumas_state * state,
-    struct pumas_medium ** medium_ptr,
-    double * step_ptr)
+/* Column depth of the US standard atmosphere, integrated over height */
+static double us_standard_column(double h0, double h1)
 {
-        struct state * s = (void *)state;
-        struct fluxmeter * f = s->fluxmeter;
+        if (h0 > h1) return -us_standard_column(h1, h0);
 
-        double step;
-        int index[2];
-        turtle_stepper_step(
-            f->opensky_stepper,
-            state->position,
-            NULL,
-            NULL,
-            NULL,
-            NULL,
-            NULL,
-            &step,
-            index
-        );
+        const double * const hc = us_standard_hc;
+        const double * const bi = us_standard_bi;
+        const double * const ci = us_standard_ci;
 
-        if (step_ptr != NULL) {
+        /* Integrate exponential segments */
+        double column = 0.;
+        int i;
+        for (i = 0; (i < 4) && (h0 < h1); i++) {
+                if (h0 >= hc[i]) continue;
+                const double h = (h1 < hc[i]) ? h1 : hc[i];
+                const double lb = ci[i] * 1E-02;
+                column -= 1E+01 * bi[i] * exp(-h0 / lb) *
+                    expm1((h0 - h) / lb);
+                h0 = h;
+        }
+
+        /* Uniform density above the last segment */
+        if (h0 < h1) {
+                double lambda;
+                column += us_standard_density(h1, &lambda) * (h1 - h0);
+        }
+
+        return column;
+}
+
+
+/* Default atmosphere callback */
+static struct mulder_atmosphere default_atmosphere(double height)
+{
+        struct mulder_atmosphere atmosphere;
+        double lambda;
+        atmosphere.density = us_standard_density(height, &lambda);
+        atmosphere.gradient = atmosphere.density / lambda;
+        return atmosphere;
+}
+
+
+/* Compute rotation matrix from ECEF to ENU */
+static void ecef_to_enu(
+    double latitude,
+    double longitude,
+    double declination,
+    double inclination,
+    double rotation[3][3])
+{
+        turtle_ecef_from_horizontal(
+             latitude,
+             longitude,
+             90. + declination,
+             0.,
+             &rotation[0][0]
+        );
+
+        turtle_ecef_from_horizontal(
+            latitude,
+            longitude,
+            declination,
+            -inclination,
+            &rotation[1][0]
+        );
+
+        turtle_ecef_from_horizontal(
+            latitude,
+            longitude,
+            0.,
+            90. - inclination,
+            &rotation[2][0]
+        );
+}
+
+
+/* Transform a vector from ENU to ECEF (using transposed/inverse matrix) */
+static void enu_to_ecef(
+    double latitude,
+    double longitude,
+    const double enu[3],
+    double ecef[3])
+{
+        double rotation[3][3];
+        ecef_to_enu(
+            latitude,
+            longitude,
+            0.,
+            0.,
+            rotation
+        );
+
+        int i;
+        for (i = 0; i < 3; i++) {
+                ecef[i] = 0.;
+                int j;
+                for (j = 0; j < 3; j++) {
+                        ecef[i] += rotation[j][i] * enu[j];
+                }
+        }
+}
+
+
+/* Callback for setting local properties of the atmosphere. The geomagnet
+ * usage is a compile time constant (see below).
+ */
+static inline double atmosphere_locals(
+    struct pumas_medium * medium,
+    struct pumas_state * state,
+    struct pumas_locals * locals,
+    const int use_geomagnet)
+{
+        /* Get local density */
+        struct state * s = (void *)state;
+        struct fluxmeter * f = s->fluxmeter;
+        double latitude, longitude, height;
+        turtle_ecef_to_geodetic(
+            state->position,
+            &latitude,
+            &longitude,
+            &height
+        );
+        struct mulder_atmosphere atmosphere =
+            f->api.geometry->atmosphere(height);
+        locals->density = atmosphere.density;
+
+        double lambda;
+        if (fabs(atmosphere.gradient) > 1E-09 * atmosphere.density) {
+                double azimuth, elevation;
+                turtle_ecef_to_horizontal(
+                    latitude,
+                    longitude,
+                    state->direction,
+                    &azimuth,
+                    &elevation
+                );
+                double c = fabs(sin(elevation * M_PI / 180));
+                if (c < 0.1) c = 0.1;
+                lambda = atmosphere.density / (c * atmosphere.gradient);
+        } else {
+                lambda = 1E+09;
+        }
+
+        if (!use_geomagnet) {
+                return lambda;
+        }
+
+        /* Get local geomagnetic field, from the grid if available */
+        double lambda_g = 1E+03;
+        if (geomagnet_grid_field(f->current_geomagnet, latitude, longitude,
+            height, locals->magnet) == 0) {
+                lambda_g /= f->context->accuracy;
+                return (lambda < lambda_g) ? lambda : lambda_g;
+        }
+
+        /* Otherwise, use the cached field */
+        double d2 = 0.;
+        int i;
+        for (i = 0; i < 3; i++) {
+                const double tmp =
+                    state->position[i] - f->geomagnet_position[i];
+                d2 += tmp * tmp;
+        }
+        if (d2 > lambda_g * lambda_g) {
+                /* Get the local magnetic field (in ENU frame) */
+                STATS_COUNT(f, geomagnet_misses);
+                double enu[3];
+                gull_snapshot_field(
+                    f->current_geomagnet->snapshot,
+                    latitude,
+                    longitude,
+                    height,
+                    enu,
+                    &f->geomagnet_workspace
+                );
+
+                /* Transform to ECEF and update the cache */
+                enu_to_ecef(latitude, longitude, enu, f->geomagnet_field);
+                memcpy(
+                    f->geomagnet_position,
+                    state->position,
+                    sizeof f->geomagnet_position
+                );
+        }
+
+        /* Fetch the cached geomagnetic field */
+        memcpy(
+            locals->magnet,
+            f->geomagnet_field,
+            sizeof locals->magnet
+        );
+
+        lambda_g /= f->context->accuracy;
+        return (lambda < lambda_g) ? lambda : lambda_g;
+}
+
+
+#define ATMOSPHERE_LOCALS(NAME, USE_GEOMAGNET)                                 \
+static double NAME(                                                            \
+    struct pumas_medium * medium,                                              \
+    struct pumas_state * state,                                                \
+    struct pumas_locals * locals)                                              \
+{                                                                              \
+        return atmosphere_locals(medium, state, locals, USE_GEOMAGNET);        \
+}
+
+ATMOSPHERE_LOCALS(atmosphere_locals_plain, 0)
+ATMOSPHERE_LOCALS(atmosphere_locals_geomagnet, 1)
+
+
+/* Pumas locator for the layered geometry. The external layer usage is a
+ * compile time constant (see below).
+ */
+static inline enum pumas_step layers_geometry(
+    struct pumas_context * context,
+    struct pumas_state * state,
+    struct pumas_medium ** medium_ptr,
+    double * step_ptr,
+    const int use_external_layer)
+{
+        struct state * s = (void *)state;
+        struct fluxmeter * f = s->fluxmeter;
+
+        double step;
+        int index[2];
+        turtle_stepper_step(
+            f->layers_stepper,
+            state->position,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            &step,
+            index
+        );
+        STATS_COUNT(f, steps);
+
+        if (step_ptr != NULL) {
+                *step_ptr = (step <= FLT_EPSILON) ? FLT_EPSILON : step;
+        }
+
+        if (medium_ptr != NULL) {
+                if ((index[0] >= 1) && (index[0] <= f->api.geometry->size)) {
+                        *medium_ptr = f->layers_media + (index[0] - 1);
+                } else if (index[0] == f->api.geometry->size + 1) {
+                        *medium_ptr = &f->atmosphere_medium;
+                } else if (use_external_layer &&
+                           (index[0] == f->api.geometry->size + 2)) {
+                        *medium_ptr = &f->atmosphere_medium;
+                } else {
+                        *medium_ptr = NULL;
+                }
+        }
+
+        return PUMAS_STEP_CHECK;
+}
+
+
+#define LAYERS_GEOMETRY(NAME, USE_EXTERNAL_LAYER)                              \
+static enum pumas_step NAME(                                                   \
+    struct pumas_context * context,                                            \
+    struct pumas_state * state,                                                \
+    struct pumas_medium ** medium_ptr,                                         \
+    double * step_ptr)                                                         \
+{                                                                              \
+        return layers_geometry(context, state, medium_ptr, step_ptr,           \
+            USE_EXTERNAL_LAYER);                                               \
+}
+
+LAYERS_GEOMETRY(layers_geometry_internal, 0)
+LAYERS_GEOMETRY(layers_geometry_external, 1)
+
+
+/* Pumas locator for the opensky geometry */
+static enum pumas_step opensky_geometry(
+    struct pumas_context * context,
+    struct pumas_state * state,
+    struct pumas_medium ** medium_ptr,
+    double * step_ptr)
+{
+        struct state * s = (void *)state;
+        struct fluxmeter * f = s->fluxmeter;
+
+        double step;
+        int index[2];
+        turtle_stepper_step(
+            f->opensky_stepper,
+            state->position,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            &step,
+            index
+        );
+        STATS_COUNT(f, steps);
+
+        if (step_ptr != NULL) {
                 *step_ptr = (step <= FLT_EPSILON) ? FLT_EPSILON : step;
         }
 
-        if (medium_ptr != NULL) {
-                if (index[0] == 1) {
-                        *medium_ptr = &f->atmosphere_medium;
-                } else {
-                        *medium_ptr = NULL;
-                }
-        }
+        if (medium_ptr != NULL) {
+                if (index[0] == 1) {
+                        *medium_ptr = &f->atmosphere_medium;
+                } else {
+                        *medium_ptr = NULL;
+                }
+        }
+
+        return PUMAS_STEP_CHECK;
+}
+
+
+/* Floating point selects must be if-converted for vectorizing flux kernels.
+ * With GCC, this requires to disable floating point traps (which are not used
+ * by Mulder).
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize ("no-trapping-math")
+#endif
+
+
+/* Branch-free elementary functions, used by flux kernels.
+ *
+ * Contrary to libm calls, these functions are inlined. Thus, loops over
+ * samples can be auto-vectorized by the compiler (e.g. using SSE, AVX or NEON
+ * instructions). Polynomial coefficients are those of fdlibm (Sun
+ * Microsystems). The relative accuracy is of a few 1E-16.
+ */
+static inline double vector_exp(double x)
+{
+        /* Range reduction, x = n * ln(2) + r, with |r| <= ln(2) / 2 */
+        const double shift = 6755399441055744.; /* 1.5 * 2^52 */
+        x = (x < -708.) ? -708. : x;
+        x = (x > 709.) ? 709. : x;
+        const double t = x * 1.44269504088896340736 + shift;
+        const double n = t - shift;
+        const double r = (x - n * 6.93147180369123816490E-01) -
+            n * 1.90821492927058770002E-10;
+
+        /* Rational approximation of exp(r) */
+        const double r2 = r * r;
+        const double c = r - r2 * (1.66666666666666019037E-01 +
+            r2 * (-2.77777777770155933842E-03 +
+            r2 * (6.61375632143793436117E-05 +
+            r2 * (-1.65339022054652515390E-06 +
+            r2 * 4.13813679705723846039E-08))));
+        const double p = 1. + (r + r * c / (2. - c));
+
+        /* Scale by 2^n, using the integer bits of t */
+        int64_t it, is;
+        memcpy(&it, &t, sizeof it);
+        memcpy(&is, &shift, sizeof is);
+        const int64_t ie = (it - is + 1023) << 52;
+        double scale;
+        memcpy(&scale, &ie, sizeof scale);
+        return p * scale;
+}
+
+static inline double vector_log(double x)
+{
+        /* Note that x must be positive and normal. Otherwise, a meaningless
+         * value is returned (without any floating point exception).
+         */
+
+        /* Range reduction, x = m * 2^e, with sqrt(1/2) <= m < sqrt(2) */
+        uint64_t ix;
+        memcpy(&ix, &x, sizeof ix);
+        const uint64_t one = 0x3FF0000000000000ULL;
+        const uint64_t eb = (ix - 0x3FE6A09E667F3BCDULL + one) >> 52;
+        const uint64_t im = ix - (eb << 52) + one;
+        double m;
+        memcpy(&m, &im, sizeof m);
+
+        /* Convert the (biased) exponent to a floating point value */
+        const uint64_t ie = 0x4330000000000000ULL | eb;
+        double e;
+        memcpy(&e, &ie, sizeof e);
+        e -= 4503599627370496. + 1023.;
+
+        /* Approximation of log(m), with s = (m - 1) / (m + 1) */
+        const double f = m - 1.;
+        const double s = f / (2. + f);
+        const double z = s * s;
+        const double R = z * (6.666666666666735130E-01 +
+            z * (3.999999999940941908E-01 +
+            z * (2.857142874366239149E-01 +
+            z * (2.222219843214978396E-01 +
+            z * (1.818357216161805012E-01 +
+            z * (1.531383769920937332E-01 +
+            z * 1.479819860511658591E-01))))));
+        const double hfsq = 0.5 * f * f;
+        const double lm = f - (hfsq - s * (hfsq + R));
+
+        return e * 6.93147180369123816490E-01 +
+            (lm + e * 1.90821492927058770002E-10);
+}
+
+static inline double vector_sind(double angle) /* angle in deg */
+{
+        /* Range reduction, to [-90, 90] deg */
+        const double shift = 6755399441055744.;
+        double t = angle - 360. * ((angle * (1. / 360.) + shift) - shift);
+        t = (t > 90.) ? 180. - t : t;
+        t = (t < -90.) ? -180. - t : t;
+        const double x = t * (M_PI / 180.);
+
+        /* Taylor expansion of sin(x) */
+        const double x2 = x * x;
+        double p = 1. / 51090942171709440000.;
+        p = -p * x2 + 1. / 121645100408832000.;
+        p = -p * x2 + 1. / 355687428096000.;
+        p = -p * x2 + 1. / 1307674368000.;
+        p = -p * x2 + 1. / 6227020800.;
+        p = -p * x2 + 1. / 39916800.;
+        p = -p * x2 + 1. / 362880.;
+        p = -p * x2 + 1. / 5040.;
+        p = -p * x2 + 1. / 120.;
+        p = -p * x2 + 1. / 6.;
+        p = -p * x2 + 1.;
+        return p * x;
+}
+
+
+/* Dispatch of batched kernels, using runtime CPU detection (if available) */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) &&         \
+    defined(__linux__)
+#define VECTORIZED __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTORIZED
+#endif
+
+
+/* Gaisser's flux model (in GeV^-1 m^-2 s^-1 sr^-1), up to the spectral factor
+ *
+ * The full model is obtained by multiplying with Emu^-2.7, where Emu is the
+ * muon total energy. This factor is left to callers, in order to factorise
+ * computations with Guan et al. correction below.
+ *
+ * Ref: see e.g. the ch.30 of the PDG (https://pdglive.lbl.gov)
+ */
+static inline double flux_gaisser(double cos_theta, double kinetic_energy)
+{
+        const double Emu = kinetic_energy + 0.10566;
+        const double ec = 1.1 * Emu * cos_theta;
+        const double rpi = 1. + ec / 115.;
+        const double rK = 1. + ec / 850.;
+        const double value = 1.4E+03 * (1. / rpi + 0.054 / rK);
+        return (cos_theta < 0.) ? 0. : value;
+}
+
+
+/* Volkova's parameterization of cos(theta*)
+ *
+ * This is a correction for the Earth curvature, relevant for close to
+ * horizontal trajectories. The squared value is returned, for a non-negative
+ * cos(theta).
+ * */
+static inline double cos_theta_star2(double cos_theta)
+{
+        const double p[] = {
+            0.102573, -0.068287, 0.958633, 0.0407253, 0.817285};
+        const double c = (cos_theta > DBL_MIN) ? cos_theta : DBL_MIN;
+        const double lc = vector_log(c);
+        return
+            (
+                cos_theta * cos_theta +
+                p[0] * p[0] +
+                p[1] * vector_exp(p[2] * lc) +
+                p[3] * vector_exp(p[4] * lc))
+            /
+            (
+                1. +
+                p[0] * p[0] +
+                p[1] +
+                p[3]
+            )
+        ;
+}
+
+
+/*
+ * Guan et al. parameterization of the sea level flux of atmospheric muons
+ * Ref: https://arxiv.org/abs/1509.06176
+ *
+ * Note that the correction factor, (1 + 3.64 / (Emu * cs^1.29))^-2.7, is
+ * merged with Gaisser's spectral factor, Emu^-2.7.
+ */
+static inline double flux_gccly(double cos_theta, double kinetic_energy)
+{
+        const double Emu = kinetic_energy + MUON_MASS;
+        const double lcs2 = vector_log(cos_theta_star2(cos_theta));
+        const double cs = vector_exp(0.5 * lcs2);
+        const double value =
+            vector_exp(-2.7 * vector_log(
+                Emu + 3.64 * vector_exp(-0.645 * lcs2))) *
+            flux_gaisser(cs, kinetic_energy)
+        ;
+        return (cos_theta < 0.) ? 0. : value;
+}
+
+
+/* Fraction of the muon flux for a given charge */
+static double charge_fraction(enum mulder_pid pid)
+{
+        /* Use a constant charge ratio.
+         * Ref: CMS (https://arxiv.org/abs/1005.5332)
+         */
+        const double charge_ratio = 1.2766;
+
+        if (pid == MULDER_MUON) {
+                return 1. / (1. + charge_ratio);
+        } else if (pid == MULDER_ANTIMUON) {
+                return charge_ratio / (1. + charge_ratio);
+        } else {
+                return 1.;
+        }
+}
+
+
+/* Default reference flux model, in GeV^-1 m^-2 s^-1 sr^-1 */
+static struct mulder_flux reference_flux(
+    struct mulder_reference * reference,
+    double height,
+    double elevation,
+    double kinetic_energy)
+{
+        struct mulder_flux result = {0.};
+        if ((height >= reference->height_min) &&
+            (height <= reference->height_max)) {
+                const double cos_theta = vector_sind(elevation);
+                result.value = flux_gccly(cos_theta, kinetic_energy);
+                const double f = charge_fraction(MULDER_ANTIMUON);
+                result.asymmetry = 2 * f - 1.;
+        }
+        return result;
+}
+
+VECTORIZED
+static void reference_flux_v(
+    struct mulder_reference * reference,
+    int size,
+    const double * height,
+    const double * elevation,
+    const double * kinetic_energy,
+    struct mulder_flux * flux)
+{
+        const double height_min = reference->height_min;
+        const double height_max = reference->height_max;
+        const double asymmetry = 2 * charge_fraction(MULDER_ANTIMUON) - 1.;
+        int i;
+        for (i = 0; i < size; i++) {
+                const int valid = (height[i] >= height_min) &
+                                  (height[i] <= height_max);
+                const double cos_theta = vector_sind(elevation[i]);
+                const double value = flux_gccly(cos_theta, kinetic_energy[i]);
+                flux[i].value = valid ? value : 0.;
+                flux[i].asymmetry = valid ? asymmetry : 0.;
+        }
+}
+
+static struct mulder_reference default_reference = {
+        .energy_min = 1E-04,
+        .energy_max = 1E+21,
+        .height_min = 0.,
+        .height_max = 0.,
+        .flux = &reference_flux,
+        .flux_v = &reference_flux_v
+};
+
+static struct mulder_reference * reference_default(void)
+{
+        struct mulder_reference * reference = malloc(sizeof *reference);
+        if (reference == NULL) {
+                raise_error("could not allocate memory");
+                return NULL;
+        }
+
+        memcpy(reference, &default_reference, sizeof * reference);
+
+        return reference;
+}
+
+
+/* Data layout for a tabulated reference flux */
+struct reference_table {
+        struct mulder_reference api;
+        int n_k;
+        int n_c;
+        int n_h;
+        double k_min;
+        double k_max;
+        double c_min;
+        double c_max;
+        double h_min;
+        double h_max;
+        const float * data;
+        /* Data layout (see reference_header) and validity mask (if any) */
+        int layout;
+        const uint8_t * mask;
+        /* Memory mapping (or allocated memory, if map_size is null) */
+        void * map;
+        size_t map_size;
+        /* Precomputed grid properties */
+        double log_k_min;
+        double inv_dlk;
+        double inv_dc;
+        double inv_dh;
+        double c_lo;
+        double c_hi;
+        double h_lo;
+        double h_hi;
+};
+
+
+/* Precompute grid properties of a tabulated reference flux */
+static void reference_table_initialise(struct reference_table * table)
+{
+        table->log_k_min = log(table->k_min);
+        table->inv_dlk = (table->n_k - 1) / log(table->k_max / table->k_min);
+        table->inv_dc = (table->n_c - 1) / (table->c_max - table->c_min);
+        table->c_lo = (table->c_min < table->c_max) ?
+            table->c_min : table->c_max;
+        table->c_hi = (table->c_min < table->c_max) ?
+            table->c_max : table->c_min;
+        if (table->n_h > 1) {
+                table->inv_dh = (table->n_h - 1) /
+                    (table->h_max - table->h_min);
+                table->h_lo = (table->h_min < table->h_max) ?
+                    table->h_min : table->h_max;
+                table->h_hi = (table->h_min < table->h_max) ?
+                    table->h_max : table->h_min;
+        } else {
+                table->inv_dh = 0.;
+                table->h_lo = -INFINITY;
+                table->h_hi = INFINITY;
+        }
+}
+
+
+/* Log interpolation, or linear one if a value is not strictly positive */
+static inline double interpolate_log(double g0, double g1, double h)
+{
+        const double lin = g0 * (1. - h) + g1 * h;
+        const double lg = vector_exp(
+            vector_log(g0) * (1. - h) + vector_log(g1) * h);
+        return (g0 > 0.) ? ((g1 > 0.) ? lg : lin) : lin;
+}
+
+
+/* Grid index and interpolation coefficient, for a regular grid */
+static inline int grid_index(double x, int n, double * h)
+{
+        x = (x >= 0.) ? x : 0.; /* This also discards NaN values */
+        x = (x <= n - 1) ? x : n - 1;
+        const int i = (int)x;
+        *h = x - i;
+        return i;
+}
+
+
+/* Cell index and interpolation coefficient, for a regular grid */
+static inline int grid_cell(double x, int n, double * h)
+{
+        x = (x >= 0.) ? x : 0.; /* This also discards NaN values */
+        x = (x <= n - 1) ? x : n - 1;
+        int i = (int)x;
+        i = (i < n - 2) ? i : n - 2;
+        i = (i > 0) ? i : 0;
+        *h = x - i;
+        return i;
+}
+
+
+/* Check if a sample lies within a tabulated reference flux */
+static inline int reference_table_valid(
+    const struct reference_table * table,
+    double height,
+    double cos_theta,
+    double kinetic_energy)
+{
+        return (kinetic_energy >= table->k_min) &
+               (kinetic_energy <= table->k_max) &
+               (cos_theta >= table->c_lo) & (cos_theta <= table->c_hi) &
+               (height >= table->h_lo) & (height <= table->h_hi);
+}
+
+
+/* Location of a sample in a tabulated reference flux (branch-free) */
+static inline int reference_table_locate(
+    const struct reference_table * table,
+    double height,
+    double cos_theta,
+    double kinetic_energy,
+    double * hk,
+    double * hc,
+    double * hh,
+    int * index)
+{
+        /* Compute the interpolation indices and coefficients */
+        const int valid = reference_table_valid(
+            table, height, cos_theta, kinetic_energy);
+
+        /* Note that indices are clamped to the table, for invalid samples */
+        const int ik = grid_index(
+            (vector_log(kinetic_energy) - table->log_k_min) * table->inv_dlk,
+            table->n_k, hk);
+        const int ic = grid_index(
+            (cos_theta - table->c_min) * table->inv_dc,
+            table->n_c, hc);
+        const int ih = grid_index(
+            (height - table->h_min) * table->inv_dh,
+            table->n_h, hh);
+
+        *index = (ih * table->n_c + ic) * table->n_k + ik;
+        return valid;
+}
+
+
+/* Linear interpolation along cos(theta), at the corners of a table cell
+ *
+ * Values are returned for each charge (mu+, mu-), for each corner along
+ * log(kinetic) and altitude, i.e. as g[(2 * (2 * h + k) + charge) * stride].
+ * Null values are returned for invalid samples.
+ */
+static inline void reference_table_corners(
+    const struct reference_table * table,
+    int valid,
+    int index,
+    double hc,
+    double * g,
+    int stride)
+{
+        const int ik = index % table->n_k;
+        const int ic = (index / table->n_k) % table->n_c;
+        const int ih = index / (table->n_k * table->n_c);
+        const int dk = (ik < table->n_k - 1) ? 2 : 0;
+        const int dc = (ic < table->n_c - 1) ? 2 * table->n_k : 0;
+        const int dh = (ih < table->n_h - 1) ? 2 * table->n_k * table->n_c : 0;
+
+        const float * const f000 = table->data + 2 * index;
+        const float * const corners[4] = {
+            f000, f000 + dk, f000 + dh, f000 + dh + dk};
+        int i;
+        for (i = 0; i < 4; i++) {
+                const float * const f0 = corners[i];
+                const float * const f1 = f0 + dc;
+                g[2 * i * stride] = valid ?
+                    f0[0] * (1. - hc) + f1[0] * hc : 0.;
+                g[(2 * i + 1) * stride] = valid ?
+                    f0[1] * (1. - hc) + f1[1] * hc : 0.;
+        }
+}
+
+
+/* Total flux and charge asymmetry, from mu+ and mu- fluxes */
+static inline struct mulder_flux reference_table_result(double f0, double f1)
+{
+        const double tmp = f0 + f1;
+        struct mulder_flux result = {
+                .value = (tmp > 0.) ? tmp : 0.,
+                .asymmetry = (tmp > 0.) ? (f0 - f1) / tmp : 0.
+        };
+        return result;
+}
+
+
+/* Log or linear interpolation along log(kinetic) and altitude */
+static inline struct mulder_flux reference_table_combine(
+    double hk,
+    double hh,
+    const double * g,
+    int stride)
+{
+        const double flux[2] = {
+            interpolate_log(
+                interpolate_log(g[0], g[2 * stride], hk),
+                interpolate_log(g[4 * stride], g[6 * stride], hk),
+                hh),
+            interpolate_log(
+                interpolate_log(g[stride], g[3 * stride], hk),
+                interpolate_log(g[5 * stride], g[7 * stride], hk),
+                hh)
+        };
+
+        return reference_table_result(flux[0], flux[1]);
+}
+
+
+/* Intepolation of tabulated reference flux */
+static struct mulder_flux reference_table_flux(
+    struct mulder_reference * reference,
+    double height,
+    double elevation,
+    double kinetic_energy)
+{
+        const struct reference_table * table = (void *)reference;
+        double hk, hc, hh, g[8];
+        int index;
+        const int valid = reference_table_locate(table, height,
+            vector_sind(elevation), kinetic_energy, &hk, &hc, &hh, &index);
+        reference_table_corners(table, valid, index, hc, g, 1);
+        return reference_table_combine(hk, hh, g, 1);
+}
+
+
+/* Batched interpolation of tabulated reference flux
+ *
+ * Samples are processed by blocks, in three passes. The first and last passes
+ * are vectorized. The second one gathers table data.
+ */
+#define TABLE_BLOCK_SIZE 64
+
+VECTORIZED
+static void reference_table_flux_v(
+    struct mulder_reference * reference,
+    int size,
+    const double * height,
+    const double * elevation,
+    const double * kinetic_energy,
+    struct mulder_flux * flux)
+{
+        const struct reference_table * table = (void *)reference;
+        double hk[TABLE_BLOCK_SIZE], hc[TABLE_BLOCK_SIZE],
+            hh[TABLE_BLOCK_SIZE], g[8 * TABLE_BLOCK_SIZE];
+        int index[TABLE_BLOCK_SIZE], valid[TABLE_BLOCK_SIZE];
+
+        while (size > 0) {
+                const int n = (size < TABLE_BLOCK_SIZE) ?
+                    size : TABLE_BLOCK_SIZE;
+                int i;
+                for (i = 0; i < n; i++) {
+                        valid[i] = reference_table_locate(table, height[i],
+                            vector_sind(elevation[i]), kinetic_energy[i],
+                            hk + i, hc + i, hh + i, index + i);
+                }
+                for (i = 0; i < n; i++) {
+                        reference_table_corners(table, valid[i], index[i],
+                            hc[i], g + i, TABLE_BLOCK_SIZE);
+                }
+                for (i = 0; i < n; i++) {
+                        flux[i] = reference_table_combine(hk[i], hh[i],
+                            g + i, TABLE_BLOCK_SIZE);
+                }
+                size -= n;
+                height += n;
+                elevation += n;
+                kinetic_energy += n;
+                flux += n;
+        }
+}
+
+
+/* Location of a sample in a log-space table (branch-free) */
+static inline int reference_table_locate_cell(
+    const struct reference_table * table,
+    double height,
+    double cos_theta,
+    double kinetic_energy,
+    double * hk,
+    double * hc,
+    double * hh,
+    int * cell)
+{
+        const int valid = reference_table_valid(
+            table, height, cos_theta, kinetic_energy);
+
+        /* Note that indices are clamped to the table, for invalid samples */
+        const int ik = grid_cell(
+            (vector_log(kinetic_energy) - table->log_k_min) * table->inv_dlk,
+            table->n_k, hk);
+        const int ic = grid_cell(
+            (cos_theta - table->c_min) * table->inv_dc,
+            table->n_c, hc);
+        const int ih = grid_cell(
+            (height - table->h_min) * table->inv_dh,
+            table->n_h, hh);
+
+        *cell = (ih * (table->n_c - 1) + ic) * (table->n_k - 1) + ik;
+        return valid;
+}
+
+
+/* Trilinear interpolation over a cell of a log-space table
+ *
+ * For each charge, the interpolated log-flux is returned as l. If some
+ * corner values are not strictly positive (according to the table mask),
+ * then a linear interpolation of the flux is done instead. The result is
+ * returned as lin, which is negative otherwise.
+ */
+static inline void reference_table_cell(
+    const struct reference_table * table,
+    int valid,
+    int cell,
+    double hk,
+    double hc,
+    double hh,
+    double * l,
+    double * lin,
+    int stride)
+{
+        const float * const f = table->data + 16 * cell;
+        const int mask = valid ? table->mask[cell] : 0;
+
+        const double wk[2] = {1. - hk, hk};
+        const double wc[2] = {1. - hc, hc};
+        const double wh[2] = {1. - hh, hh};
+        double w[8];
+        int i;
+        for (i = 0; i < 8; i++) {
+                w[i] = wh[i >> 2] * wc[(i >> 1) & 1] * wk[i & 1];
+        }
+
+        for (i = 0; i < 2; i++) {
+                double s = 0.;
+                int j;
+                if (mask & (1 << i)) {
+                        for (j = 0; j < 8; j++) s += w[j] * f[2 * j + i];
+                        l[i * stride] = s;
+                        lin[i * stride] = -1.;
+                } else {
+                        if (valid) {
+                                for (j = 0; j < 8; j++) {
+                                        s += w[j] * exp(f[2 * j + i]);
+                                }
+                        }
+                        l[i * stride] = 0.;
+                        lin[i * stride] = s;
+                }
+        }
+}
+
+
+/* Flux from the interpolation of a log-space table cell */
+static inline struct mulder_flux reference_table_cell_combine(
+    const double * l, const double * lin, int stride)
+{
+        const double f0 = (lin[0] < 0.) ? vector_exp(l[0]) : lin[0];
+        const double f1 = (lin[stride] < 0.) ?
+            vector_exp(l[stride]) : lin[stride];
+        return reference_table_result(f0, f1);
+}
+
+
+/* Intepolation of a log-space tabulated reference flux */
+static struct mulder_flux reference_table_log_flux(
+    struct mulder_reference * reference,
+    double height,
+    double elevation,
+    double kinetic_energy)
+{
+        const struct reference_table * table = (void *)reference;
+        double hk, hc, hh, l[2], lin[2];
+        int cell;
+        const int valid = reference_table_locate_cell(table, height,
+            vector_sind(elevation), kinetic_energy, &hk, &hc, &hh, &cell);
+        reference_table_cell(table, valid, cell, hk, hc, hh, l, lin, 1);
+        return reference_table_cell_combine(l, lin, 1);
+}
+
+
+/* Batched interpolation of a log-space tabulated reference flux */
+VECTORIZED
+static void reference_table_log_flux_v(
+    struct mulder_reference * reference,
+    int size,
+    const double * height,
+    const double * elevation,
+    const double * kinetic_energy,
+    struct mulder_flux * flux)
+{
+        const struct reference_table * table = (void *)reference;
+        double hk[TABLE_BLOCK_SIZE], hc[TABLE_BLOCK_SIZE],
+            hh[TABLE_BLOCK_SIZE], l[2 * TABLE_BLOCK_SIZE],
+            lin[2 * TABLE_BLOCK_SIZE];
+        int cell[TABLE_BLOCK_SIZE], valid[TABLE_BLOCK_SIZE];
+
+        while (size > 0) {
+                const int n = (size < TABLE_BLOCK_SIZE) ?
+                    size : TABLE_BLOCK_SIZE;
+                int i;
+                for (i = 0; i < n; i++) {
+                        valid[i] = reference_table_locate_cell(table,
+                            height[i], vector_sind(elevation[i]),
+                            kinetic_energy[i], hk + i, hc + i, hh + i,
+                            cell + i);
+                }
+                for (i = 0; i < n; i++) {
+                        reference_table_cell(table, valid[i], cell[i], hk[i],
+                            hc[i], hh[i], l + i, lin + i, TABLE_BLOCK_SIZE);
+                }
+                for (i = 0; i < n; i++) {
+                        flux[i] = reference_table_cell_combine(
+                            l + i, lin + i, TABLE_BLOCK_SIZE);
+                }
+                size -= n;
+                height += n;
+                elevation += n;
+                kinetic_energy += n;
+                flux += n;
+        }
+}
+
+/* Tabulated flux at a fixed observation position (see mulder_fluxmap) */
+struct fluxmap_axis {
+        int size;
+        const double * nodes;
+        /* Lookup of intervals, over regular bins */
+        int n_bins;
+        double min;
+        double inv_dbin;
+        int * bins;
+};
+
+struct fluxmap {
+        struct mulder_fluxmap api;
+        struct fluxmap_axis axes[2]; /* azimuth, elevation */
+        double log_k_min;
+        double inv_dlk;
+        float * data;
+        double * nodes; /* allocated axes nodes (if not mapped) */
+        /* Memory mapping (read-only), if map_size is not null */
+        void * map;
+        size_t map_size;
+};
+
+
+/* Location of a sample over an irregular axis, using regular bins */
+static inline int fluxmap_axis_locate(
+    const struct fluxmap_axis * axis,
+    double x,
+    double * h)
+{
+        int b = grid_index((x - axis->min) * axis->inv_dbin, axis->n_bins,
+            h);
+        int i = axis->bins[b];
+        while ((i < axis->size - 2) && (x >= axis->nodes[i + 1])) i++;
+        const double x0 = axis->nodes[i], x1 = axis->nodes[i + 1];
+        double u = (x - x0) / (x1 - x0);
+        u = (u >= 0.) ? u : 0.; /* This also discards NaN values */
+        *h = (u <= 1.) ? u : 1.;
+        return i;
+}
+
+
+/* Location of a sample in a flux map. Angles are bilinearly interpolated at
+ * both energy corners, for each charge, as g[(2 * k + charge) * stride].
+ */
+static inline int fluxmap_locate(
+    const struct fluxmap * map,
+    double azimuth,
+    double elevation,
+    double kinetic_energy,
+    double * hk,
+    double * g,
+    int stride)
+{
+        const struct mulder_fluxmap * api = &map->api;
+        const double * az = map->axes[0].nodes;
+        const double * el = map->axes[1].nodes;
+        const double az_min = az[0], az_max = az[api->n_azimuth - 1];
+        if (az_max - az_min >= 360.) {
+                /* Full turn */
+                azimuth = fmod(azimuth - az_min, 360.);
+                if (azimuth < 0.) azimuth += 360.;
+                azimuth += az_min;
+        }
+        const int valid = (kinetic_energy >= api->energy_min) &&
+            (kinetic_energy <= api->energy_max) &&
+            (azimuth >= az_min) && (azimuth <= az_max) &&
+            (elevation >= el[0]) && (elevation <= el[api->n_elevation - 1]);
+
+        double ha, he;
+        const int ia = fluxmap_axis_locate(map->axes, azimuth, &ha);
+        const int ie = fluxmap_axis_locate(map->axes + 1, elevation, &he);
+        const int ik = grid_index(
+            (log(kinetic_energy) - map->log_k_min) * map->inv_dlk,
+            api->n_energy, hk);
+        const int dk = (ik < api->n_energy - 1) ? 2 : 0;
+        const int de = 2 * api->n_energy;
+        const int da = de * api->n_elevation;
+
+        const float * const f = map->data +
+            ((size_t)ia * api->n_elevation + ie) * de + 2 * ik;
+        const double w[4] = {
+            (1. - ha) * (1. - he), (1. - ha) * he, ha * (1. - he), ha * he
+        };
+        const float * const corners[4] = {f, f + de, f + da, f + da + de};
+        int k, charge, i;
+        for (k = 0; k < 2; k++) {
+                for (charge = 0; charge < 2; charge++) {
+                        double s = 0.;
+                        if (valid) {
+                                for (i = 0; i < 4; i++) {
+                                        s += w[i] *
+                                            corners[i][k * dk + charge];
+                                }
+                        }
+                        g[(2 * k + charge) * stride] = s;
+                }
+        }
+        return valid;
+}
+
+
+/* Log interpolation along energy, from angular interpolations */
+static inline struct mulder_flux fluxmap_combine(
+    double hk,
+    const double * g,
+    int stride)
+{
+        return reference_table_result(
+            interpolate_log(g[0], g[2 * stride], hk),
+            interpolate_log(g[stride], g[3 * stride], hk));
+}
+
+
+struct mulder_flux mulder_fluxmap_flux(
+    const struct mulder_fluxmap * fluxmap,
+    const struct mulder_direction direction,
+    double kinetic_energy)
+{
+        const struct fluxmap * map = (void *)fluxmap;
+        double hk, g[4];
+        fluxmap_locate(map, direction.azimuth, direction.elevation,
+            kinetic_energy, &hk, g, 1);
+        return fluxmap_combine(hk, g, 1);
+}
+
+
+/* Batched interpolation of a flux map. As for tabulated reference fluxes,
+ * samples are processed by blocks, and the last pass is vectorized.
+ */
+VECTORIZED
+void mulder_fluxmap_flux_batch(
+    const struct mulder_fluxmap * fluxmap,
+    int size,
+    const double * azimuth,
+    const double * elevation,
+    const double * kinetic_energy,
+    struct mulder_flux * flux)
+{
+        const struct fluxmap * map = (void *)fluxmap;
+        double hk[TABLE_BLOCK_SIZE], g[4 * TABLE_BLOCK_SIZE];
+
+        while (size > 0) {
+                const int n = (size < TABLE_BLOCK_SIZE) ?
+                    size : TABLE_BLOCK_SIZE;
+                int i;
+                for (i = 0; i < n; i++) {
+                        fluxmap_locate(map, azimuth[i], elevation[i],
+                            kinetic_energy[i], hk + i, g + i,
+                            TABLE_BLOCK_SIZE);
+                }
+                for (i = 0; i < n; i++) {
+                        flux[i] = fluxmap_combine(hk[i], g + i,
+                            TABLE_BLOCK_SIZE);
+                }
+                size -= n;
+                azimuth += n;
+                elevation += n;
+                kinetic_energy += n;
+                flux += n;
+        }
+}
+
+/* Batched conversion of observation states to ECEF coordinates.
+ *
+ * This is equivalent to turtle_ecef_from_geodetic and
+ * turtle_ecef_from_horizontal, but using inlined functions (see above). Thus,
+ * conversions can be vectorized.
+ */
+VECTORIZED
+static void batch_ecef(struct batch * batch)
+{
+        /* WGS84 ellipsoid */
+        const double a = 6378137.;
+        const double e2 = 6.69437999014E-03;
+
+        int i;
+        for (i = 0; i < batch->size; i++) {
+                const double sl = vector_sind(batch->latitude[i]);
+                const double cl = vector_sind(90. - batch->latitude[i]);
+                const double sp = vector_sind(batch->longitude[i]);
+                const double cp = vector_sind(90. - batch->longitude[i]);
+                const double sa = vector_sind(batch->azimuth[i]);
+                const double ca = vector_sind(90. - batch->azimuth[i]);
+                const double se = vector_sind(batch->elevation[i]);
+                const double ce = vector_sind(90. - batch->elevation[i]);
+
+                /* Geodetic to ECEF position */
+                const double h = batch->height[i];
+                const double n = a / sqrt(1. - e2 * sl * sl);
+                batch->position[0][i] = (n + h) * cl * cp;
+                batch->position[1][i] = (n + h) * cl * sp;
+                batch->position[2][i] = (n * (1. - e2) + h) * sl;
+
+                /* Horizontal (ENU) to ECEF direction */
+                const double east = ce * sa;
+                const double north = ce * ca;
+                batch->direction[0][i] = -sp * east - sl * cp * north +
+                    cl * cp * se;
+                batch->direction[1][i] = cp * east - sl * sp * north +
+                    cl * sp * se;
+                batch->direction[2][i] = cl * north + sl * se;
+        }
+}
+
+/* Bilinear interpolation of gathered map cells (see map_gather) */
+VECTORIZED
+static void map_interpolate_v(struct map_cells * cells, double offset,
+    double * height)
+{
+        int i;
+        for (i = 0; i < cells->size; i++) {
+                const double hx = cells->hx[i], hy = cells->hy[i];
+                height[i] = cells->z[0][i] * (1. - hx) * (1. - hy) +
+                    cells->z[1][i] * hx * (1. - hy) +
+                    cells->z[2][i] * (1. - hx) * hy +
+                    cells->z[3][i] * hx * hy + offset;
+        }
+}
+
+/* Gradient of the bilinear interpolation (see map_interpolate_v) */
+VECTORIZED
+static void map_differentiate_v(struct map_cells * cells, double dx,
+    double dy, struct mulder_projection * gradient)
+{
+        int i;
+        for (i = 0; i < cells->size; i++) {
+                const double hx = cells->hx[i], hy = cells->hy[i];
+                gradient[i].x = ((cells->z[1][i] - cells->z[0][i]) *
+                    (1. - hy) + (cells->z[3][i] - cells->z[2][i]) * hy) / dx;
+                gradient[i].y = ((cells->z[2][i] - cells->z[0][i]) *
+                    (1. - hx) + (cells->z[3][i] - cells->z[1][i]) * hx) / dy;
+        }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+
+/* Binary header of tabulated reference fluxes (format version 1).
+ *
+ * The header is followed by flux data, starting at the given offset (aligned
+ * on a cache line). The byte order of all numbers is indicated by the
+ * byte_order field, which allows to memory map data when they match the
+ * host's. Two data layouts are supported:
+ *
+ * - REFERENCE_LAYOUT_NODES. Flux values are stored as floats, for each
+ *   height, cos(theta) and kinetic energy node (in row major order), and for
+ *   each charge (mu+, mu-).
+ *
+ * - REFERENCE_LAYOUT_CELLS. Log-flux values are stored for each grid cell
+ *   (in row major order), as 16 floats (i.e. a cache line). These are the
+ *   values at the cell corners, for each charge, with index
+ *   2 * (4 * ih + 2 * ic + ik) + charge. Non positive fluxes are stored as
+ *   -inf. In addition, cells are followed by a validity mask, one byte per
+ *   cell, indicating (for each charge bit) if all corner values are strictly
+ *   positive. Note that this layout uses a log-space interpolation, along all
+ *   dimensions.
+ */
+#define REFERENCE_MAGIC "MULDERTB"
+#define REFERENCE_VERSION 1
+#define REFERENCE_BYTE_ORDER 0x01020304
+
+enum {
+        REFERENCE_LAYOUT_NODES = 0,
+        REFERENCE_LAYOUT_CELLS
+};
+
+struct reference_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        int64_t shape[3];
+        double range[6];
+        uint64_t offset;
+        uint32_t layout;
+        uint32_t reserved;
+};
+
+
+/* Byte swapping utilities (for tables with foreign byte order) */
+static void swap_bytes(void * data, size_t size, size_t n)
+{
+        unsigned char * p = data;
+        size_t i;
+        for (i = 0; i < n; i++, p += size) {
+                size_t j;
+                for (j = 0; j < size / 2; j++) {
+                        const unsigned char tmp = p[j];
+                        p[j] = p[size - 1 - j];
+                        p[size - 1 - j] = tmp;
+                }
+        }
+}
+
+
+/* Check the shape of a tabulated reference flux */
+static int reference_shape_check(const int64_t shape[3])
+{
+        return (shape[0] >= 2) && (shape[0] <= INT_MAX) &&
+               (shape[1] >= 2) && (shape[1] <= INT_MAX) &&
+               (shape[2] >= 1) && (shape[2] <= INT_MAX) &&
+               (shape[0] * shape[1] * shape[2] <=
+                   (int64_t)(SIZE_MAX / (2 * sizeof(float))));
+}
+
+
+/* Load a tabulated reference flux
+ *
+ * Table files are memory mapped, when possible. Thus, data are shared between
+ * processes (through the page cache), and they are loaded on demand.
+ */
+static struct mulder_reference * reference_load_table(const char * path)
+{
+        const int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                MULDER_ERROR("could not open %s", strlen(path), path);
+                return NULL;
+        }
+
+        struct stat st;
+        void * map = MAP_FAILED;
+        size_t map_size = 0;
+        if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+                map_size = (size_t)st.st_size;
+                map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) goto error;
+
+        /* Parse the header */
+        const char * const buffer = map;
+        int64_t shape[3];
+        double range[6];
+        uint64_t offset;
+        int swap, layout;
+        if ((map_size >= sizeof(struct reference_header)) &&
+            (memcmp(buffer, REFERENCE_MAGIC, 8) == 0)) {
+                struct reference_header header;
+                memcpy(&header, buffer, sizeof header);
+                if (header.byte_order == REFERENCE_BYTE_ORDER) {
+                        swap = 0;
+                } else {
+                        swap_bytes(&header.byte_order, 4, 1);
+                        if (header.byte_order != REFERENCE_BYTE_ORDER) {
+                                goto error;
+                        }
+                        swap = 1;
+                        swap_bytes(&header.version, 4, 1);
+                        swap_bytes(header.shape, 8, 3);
+                        swap_bytes(header.range, 8, 6);
+                        swap_bytes(&header.offset, 8, 1);
+                        swap_bytes(&header.layout, 4, 1);
+                }
+                if ((header.version != REFERENCE_VERSION) ||
+                    (header.layout > REFERENCE_LAYOUT_CELLS) ||
+                    (header.offset % sizeof(float) != 0)) {
+                        goto error;
+                }
+                memcpy(shape, header.shape, sizeof shape);
+                memcpy(range, header.range, sizeof range);
+                offset = header.offset;
+                layout = header.layout;
+        } else if (map_size >= sizeof shape + sizeof range) {
+                /* Legacy format, without explicit byte order */
+                memcpy(shape, buffer, sizeof shape);
+                memcpy(range, buffer + sizeof shape, sizeof range);
+                offset = sizeof shape + sizeof range;
+                layout = REFERENCE_LAYOUT_NODES;
+                if (reference_shape_check(shape)) {
+                        swap = 0;
+                } else {
+                        swap = 1;
+                        swap_bytes(shape, 8, 3);
+                        swap_bytes(range, 8, 6);
+                }
+        } else {
+                goto error;
+        }
+
+        /* Validate the header */
+        if (!reference_shape_check(shape)) goto error;
+        int i;
+        for (i = 0; i < 6; i++) {
+                if (!isfinite(range[i])) goto error;
+        }
+        if ((range[0] <= 0.) || (range[1] <= range[0]) ||
+            (range[2] == range[3]) ||
+            ((shape[2] > 1) && (range[4] == range[5]))) {
+                goto error;
+        }
+
+        size_t size, mask_size;
+        if (layout == REFERENCE_LAYOUT_NODES) {
+                size = (size_t)(2 * shape[0] * shape[1] * shape[2]);
+                mask_size = 0;
+        } else {
+                mask_size = (size_t)((shape[0] - 1) * (shape[1] - 1) *
+                    ((shape[2] > 1) ? shape[2] - 1 : 1));
+                if (mask_size > INT_MAX / 16) goto error;
+                size = 16 * mask_size;
+        }
+        if ((offset > map_size) ||
+            (map_size - offset < mask_size) ||
+            ((map_size - offset - mask_size) / sizeof(float) < size)) {
+                goto error;
+        }
+
+        struct reference_table * table = malloc(sizeof(*table));
+        if (table == NULL) {
+                munmap(map, map_size);
+                raise_error("could not allocate memory");
+                return NULL;
+        }
+
+        if (swap) {
+                /* Data cannot be mapped. Thus, a byte swapped copy is done */
+                float * data = malloc(size * sizeof(*data) + mask_size);
+                if (data == NULL) {
+                        free(table);
+                        munmap(map, map_size);
+                        raise_error("could not allocate memory");
+                        return NULL;
+                }
+                memcpy(data, buffer + offset,
+                    size * sizeof(*data) + mask_size);
+                swap_bytes(data, sizeof(*data), size);
+                munmap(map, map_size);
+                table->data = data;
+                table->map = data;
+                table->map_size = 0;
+        } else {
+                table->data = (const float *)(buffer + offset);
+                table->map = map;
+                table->map_size = map_size;
+        }
+
+        table->layout = layout;
+        table->mask = (mask_size > 0) ?
+            (const uint8_t *)(table->data + size) : NULL;
+        table->n_k = shape[0];
+        table->n_c = shape[1];
+        table->n_h = shape[2];
+        table->k_min = range[0];
+        table->k_max = range[1];
+        table->c_min = range[2];
+        table->c_max = range[3];
+        table->h_min = range[4];
+        table->h_max = range[5];
+
+        /* Set API fields */
+        table->api.energy_min = table->k_min;
+        table->api.energy_max = table->k_max;
+        table->api.height_min = table->h_min;
+        table->api.height_max = table->h_max;
+        if (layout == REFERENCE_LAYOUT_NODES) {
+                table->api.flux = &reference_table_flux;
+                table->api.flux_v = &reference_table_flux_v;
+        } else {
+                table->api.flux = &reference_table_log_flux;
+                table->api.flux_v = &reference_table_log_flux_v;
+        }
+        reference_table_initialise(table);
+
+        return &table->api;
+error:
+        if (map != MAP_FAILED) munmap(map, map_size);
+        MULDER_ERROR("bad format (%s)", strlen(path), path);
+        return NULL;
+}
+
+
+/* Unload a tabulated reference flux */
+static void reference_unload_table(struct reference_table * table)
+{
+        if (table->map_size > 0) {
+                munmap(table->map, table->map_size);
+        } else {
+                free(table->map);
+        }
+}
+
 
-        return PUMAS_STEP_CHECK;
+/* Generic reference API */
+struct mulder_reference * mulder_reference_create(const char * model)
+{
+        if (model == NULL) {
+                return reference_default();
+        } else {
+                return reference_load_table(model);
+        }
 }
 
 
-/* Gaisser's flux model (in GeV^-1 m^-2 s^-1 sr^-1)
- * Ref: see e.g. the ch.30 of the PDG (https://pdglive.lbl.gov)
- */
-static double flux_gaisser(double cos_theta, double kinetic_energy)
+void mulder_reference_destroy(struct mulder_reference ** reference)
 {
-        if (cos_theta < 0.) {
-                return 0.;
-        } else {
-                const double Emu = kinetic_energy + 0.10566;
-                const double ec = 1.1 * Emu * cos_theta;
-                const double rpi = 1. + ec / 115.;
-                const double rK = 1. + ec / 850.;
-                return
-                    1.4E+03 *
-                    pow(Emu, -2.7) *
-                    (1. / rpi + 0.054 / rK)
-                ;
+        if ((reference == NULL) || (*reference == NULL)) return;
+        if (((*reference)->flux == &reference_table_flux) ||
+            ((*reference)->flux == &reference_table_log_flux)) {
+                reference_unload_table((void *)(*reference));
         }
+        free(*reference);
+        *reference = NULL;
 }
 
 
-/* Volkova's parameterization of cos(theta*)
+/* Flux maps (i.e. tabulated fluxes at a fixed observation position).
  *
- * This is a correction for the Earth curvature, relevant for close to
- * horizontal trajectories.
- * */
-static double cos_theta_star(double cos_theta)
+ * Binary format (version 1). The header is followed by azimuth and elevation
+ * nodes (as doubles), and then by flux data starting at the given offset
+ * (aligned on a cache line). Flux data are stored as floats, for each
+ * azimuth, elevation and energy node (in row major order), and for each
+ * charge (mu+, mu-). As for reference tables, data are memory mapped when
+ * the byte order matches the host's.
+ */
+#define FLUXMAP_MAGIC "MULDERFM"
+#define FLUXMAP_VERSION 1
+
+struct fluxmap_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        int64_t shape[3];
+        double position[3];
+        double energy[2];
+        uint64_t offset;
+};
+
+#define FLUXMAP_MAX_DEPTH 6
+#define FLUXMAP_GRAMMAGE_MIN 1E+03 /* kg / m^2, i.e. 1 m of water */
+
+
+/* Initialise the lookup of intervals over an axis */
+static int fluxmap_axis_initialise(
+    struct fluxmap_axis * axis,
+    int size,
+    const double * nodes)
 {
-        const double p[] = {
-            0.102573, -0.068287, 0.958633, 0.0407253, 0.817285};
-        const double cs2 =
-            (
-                cos_theta * cos_theta +
-                p[0] * p[0] +
-                p[1] * pow(cos_theta, p[2]) +
-                p[3] * pow(cos_theta, p[4]))
-            /
-            (
-                1. +
-                p[0] * p[0] +
-                p[1] +
-                p[3]
-            )
-        ;
-        return cs2 > 0. ? sqrt(cs2) : 0.;
+        axis->size = size;
+        axis->nodes = nodes;
+        axis->n_bins = 4 * (size - 1) + 1;
+        axis->min = nodes[0];
+        axis->inv_dbin = (axis->n_bins - 1) / (nodes[size - 1] - nodes[0]);
+        axis->bins = malloc(axis->n_bins * sizeof *axis->bins);
+        if (axis->bins == NULL) return -1;
+
+        int b, i = 0;
+        for (b = 0; b < axis->n_bins; b++) {
+                const double x = axis->min + b / axis->inv_dbin;
+                while ((i < size - 2) && (x >= nodes[i + 1])) i++;
+                axis->bins[b] = i;
+        }
+        return 0;
 }
 
 
-/*
- * Guan et al. parameterization of the sea level flux of atmospheric muons
- * Ref: https://arxiv.org/abs/1509.06176
- */
-static double flux_gccly(double cos_theta, double kinetic_energy)
+/* Finalise the creation of a flux map (energies and lookups) */
+static struct mulder_fluxmap * fluxmap_initialise(struct fluxmap * map)
 {
-        const double Emu = kinetic_energy + MUON_MASS;
-        const double cs = cos_theta_star(cos_theta);
-        return
-            pow(1. + 3.64 / (Emu * pow(cs, 1.29)), -2.7) *
-            flux_gaisser(cs, kinetic_energy)
-        ;
+        struct mulder_fluxmap * api = &map->api;
+        map->log_k_min = log(api->energy_min);
+        map->inv_dlk = (api->n_energy > 1) ?
+            (api->n_energy - 1) / log(api->energy_max / api->energy_min) :
+            0.;
+        map->axes[0].bins = map->axes[1].bins = NULL;
+        if ((fluxmap_axis_initialise(map->axes, api->n_azimuth,
+                api->azimuth) != 0) ||
+            (fluxmap_axis_initialise(map->axes + 1, api->n_elevation,
+                api->elevation) != 0)) {
+                mulder_fluxmap_destroy(&api);
+                raise_error("could not allocate memory");
+                return NULL;
+        }
+        return api;
 }
 
 
-/* Fraction of the muon flux for a given charge */
-static double charge_fraction(enum mulder_pid pid)
+/* Refine an angular axis, w.r.t. the grammage variation across intervals */
+static int fluxmap_refine(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_position position,
+    int refine_azimuth,
+    int * size,
+    double ** nodes,
+    int n_other,
+    const double * other,
+    double tolerance,
+    int max_nodes)
 {
-        /* Use a constant charge ratio.
-         * Ref: CMS (https://arxiv.org/abs/1005.5332)
-         */
-        const double charge_ratio = 1.2766;
+        int depth;
+        for (depth = 0; depth < FLUXMAP_MAX_DEPTH; depth++) {
+                const int n = *size;
+                if (n >= max_nodes) break;
+
+                /* Compute grammages over the current grid */
+                double * grammage = malloc((size_t)n * n_other *
+                    sizeof *grammage);
+                if (grammage == NULL) return -1;
+                int i, j;
+                for (i = 0; i < n; i++) for (j = 0; j < n_other; j++) {
+                        struct mulder_direction direction;
+                        direction.azimuth = refine_azimuth ?
+                            (*nodes)[i] : other[j];
+                        direction.elevation = refine_azimuth ?
+                            other[j] : (*nodes)[i];
+                        grammage[i * n_other + j] = mulder_fluxmeter_grammage(
+                            fluxmeter, position, direction, NULL);
+                }
 
-        if (pid == MULDER_MUON) {
-                return 1. / (1. + charge_ratio);
-        } else if (pid == MULDER_ANTIMUON) {
-                return charge_ratio / (1. + charge_ratio);
-        } else {
-                return 1.;
+                /* Split intervals with large variations */
+                double * refined = malloc((2 * n - 1) * sizeof *refined);
+                if (refined == NULL) {
+                        free(grammage);
+                        return -1;
+                }
+                int m = 0;
+                for (i = 0; i < n - 1; i++) {
+                        refined[m++] = (*nodes)[i];
+                        if (m + (n - 1 - i) >= max_nodes) continue;
+                        double variation = 0.;
+                        for (j = 0; j < n_other; j++) {
+                                const double x0 = grammage[i * n_other + j];
+                                const double x1 =
+                                    grammage[(i + 1) * n_other + j];
+                                const double v = fabs(x1 - x0) /
+                                    (0.5 * (x0 + x1) + FLUXMAP_GRAMMAGE_MIN);
+                                if (v > variation) variation = v;
+                        }
+                        if (variation > tolerance) {
+                                refined[m++] = 0.5 * ((*nodes)[i] +
+                                    (*nodes)[i + 1]);
+                        }
+                }
+                refined[m++] = (*nodes)[n - 1];
+                free(grammage);
+
+                free(*nodes);
+                *nodes = refined;
+                *size = m;
+                if (m == n) break;
         }
+        return 0;
 }
 
 
-/* Default reference flux model, in GeV^-1 m^-2 s^-1 sr^-1 */
-static struct mulder_flux reference_flux(
-    struct mulder_reference * reference,
-    double height,
-    double elevation,
-    double kinetic_energy)
+static int axis_check(const struct mulder_axis * axis, const char * name)
 {
-        struct mulder_flux result = {0.};
-        if ((height >= reference->height_min) &&
-            (height <= reference->height_max)) {
-                const double deg = M_PI / 180.;
-                const double cos_theta = cos((90. - elevation) * deg);
-                result.value = flux_gccly(cos_theta, kinetic_energy);
-                const double f = charge_fraction(MULDER_ANTIMUON);
-                result.asymmetry = 2 * f - 1.;
+        if ((axis->size < 2) || !(axis->max > axis->min)) {
+                MULDER_ERROR("bad %s axis", strlen(name), name);
+                return -1;
         }
-        return result;
+        return 0;
 }
 
-static struct mulder_reference default_reference = {
-        .energy_min = 1E-04,
-        .energy_max = 1E+21,
-        .height_min = 0.,
-        .height_max = 0.,
-        .flux = &reference_flux
-};
 
-static struct mulder_reference * reference_default(void)
+struct mulder_fluxmap * mulder_fluxmap_create(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_position position,
+    const struct mulder_axis azimuth,
+    const struct mulder_axis elevation,
+    const struct mulder_axis energy,
+    double tolerance,
+    int max_nodes)
 {
-        struct mulder_reference * reference = malloc(sizeof *reference);
-        if (reference == NULL) {
-                mulder_error("could not allocate memory");
+        if ((axis_check(&azimuth, "azimuth") != 0) ||
+            (axis_check(&elevation, "elevation") != 0) ||
+            (axis_check(&energy, "energy") != 0)) {
+                return NULL;
+        } else if (energy.min <= 0.) {
+                MULDER_ERROR("bad energy (%g)", 16, energy.min);
                 return NULL;
         }
 
-        memcpy(reference, &default_reference, sizeof * reference);
+        /* Regular angular axes, refined if requested */
+        int n[2] = {azimuth.size, elevation.size};
+        double * nodes[2] = {
+            malloc(azimuth.size * sizeof **nodes),
+            malloc(elevation.size * sizeof **nodes)
+        };
+        const struct mulder_axis * axes[2] = {&azimuth, &elevation};
+        int i, j;
+        for (i = 0; i < 2; i++) {
+                if (nodes[i] == NULL) continue;
+                for (j = 0; j < n[i]; j++) {
+                        nodes[i][j] = axes[i]->min + j *
+                            (axes[i]->max - axes[i]->min) / (n[i] - 1);
+                }
+        }
+        if ((nodes[0] == NULL) || (nodes[1] == NULL)) goto memory_error;
+        if (tolerance > 0.) {
+                if (max_nodes < 2) max_nodes = INT_MAX / 2;
+                for (i = 0; i < 2; i++) {
+                        if (fluxmap_refine(fluxmeter, position, i == 0,
+                                n + i, nodes + i, n[1 - i], nodes[1 - i],
+                                tolerance, max_nodes) != 0) {
+                                goto memory_error;
+                        }
+                }
+        }
 
-        return reference;
+        /* Allocate the map, with contiguous nodes */
+        const size_t size = 2 * (size_t)n[0] * n[1] * energy.size;
+        struct fluxmap * map = calloc(1, sizeof *map);
+        double * all_nodes = malloc((n[0] + n[1]) * sizeof *all_nodes);
+        float * data = calloc(size, sizeof *data);
+        if ((map == NULL) || (all_nodes == NULL) || (data == NULL)) {
+                free(map);
+                free(all_nodes);
+                free(data);
+                goto memory_error;
+        }
+        memcpy(all_nodes, nodes[0], n[0] * sizeof *all_nodes);
+        memcpy(all_nodes + n[0], nodes[1], n[1] * sizeof *all_nodes);
+        free(nodes[0]);
+        free(nodes[1]);
+
+        map->nodes = all_nodes;
+        map->data = data;
+        map->map = NULL;
+        map->map_size = 0;
+        struct mulder_fluxmap * api = &map->api;
+        memcpy((void *)&api->position, &position, sizeof position);
+        init_int((int *)&api->n_azimuth, n[0]);
+        init_int((int *)&api->n_elevation, n[1]);
+        init_int((int *)&api->n_energy, energy.size);
+        init_ptr((void **)&api->azimuth, all_nodes);
+        init_ptr((void **)&api->elevation, all_nodes + n[0]);
+        init_double((double *)&api->energy_min, energy.min);
+        init_double((double *)&api->energy_max, energy.max);
+
+        return fluxmap_initialise(map);
+
+memory_error:
+        free(nodes[0]);
+        free(nodes[1]);
+        raise_error("could not allocate memory");
+        return NULL;
 }
 
 
-/* Data layout for a tabulated reference flux */
-struct reference_table {
-        struct mulder_reference api;
-        int n_k;
-        int n_c;
-        int n_h;
-        double k_min;
-        double k_max;
-        double c_min;
-        double c_max;
-        double h_min;
-        double h_max;
-        float data[];
-};
-
-
-/* Intepolation of tabulated reference flux */
-static struct mulder_flux reference_table_flux(
-    struct mulder_reference * reference,
-    double height,
-    double elevation,
-    double kinetic_energy)
+enum mulder_return mulder_fluxmap_tabulate(
+    struct mulder_fluxmap * fluxmap,
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop)
 {
-        struct reference_table * table = (void *)reference;
-        struct mulder_flux result = {0.};
+        struct fluxmap * map = (void *)fluxmap;
+        if (map->map_size > 0) {
+                raise_error("cannot tabulate a mapped flux map");
+                return MULDER_FAILURE;
+        }
 
-        /* Compute the interpolation indices and coefficients */
-        const double dlk = log(table->k_max / table->k_min) /
-            (table->n_k - 1);
-        double hk = log(kinetic_energy / table->k_min) / dlk;
-        if ((hk < 0.) || (hk > table->n_k - 1)) return result;
-        const int ik = (int)hk;
-        hk -= ik;
-
-        const double deg = M_PI / 180;
-        const double c = cos((90 - elevation) * deg);
-        const double dc = (table->c_max - table->c_min) / (table->n_c - 1);
-        double hc = (c - table->c_min) / dc;
-        if ((hc < 0.) || (hc > table->n_c - 1)) return result;
-        const int ic = (int)hc;
-        hc -= ic;
-
-        int ih;
-        double hh;
-        if (table->n_h > 1) {
-                const double dh = (table->h_max - table->h_min) /
-                    (table->n_h - 1);
-                hh = (height - table->h_min) / dh;
-                if ((hh < 0.) || (hh > table->n_h - 1)) return result;
-                ih = (int)hh;
-                hh -= ih;
-        } else {
-                hh = 0.;
-                ih = 0;
-        }
-
-        const int ik1 = (ik < table->n_k - 1) ?
-            ik + 1 : table->n_k - 1;
-        const int ic1 = (ic < table->n_c - 1) ?
-            ic + 1 : table->n_c - 1;
-        const int ih1 = (ih < table->n_h - 1) ?
-            ih + 1 : table->n_h - 1;
-        const float * const f000 =
-            table->data + 2 * ((ih * table->n_c + ic) *
-            table->n_k + ik);
-        const float * const f010 =
-            table->data + 2 * ((ih * table->n_c + ic1) *
-            table->n_k + ik);
-        const float * const f100 =
-            table->data + 2 * ((ih * table->n_c + ic) *
-            table->n_k + ik1);
-        const float * const f110 =
-            table->data + 2 * ((ih * table->n_c + ic1) *
-            table->n_k + ik1);
-        const float * const f001 =
-            table->data + 2 * ((ih1 * table->n_c + ic) *
-            table->n_k + ik);
-        const float * const f011 =
-            table->data + 2 * ((ih1 * table->n_c + ic1) *
-            table->n_k + ik);
-        const float * const f101 =
-            table->data + 2 * ((ih1 * table->n_c + ic) *
-            table->n_k + ik1);
-        const float * const f111 =
-            table->data + 2 * ((ih1 * table->n_c + ic1) *
-            table->n_k + ik1);
-
-        /* Interpolate the flux */
-        double flux[2] = {0.};
+        const int ne = fluxmap->n_elevation, nk = fluxmap->n_energy;
+        const int size = fluxmap->n_azimuth * ne * nk;
+        if ((start < 0) || (stop > size) || (start > stop)) {
+                MULDER_ERROR("bad range ([%d, %d))", 32, start, stop);
+                return MULDER_FAILURE;
+        }
+
+        const double dlk = (nk > 1) ? 1. / map->inv_dlk : 0.;
         int i;
-        for (i = 0; i < 2; i++) {
-                /* Linear interpolation along cos(theta) */
-                const double g00 = f000[i] * (1. - hc) + f010[i] * hc;
-                const double g10 = f100[i] * (1. - hc) + f110[i] * hc;
-                const double g01 = f001[i] * (1. - hc) + f011[i] * hc;
-                const double g11 = f101[i] * (1. - hc) + f111[i] * hc;
-
-                /* Log or linear interpolation along log(kinetic) */
-                double g0;
-                if ((g00 <= 0.) || (g10 <= 0.))
-                        g0 = g00 * (1. - hk) + g10 * hk;
-                else
-                        g0 = exp(log(g00) * (1. - hk) + log(g10) * hk);
-
-                double g1;
-                if ((g01 <= 0.) || (g11 <= 0.))
-                        g1 = g01 * (1. - hk) + g11 * hk;
-                else
-                        g1 = exp(log(g01) * (1. - hk) + log(g11) * hk);
-
-                /* Log or linear interpolation along altitude */
-                if ((g0 <= 0.) || (g1 <= 0.))
-                        flux[i] = g0 * (1. - hh) + g1 * hh;
-                else
-                        flux[i] = exp(log(g0) * (1. - hh) + log(g1) * hh);
-        }
-
-        const double tmp = flux[0] + flux[1];
-        if (tmp > 0.) {
-                result.value = tmp;
-                result.asymmetry = (flux[0] - flux[1]) / tmp;
+        for (i = start; i < stop; i++) {
+                const int ik = i % nk;
+                const int ie = (i / nk) % ne;
+                const int ia = i / (nk * ne);
+                const struct mulder_state state = {
+                        .pid = MULDER_ANY,
+                        .position = fluxmap->position,
+                        .direction = {
+                                .azimuth = fluxmap->azimuth[ia],
+                                .elevation = fluxmap->elevation[ie]
+                        },
+                        .energy = (ik == nk - 1) ? fluxmap->energy_max :
+                            exp(map->log_k_min + ik * dlk),
+                        .weight = 1.
+                };
+                const unsigned long errors = n_errors;
+                const struct mulder_flux flux = mulder_fluxmeter_flux(
+                    fluxmeter, state);
+                if (n_errors != errors) return MULDER_FAILURE;
+                map->data[2 * i] = 0.5 * flux.value * (1. + flux.asymmetry);
+                map->data[2 * i + 1] = 0.5 * flux.value *
+                    (1. - flux.asymmetry);
         }
-        return result;
+        return MULDER_SUCCESS;
 }
 
 
-/* Load a tabulated reference flux */
-static struct mulder_reference * reference_load_table(const char * path)
+struct mulder_fluxmap * mulder_fluxmap_load(const char * path)
 {
-        FILE * fid = fopen(path, "rb");
-        if (fid == NULL) {
+        const int fd = open(path, O_RDONLY);
+        if (fd < 0) {
                 MULDER_ERROR("could not open %s", strlen(path), path);
                 return NULL;
         }
 
-        struct reference_table * table = NULL;
-        int64_t shape[3];
-        double range[6];
-
-        if (fread(shape, 8, 3, fid) != 3) goto error;
-        if (fread(range, 8, 6, fid) != 6) goto error;
-
-        /* XXX check endianess ? */
-
-        size_t size = (size_t)(2 * shape[0] * shape[1] * shape[2]);
-        table = malloc(sizeof(*table) + size * sizeof(*table->data));
-        if (table == NULL) goto error;
+        struct stat st;
+        void * map = MAP_FAILED;
+        size_t map_size = 0;
+        if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+                map_size = (size_t)st.st_size;
+                map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) goto error;
 
-        if (fread(table->data, sizeof(*table->data), size, fid) != size) {
+        /* Parse and validate the header */
+        struct fluxmap_header header;
+        if ((map_size < sizeof header) ||
+            (memcmp(map, FLUXMAP_MAGIC, 8) != 0)) {
+                goto error;
+        }
+        memcpy(&header, map, sizeof header);
+        int swap = 0;
+        if (header.byte_order != REFERENCE_BYTE_ORDER) {
+                swap_bytes(&header.byte_order, 4, 1);
+                if (header.byte_order != REFERENCE_BYTE_ORDER) goto error;
+                swap = 1;
+                swap_bytes(&header.version, 4, 1);
+                swap_bytes(header.shape, 8, 3);
+                swap_bytes(header.position, 8, 3);
+                swap_bytes(header.energy, 8, 2);
+                swap_bytes(&header.offset, 8, 1);
+        }
+        if ((header.version != FLUXMAP_VERSION) ||
+            (header.shape[0] < 2) || (header.shape[0] > INT_MAX) ||
+            (header.shape[1] < 2) || (header.shape[1] > INT_MAX) ||
+            (header.shape[2] < 2) || (header.shape[2] > INT_MAX) ||
+            !(header.energy[0] > 0.) ||
+            !(header.energy[1] > header.energy[0]) ||
+            (header.offset % sizeof(float) != 0)) {
+                goto error;
+        }
+        const size_t n_nodes = header.shape[0] + header.shape[1];
+        const size_t size = 2 * (size_t)header.shape[0] * header.shape[1] *
+            header.shape[2];
+        if ((header.offset < sizeof header + n_nodes * sizeof(double)) ||
+            (header.offset > map_size) ||
+            ((map_size - header.offset) / sizeof(float) < size)) {
                 goto error;
         }
-        fclose(fid);
 
-        table->n_k = shape[0];
-        table->n_c = shape[1];
-        table->n_h = shape[2];
-        table->k_min = range[0];
-        table->k_max = range[1];
-        table->c_min = range[2];
-        table->c_max = range[3];
-        table->h_min = range[4];
-        table->h_max = range[5];
+        struct fluxmap * fluxmap = calloc(1, sizeof *fluxmap);
+        if (fluxmap == NULL) {
+                munmap(map, map_size);
+                raise_error("could not allocate memory");
+                return NULL;
+        }
+        const char * const buffer = map;
+        const double * nodes;
+        if (swap) {
+                /* Data cannot be mapped. Thus, byte swapped copies are done */
+                double * n = malloc(n_nodes * sizeof *n);
+                float * data = malloc(size * sizeof *data);
+                if ((n == NULL) || (data == NULL)) {
+                        free(n);
+                        free(data);
+                        free(fluxmap);
+                        munmap(map, map_size);
+                        raise_error("could not allocate memory");
+                        return NULL;
+                }
+                memcpy(n, buffer + sizeof header, n_nodes * sizeof *n);
+                swap_bytes(n, sizeof *n, n_nodes);
+                memcpy(data, buffer + header.offset, size * sizeof *data);
+                swap_bytes(data, sizeof *data, size);
+                munmap(map, map_size);
+                fluxmap->nodes = n;
+                fluxmap->data = data;
+                nodes = n;
+        } else {
+                fluxmap->map = map;
+                fluxmap->map_size = map_size;
+                fluxmap->data = (float *)(buffer + header.offset);
+                nodes = (const double *)(buffer + sizeof header);
+        }
 
-        /* Set API fields */
-        table->api.energy_min = table->k_min;
-        table->api.energy_max = table->k_max;
-        table->api.height_min = table->h_min;
-        table->api.height_max = table->h_max;
-        table->api.flux = &reference_table_flux;
+        /* Check that nodes are increasing */
+        size_t i;
+        for (i = 1; i < n_nodes; i++) {
+                if ((i != (size_t)header.shape[0]) &&
+                    !(nodes[i] > nodes[i - 1])) {
+                        struct mulder_fluxmap * api = &fluxmap->api;
+                        mulder_fluxmap_destroy(&api);
+                        MULDER_ERROR("bad format (%s)", strlen(path), path);
+                        return NULL;
+                }
+        }
 
-        return &table->api;
+        struct mulder_fluxmap * api = &fluxmap->api;
+        struct mulder_position position = {
+            header.position[0], header.position[1], header.position[2]
+        };
+        memcpy((void *)&api->position, &position, sizeof position);
+        init_int((int *)&api->n_azimuth, header.shape[0]);
+        init_int((int *)&api->n_elevation, header.shape[1]);
+        init_int((int *)&api->n_energy, header.shape[2]);
+        init_ptr((void **)&api->azimuth, (void *)nodes);
+        init_ptr((void **)&api->elevation, (void *)(nodes + header.shape[0]));
+        init_double((double *)&api->energy_min, header.energy[0]);
+        init_double((double *)&api->energy_max, header.energy[1]);
+
+        return fluxmap_initialise(fluxmap);
 error:
-        fclose(fid);
-        free(table);
+        if (map != MAP_FAILED) munmap(map, map_size);
         MULDER_ERROR("bad format (%s)", strlen(path), path);
         return NULL;
 }
 
 
-/* Generic reference API */
-struct mulder_reference * mulder_reference_create(const char * model)
+enum mulder_return mulder_fluxmap_dump(
+    const struct mulder_fluxmap * fluxmap,
+    const char * path)
 {
-        if (model == NULL) {
-                return reference_default();
-        } else {
-                return reference_load_table(model);
+        const struct fluxmap * map = (void *)fluxmap;
+        FILE * stream = fopen(path, "wb");
+        if (stream == NULL) {
+                MULDER_ERROR("could not open %s", strlen(path), path);
+                return MULDER_FAILURE;
+        }
+
+        const size_t n_nodes = fluxmap->n_azimuth + fluxmap->n_elevation;
+        size_t offset = sizeof(struct fluxmap_header) +
+            n_nodes * sizeof(double);
+        offset = ((offset + 63) / 64) * 64;
+        struct fluxmap_header header = {
+                .version = FLUXMAP_VERSION,
+                .byte_order = REFERENCE_BYTE_ORDER,
+                .shape = {
+                    fluxmap->n_azimuth,
+                    fluxmap->n_elevation,
+                    fluxmap->n_energy
+                },
+                .position = {
+                    fluxmap->position.latitude,
+                    fluxmap->position.longitude,
+                    fluxmap->position.height
+                },
+                .energy = {fluxmap->energy_min, fluxmap->energy_max},
+                .offset = offset
+        };
+        memcpy(header.magic, FLUXMAP_MAGIC, 8);
+
+        const size_t size = 2 * (size_t)fluxmap->n_azimuth *
+            fluxmap->n_elevation * fluxmap->n_energy;
+        const char padding[64] = {0};
+        const size_t n_padding = offset - sizeof header -
+            n_nodes * sizeof(double);
+        int rc = (fwrite(&header, sizeof header, 1, stream) == 1) &&
+            (fwrite(fluxmap->azimuth, sizeof(double), fluxmap->n_azimuth,
+                stream) == (size_t)fluxmap->n_azimuth) &&
+            (fwrite(fluxmap->elevation, sizeof(double),
+                fluxmap->n_elevation, stream) ==
+                (size_t)fluxmap->n_elevation) &&
+            (fwrite(padding, 1, n_padding, stream) == n_padding) &&
+            (fwrite(map->data, sizeof(float), size, stream) == size);
+        rc = (fclose(stream) == 0) && rc;
+        if (!rc) {
+                MULDER_ERROR("could not write %s", strlen(path), path);
+                return MULDER_FAILURE;
         }
+        return MULDER_SUCCESS;
 }
 
 
-void mulder_reference_destroy(struct mulder_reference ** reference)
+void mulder_fluxmap_destroy(struct mulder_fluxmap ** fluxmap)
 {
-        if ((reference == NULL) || (*reference == NULL)) return;
-        free(*reference);
-        *reference = NULL;
+        if ((fluxmap == NULL) || (*fluxmap == NULL)) return;
+        struct fluxmap * map = (void *)(*fluxmap);
+        free(map->axes[0].bins);
+        free(map->axes[1].bins);
+        if (map->map_size > 0) {
+                munmap(map->map, map->map_size);
+        } else {
+                free(map->nodes);
+                free(map->data);
+        }
+        free(map);
+        *fluxmap = NULL;
 }
 
 
@@ -1958,8 +6341,30 @@ void mulder_reference_destroy(struct mulder_reference ** reference)
 static double random_pumas(struct pumas_context * context)
 {
         struct fluxmeter * f = context->user_data;
+        if ((f->antithetic == ANTITHETIC_REPLAY) &&
+            (f->antithetic_index < f->antithetic_size)) {
+                return 1. - f->antithetic_values[f->antithetic_index++];
+        }
+
         struct mulder_prng * prng = f->api.prng;
-        return prng->uniform01(prng);
+        const double u = prng->uniform01(prng);
+        if (f->antithetic == ANTITHETIC_RECORD) {
+                if (f->antithetic_size >= f->antithetic_capacity) {
+                        const int n = (f->antithetic_capacity > 0) ?
+                            2 * f->antithetic_capacity : 256;
+                        double * values = realloc(
+                            f->antithetic_values, n * sizeof *values);
+                        if (values == NULL) {
+                                /* Subsequent deviates are independent */
+                                f->antithetic = ANTITHETIC_DISABLED;
+                                return u;
+                        }
+                        f->antithetic_values = values;
+                        f->antithetic_capacity = n;
+                }
+                f->antithetic_values[f->antithetic_size++] = u;
+        }
+        return u;
 }
 
 
@@ -1969,9 +6374,10 @@ static unsigned long get_seed(struct mulder_prng * prng)
         struct pumas_context * context = f->context;
 
         unsigned long seed;
-        pumas_error_catch(1); /* Silently ignore unlikely error(s) below */
+        /* Silently ignore unlikely error(s) below */
+        const int caught = catch_begin();
         pumas_context_random_seed_get(context, &seed);
-        pumas_error_catch(0);
+        catch_end(caught, 0);
         return seed;
 }
 
@@ -1983,9 +6389,10 @@ static void set_seed(
         struct fluxmeter * f = (void *)prng - offsetof(struct fluxmeter, prng);
         struct pumas_context * context = f->context;
 
-        pumas_error_catch(1); /* Silently ignore unlikely error(s) below */
+        /* Silently ignore unlikely error(s) below */
+        const int caught = catch_begin();
         pumas_context_random_seed_set(context, seed);
-        pumas_error_catch(0);
+        catch_end(caught, 0);
 }
 
 
@@ -1998,6 +6405,160 @@ static double uniform01(struct mulder_prng * prng)
 }
 
 
+/* Philox4x32-10 PRNG (see e.g. the Random123 library) */
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+
+static inline void philox_block(
+    const uint32_t key[2],
+    uint64_t draw,
+    uint64_t substream,
+    uint32_t out[4])
+{
+        uint32_t c0 = (uint32_t)draw, c1 = (uint32_t)(draw >> 32);
+        uint32_t c2 = (uint32_t)substream, c3 = (uint32_t)(substream >> 32);
+        uint32_t k0 = key[0], k1 = key[1];
+        int i;
+        for (i = 0; i < 10; i++) {
+                const uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+                const uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+                c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+                c1 = (uint32_t)p1;
+                c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+                c3 = (uint32_t)p0;
+                k0 += PHILOX_W0;
+                k1 += PHILOX_W1;
+        }
+        out[0] = c0;
+        out[1] = c1;
+        out[2] = c2;
+        out[3] = c3;
+}
+
+/* Convert 64 random bits to a double in (0, 1) */
+static inline double philox_double(uint32_t hi, uint32_t lo)
+{
+        const uint64_t x = (((uint64_t)hi << 32) | lo) >> 11;
+        return (x + 0.5) * (1. / 9007199254740992.);
+}
+
+static unsigned long philox_get_seed(struct mulder_prng * prng)
+{
+        struct philox * philox = (void *)prng;
+        return ((unsigned long)philox->key[1] << 32) | philox->key[0];
+}
+
+static void philox_set_seed(
+    struct mulder_prng * prng,
+    const unsigned long * seed)
+{
+        struct philox * philox = (void *)prng;
+        unsigned long value;
+        if (seed == NULL) {
+                /* Seed from the OS entropy source */
+                FILE * stream = fopen("/dev/urandom", "rb");
+                if ((stream == NULL) ||
+                    (fread(&value, sizeof value, 1, stream) != 1)) {
+                        value = (unsigned long)time(NULL);
+                }
+                if (stream != NULL) fclose(stream);
+        } else {
+                value = *seed;
+        }
+        philox_initialise(philox, value);
+}
+
+static double philox_uniform01(struct mulder_prng * prng)
+{
+        struct philox * philox = (void *)prng;
+        if (philox->buffered) {
+                philox->buffered = 0;
+                return philox->buffer;
+        }
+        uint32_t out[4];
+        philox_block(philox->key, philox->draw++, philox->substream, out);
+        philox->buffer = philox_double(out[2], out[3]);
+        philox->buffered = 1;
+        return philox_double(out[0], out[1]);
+}
+
+/* Bulk generation. Blocks are independent. Thus, the main loop can be
+ * vectorized.
+ */
+VECTORIZED
+static void philox_uniform01_v(
+    struct mulder_prng * prng,
+    int n,
+    double * values)
+{
+        struct philox * philox = (void *)prng;
+        if ((n > 0) && philox->buffered) {
+                philox->buffered = 0;
+                *values++ = philox->buffer;
+                n--;
+        }
+
+        const int blocks = n / 2;
+        const uint64_t draw = philox->draw;
+        int i;
+        for (i = 0; i < blocks; i++) {
+                uint32_t out[4];
+                philox_block(philox->key, draw + i, philox->substream, out);
+                values[2 * i] = philox_double(out[0], out[1]);
+                values[2 * i + 1] = philox_double(out[2], out[3]);
+        }
+        philox->draw += blocks;
+
+        if (n % 2) {
+                values[n - 1] = philox_uniform01(prng);
+        }
+}
+
+static void philox_set_substream(
+    struct mulder_prng * prng,
+    unsigned long substream)
+{
+        struct philox * philox = (void *)prng;
+        if (substream == philox->substream) return;
+
+        if (philox->substream == 0) {
+                /* Save the main stream state */
+                philox->main_draw = philox->draw;
+                philox->main_buffer = philox->buffer;
+                philox->main_buffered = philox->buffered;
+        }
+
+        philox->substream = substream;
+        if (substream == 0) {
+                /* Resume the main stream */
+                philox->draw = philox->main_draw;
+                philox->buffer = philox->main_buffer;
+                philox->buffered = philox->main_buffered;
+        } else {
+                philox->draw = 0;
+                philox->buffered = 0;
+        }
+}
+
+static void philox_initialise(struct philox * philox, unsigned long seed)
+{
+        philox->api.get_seed = &philox_get_seed;
+        philox->api.set_seed = &philox_set_seed;
+        philox->api.uniform01 = &philox_uniform01;
+        philox->api.uniform01_v = &philox_uniform01_v;
+        philox->api.set_substream = &philox_set_substream;
+        philox->key[0] = (uint32_t)seed;
+        philox->key[1] = (uint32_t)((uint64_t)seed >> 32);
+        philox->draw = 0;
+        philox->substream = 0;
+        philox->buffered = 0;
+        philox->main_draw = 0;
+        philox->main_buffered = 0;
+}
+
+
 /* Floating point exceptions (for debugging, disabled by default) */
 #ifdef _ENABLE_FE
 #ifndef __USE_GNU
@@ -15,6 +15,13 @@ extern "C" {
 extern void (*mulder_error)(const char * message);
 
 
+/* Return codes */
+enum mulder_return {
+    MULDER_SUCCESS = 0,
+    MULDER_FAILURE
+};
+
+
 /* Observation position, using geographic coordinates (GPS-like) */
 struct mulder_position {
     double latitude;  /* deg */
@@ -74,6 +81,37 @@ struct mulder_layer * mulder_layer_create(
     double offset
 );
 
+/* Topographic layer described by several maps of the same surface, e.g. a
+ * fine near-field map and a coarse far-field one.
+ *
+ * Models are ordered by priority. At a given location, the first map covering
+ * it is used. Thus, far from the observer (outside of the fine map), steps are
+ * bounded by the coarse map resolution. Layer metadata refer to the first map,
+ * except for zmin and zmax which consider all maps.
+ */
+struct mulder_layer * mulder_layer_create_multires(
+    const char * material,
+    int size,
+    const char * models[],
+    double offset
+);
+
+/* Topographic layer described by a stack of maps (e.g. a directory of tiles).
+ *
+ * Tiles are loaded lazily, keeping at most size tiles in memory. The stack
+ * uses geographic coordinates (i.e. x is the longitude and y the latitude).
+ * Elevation bounds are given by zrange, if zrange[0] < zrange[1]. Otherwise,
+ * they are obtained by scanning tiles once. Note that mulder_layer_create
+ * loads directories as stacks, using a default size.
+ */
+struct mulder_layer * mulder_layer_create_stack(
+    const char * material,
+    const char * path,
+    double offset,
+    int size,
+    const double zrange[2]
+);
+
 void mulder_layer_destroy(struct mulder_layer ** layer);
 
 double mulder_layer_height(
@@ -91,6 +129,40 @@ struct mulder_position mulder_layer_position(
     struct mulder_projection projection
 );
 
+/* Batched topography height and gradient, over many map locations.
+ *
+ * Results match mulder_layer_height and mulder_layer_gradient, up to rounding.
+ * However, map nodes are decoded by tiles, and interpolations are vectorized.
+ * The stride is in bytes, while outputs are contiguous.
+ */
+void mulder_layer_height_batch(
+    const struct mulder_layer * layer,
+    int size,
+    int stride,
+    const struct mulder_projection * projection,
+    double * height
+);
+
+void mulder_layer_gradient_batch(
+    const struct mulder_layer * layer,
+    int size,
+    int stride,
+    const struct mulder_projection * projection,
+    struct mulder_projection * gradient
+);
+
+/* Topography height over a regular grid of map locations (x varying first) */
+void mulder_layer_height_grid(
+    const struct mulder_layer * layer,
+    int nx,
+    int ny,
+    double xmin,
+    double xmax,
+    double ymin,
+    double ymax,
+    double * height
+);
+
 struct mulder_projection mulder_layer_project(
     const struct mulder_layer * layer,
     struct mulder_position position
@@ -118,6 +190,24 @@ struct mulder_geomagnet * mulder_geomagnet_create(
     int year
 );
 
+/* Geomagnetic field tabulated over a geodetic grid.
+ *
+ * The shape argument gives the number of grid nodes along latitude,
+ * longitude and height. During the transport, the field is interpolated
+ * trilinearly within the grid, and it is computed exactly outside. Since the
+ * grid is immutable, it is shared between all fluxmeters (and threads) using
+ * the geomagnet.
+ */
+struct mulder_geomagnet * mulder_geomagnet_create_grid(
+    const char * model,
+    int day,
+    int month,
+    int year,
+    struct mulder_position min,
+    struct mulder_position max,
+    const int shape[3]
+);
+
 void mulder_geomagnet_destroy(struct mulder_geomagnet ** geomagnet);
 
 struct mulder_enu mulder_geomagnet_field(
@@ -177,6 +267,16 @@ struct mulder_reference {
         double elevation,
         double kinetic_energy
     );
+
+    /* Vectorized flux, over contiguous arrays (optional, might be NULL) */
+    void (*flux_v)(
+        struct mulder_reference * reference,
+        int size,
+        const double * height,
+        const double * elevation,
+        const double * kinetic_energy,
+        struct mulder_flux * flux
+    );
 };
 
 struct mulder_reference * mulder_reference_create(const char * model);
@@ -194,6 +294,17 @@ struct mulder_prng {
     );
 
     double (*uniform01)(struct mulder_prng * prng); /* Mandatory */
+
+    /* Optional bulk generation (might be NULL) */
+    void (*uniform01_v)(struct mulder_prng * prng, int n, double * values);
+
+    /* Optional substreams selection (might be NULL). The null substream
+     * refers to the main stream, which is resumed where it was left.
+     */
+    void (*set_substream)(
+        struct mulder_prng * prng,
+        unsigned long substream
+    );
 };
 
 
@@ -214,6 +325,30 @@ enum mulder_mode {
 };
 
 
+/* Fluxmeter statistics (optional instrumentation) */
+struct mulder_stats {
+    /* Counters */
+    long transports;       /* calls to pumas_context_transport */
+    long steps;            /* Turtle stepper steps */
+    long geomagnet_misses; /* geomagnet cache misses (field evaluations) */
+    long stepper_updates;  /* rebuilds of Turtle steppers */
+    long pruned;           /* events rejected by the energy pre-pass */
+
+    /* Failed events, by reason */
+    long failed_energy;    /* bad kinetic energy */
+    long failed_transport; /* Pumas error */
+    long failed_limit;     /* energy limit reached, or unexpected event */
+    long failed_location;  /* unexpected final location */
+    long failed_stopping;  /* null stopping power */
+
+    /* Cumulative wall time per phase, in s */
+    double time_underground; /* backward transport through layers */
+    double time_opensky;     /* forward transport to the reference height */
+    double time_reference;   /* reference flux evaluations */
+    double time_geometry;    /* ray tracing (grammage and intersections) */
+};
+
+
 /* Muon flux calculator (semi-opaque structure) */
 struct mulder_fluxmeter {
     /* Initial settings (non mutable) */
@@ -224,6 +359,32 @@ struct mulder_fluxmeter {
     enum mulder_mode mode;
     struct mulder_prng * prng;
     struct mulder_reference * reference;
+
+    /* If true, for MULDER_ANY fluxes with a geomagnet, the underground leg
+     * (i.e. up to the atmosphere) is transported once for both charges. This
+     * assumes that there is no magnetic field in topography layers.
+     */
+    int share_underground;
+
+    /* If true, in continuous mode, the underground leg is transported along a
+     * straight line using tabulated CSDA ranges, instead of stepping with
+     * Pumas. This applies to the atmosphere as well, except with a geomagnet
+     * or with a custom atmosphere.
+     */
+    int use_ranges;
+
+    /* If true, underground events are first traced along a straight line, in
+     * order to bound their energy at the surface using range tables. Events
+     * whose minimal energy exceeds the reference energy_max are rejected
+     * without Pumas stepping (null flux). This applies to the continuous and
+     * mixed modes only.
+     */
+    int use_pruning;
+
+    /* Instrumentation counters (disabled if NULL). Note that counters are not
+     * thread safe. Thus, concurrent sessions should use distinct counters.
+     */
+    struct mulder_stats * stats;
 };
 
 struct mulder_fluxmeter * mulder_fluxmeter_create(
@@ -233,6 +394,61 @@ struct mulder_fluxmeter * mulder_fluxmeter_create(
 
 void mulder_fluxmeter_destroy(struct mulder_fluxmeter ** fluxmeter);
 
+/* Built-in PRNGs of fluxmeters.
+ *
+ * The Philox PRNG is counter based (Philox4x32-10, Salmon et al., SC'11). The
+ * seed is used as key. Thus, distinct seeds (e.g. per node) result in
+ * independent streams. In addition, each stream is split in 2^64 substreams.
+ * Vectorized (multithreaded) functions use one substream per block of entries.
+ * Therefore, randomised results do not depend on the number of threads or on
+ * the scheduling.
+ *
+ * The selected PRNG is set as follows, e.g.
+ *   fluxmeter->prng = mulder_fluxmeter_prng(fluxmeter, MULDER_PHILOX);
+ */
+enum mulder_prng_type {
+    MULDER_MERSENNE_TWISTER = 0, /* Pumas default PRNG */
+    MULDER_PHILOX
+};
+
+struct mulder_prng * mulder_fluxmeter_prng(
+    struct mulder_fluxmeter * fluxmeter,
+    enum mulder_prng_type type
+);
+
+/* Fluxmeter session, e.g. for multithreaded computations.
+ *
+ * A session shares the immutable data of its parent fluxmeter, i.e. physics
+ * tables and geometry, but it has its own transport context, steppers and
+ * caches. Thus, sessions are lightweight. They can be used concurrently, e.g.
+ * one per thread, with the usual fluxmeter functions. Mutable properties are
+ * copied from the parent at creation. Note that a user supplied PRNG is shared
+ * with the session.
+ *
+ * Sessions are destroyed with mulder_fluxmeter_destroy. Note also that physics
+ * tables are shared between all fluxmeters created from the same file.
+ */
+struct mulder_fluxmeter * mulder_fluxmeter_session_create(
+    struct mulder_fluxmeter * fluxmeter
+);
+
+/* Get a persistent session of a fluxmeter, by index.
+ *
+ * Sessions are created on first use, and then reused, their mutable
+ * properties being synchronised with the parent's ones. They are owned by the
+ * parent fluxmeter, and destroyed with it. Thus, steady state computations do
+ * not allocate sessions. Note that this function is not thread safe.
+ */
+struct mulder_fluxmeter * mulder_fluxmeter_session_get(
+    struct mulder_fluxmeter * fluxmeter,
+    int index
+);
+
+/* Check if the fluxmeter PRNG is a built-in one, i.e. owned per session
+ * (returns 1), or a user one shared by all sessions (returns 0).
+ */
+int mulder_fluxmeter_prng_owned(const struct mulder_fluxmeter * fluxmeter);
+
 
 /* Observation state */
 struct mulder_state {
@@ -256,6 +472,136 @@ struct mulder_flux mulder_fluxmeter_flux(
 );
 
 
+/* Muon flux estimate, over several Monte Carlo events */
+struct mulder_estimate {
+    struct mulder_flux flux; /* mean flux */
+    double variance;         /* variance of the mean flux value */
+    long events;             /* number of transported events */
+};
+
+/* Estimate the muon flux for a given observation state.
+ *
+ * In randomised modes (MULDER_MIXED and MULDER_DISCRETE), backward transports
+ * are repeated until the relative error on the mean flux is below precision,
+ * or until max_events is reached. A null precision runs max_events. If
+ * antithetic is true, events are drawn by pairs, the second event of a pair
+ * using antithetic random deviates (i.e. 1 - u). In continuous mode, a single
+ * event is transported.
+ */
+struct mulder_estimate mulder_fluxmeter_estimate(
+    struct mulder_fluxmeter * fluxmeter,
+    struct mulder_state state,
+    double precision,
+    long max_events,
+    int antithetic
+);
+
+
+/* Observation states, as a Structure of Arrays (SoA), e.g. numpy columns.
+ *
+ * Each column has its own stride, in bytes, given in the order of columns
+ * below. A null stride broadcasts a single value over all states. The pid
+ * and weight columns might be NULL, in which case MULDER_ANY and a unit
+ * weight are assumed.
+ */
+struct mulder_states {
+    int * pid;
+    double * latitude;
+    double * longitude;
+    double * height;
+    double * azimuth;
+    double * elevation;
+    double * energy;
+    double * weight;
+    int strides[8];
+};
+
+/* Batched muon flux computation.
+ *
+ * The result is identical to successive mulder_fluxmeter_flux calls, up to
+ * rounding errors on coordinates conversions. But, per-call settings are
+ * checked once per batch.
+ */
+void mulder_fluxmeter_flux_batch(
+    struct mulder_fluxmeter * fluxmeter,
+    int size,
+    const struct mulder_states * states,
+    struct mulder_flux * flux
+);
+
+/* Batched transport, of events per input state (see above). The output
+ * columns must span over events * size states.
+ */
+void mulder_fluxmeter_transport_batch(
+    struct mulder_fluxmeter * fluxmeter,
+    int events,
+    int size,
+    const struct mulder_states * in,
+    struct mulder_states * out
+);
+
+
+/* Sampling of generated state variables (see mulder/generators.py) */
+enum mulder_sampling {
+    MULDER_FIXED = 0,   /* value = min */
+    MULDER_UNIFORM,     /* uniform over (min, max) */
+    MULDER_LOG_UNIFORM, /* log-uniform over (min, max) */
+    MULDER_SIN_UNIFORM  /* sine-uniform over (min, max), in deg */
+};
+
+struct mulder_sampler {
+    enum mulder_sampling sampling;
+    double min;
+    double max;
+};
+
+/* Monte Carlo generator of observation states, at a fixed position */
+struct mulder_generator {
+    enum mulder_pid pid;
+    struct mulder_position position;
+    struct mulder_sampler azimuth;
+    struct mulder_sampler elevation;
+    struct mulder_sampler energy;
+};
+
+/* Generated variables, e.g. for histograms */
+enum mulder_variable {
+    MULDER_AZIMUTH = 0,
+    MULDER_ELEVATION,
+    MULDER_ENERGY
+};
+
+/* Reduction of Monte Carlo events (i.e. weighted flux values) */
+struct mulder_tally {
+    long events;
+    double sum;       /* sum of flux values */
+    double sum2;      /* sum of squared flux values */
+    double asymmetry; /* sum of flux values times charge asymmetries */
+
+    /* Optional histogram (disabled if bins is null). Bins are equiprobable
+     * w.r.t. the sampling of the histogrammed variable, e.g. log-spaced for a
+     * log-uniform energy.
+     */
+    enum mulder_variable variable;
+    int bins;
+    double * values;  /* sum of flux values, per bin */
+    double * squares; /* sum of squared flux values, per bin */
+};
+
+/* Generate, transport and tally events, using the fluxmeter PRNG.
+ *
+ * Events are processed by blocks. Thus, memory usage does not depend on the
+ * number of events. Tallies are accumulated, i.e. they must be initialised by
+ * the caller.
+ */
+void mulder_fluxmeter_generate(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_generator * generator,
+    long events,
+    struct mulder_tally * tally
+);
+
+
 /* Monte Carlo interface */
 struct mulder_flux mulder_state_flux( /* sample reference flux */
     struct mulder_state state,
@@ -292,6 +638,107 @@ int mulder_fluxmeter_whereami(
     struct mulder_position position
 );
 
+/* Trace a bundle of rays from a common position, e.g. the pixels of a
+ * camera image. Directions are given over a (height, width) image, in row
+ * major order. If grammage is not NULL, the total grammage along each ray is
+ * computed. If flux is not NULL, the flux at the given kinetic energy is
+ * computed as well. Rays are traced by tiles of neighbouring pixels, for
+ * coherent stepping. This applies to grammages only, since fluxes are
+ * identical to mulder_fluxmeter_flux ones (which reset steppers per event).
+ */
+void mulder_fluxmeter_image(
+    struct mulder_fluxmeter * fluxmeter,
+    struct mulder_position position,
+    int width,
+    int height,
+    const struct mulder_direction * direction,
+    double energy,
+    double * grammage,
+    struct mulder_flux * flux
+);
+
+
+/* Regular axis, e.g. for sampling tabulated fluxes */
+struct mulder_axis {
+    int size; /* number of nodes */
+    double min;
+    double max;
+};
+
+/* Tabulated muon flux at a fixed observation position.
+ *
+ * Fluxes are tabulated over (azimuth, elevation, kinetic energy) nodes, and
+ * interpolated in between. Angular axes might be irregular, while energy
+ * nodes are regularly spaced in log scale.
+ */
+struct mulder_fluxmap {
+    const struct mulder_position position;
+    const int n_azimuth;
+    const int n_elevation;
+    const int n_energy;
+    const double * const azimuth;   /* azimuth nodes, in deg */
+    const double * const elevation; /* elevation nodes, in deg */
+    const double energy_min;
+    const double energy_max;
+};
+
+/* Create a flux map for the given position.
+ *
+ * If tolerance is strictly positive, angular axes are adaptively refined
+ * where the relative variation of the grammage, between adjacent nodes,
+ * exceeds tolerance, up to max_nodes per axis. Fluxes are not computed. See
+ * mulder_fluxmap_tabulate.
+ */
+struct mulder_fluxmap * mulder_fluxmap_create(
+    struct mulder_fluxmeter * fluxmeter,
+    struct mulder_position position,
+    struct mulder_axis azimuth,
+    struct mulder_axis elevation,
+    struct mulder_axis energy,
+    double tolerance,
+    int max_nodes
+);
+
+/* Compute fluxes over map nodes [start, stop), in row major order (energy
+ * varying the fastest). The range must be within the map, otherwise nothing
+ * is computed. Tabulation stops on the first error (e.g. a Pumas one),
+ * leaving the remaining nodes unchanged. MULDER_FAILURE is then returned.
+ */
+enum mulder_return mulder_fluxmap_tabulate(
+    struct mulder_fluxmap * fluxmap,
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop
+);
+
+/* Load a (memory mapped) flux map from a file */
+struct mulder_fluxmap * mulder_fluxmap_load(const char * path);
+
+/* Dump a flux map to a file */
+enum mulder_return mulder_fluxmap_dump(
+    const struct mulder_fluxmap * fluxmap,
+    const char * path
+);
+
+void mulder_fluxmap_destroy(struct mulder_fluxmap ** fluxmap);
+
+/* Interpolated flux (null outside of the map) */
+struct mulder_flux mulder_fluxmap_flux(
+    const struct mulder_fluxmap * fluxmap,
+    struct mulder_direction direction,
+    double kinetic_energy
+);
+
+/* Interpolated fluxes, over contiguous arrays */
+void mulder_fluxmap_flux_batch(
+    const struct mulder_fluxmap * fluxmap,
+    int size,
+    const double * azimuth,
+    const double * elevation,
+    const double * kinetic_energy,
+    struct mulder_flux * flux
+);
+
 
 #ifdef __cplusplus
 extern }
@@ -1,9 +1,13 @@
 /* C standard library */
 #include <float.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* POSIX threads */
+#include <pthread.h>
+
 /* Custom APIs */
 #include "mulder.h"
 #include "pumas.h"
@@ -11,22 +15,30 @@
 #include "wrapper.h"
 
 
-/* Data relative to the last captured error */
-static struct {
+/* Data relative to the last captured error (per thread). Errors of worker
+ * threads are forwarded to the calling thread (see run_threaded).
+ */
+static __thread struct {
         enum mulder_return rc;
         int size;
         char * msg;
 } last_error = {MULDER_SUCCESS, 0, NULL};
 
 
-/* Capture error messages */
+/* Capture error messages. The buffer is allocated by chunks, and kept
+ * between errors.
+ */
+#define ERROR_CHUNK_SIZE 256
+
 static void capture_error(const char * message)
 {
         last_error.rc = MULDER_FAILURE;
         const int n = strlen(message) + 1;
         if (n > last_error.size) {
-                last_error.msg = realloc(last_error.msg, n);
-                last_error.size = n;
+                const int size = ((n + ERROR_CHUNK_SIZE - 1) /
+                    ERROR_CHUNK_SIZE) * ERROR_CHUNK_SIZE;
+                last_error.msg = realloc(last_error.msg, size);
+                last_error.size = size;
         }
         memcpy(last_error.msg, message, n);
 }
@@ -68,34 +80,52 @@ void mulder_error_clear(void)
 }
 
 
-/* Catch interrupts */
+/* Catch interrupts.
+ *
+ * The handler is process wide, while vectorized functions might run
+ * concurrently (e.g. from distinct Python threads). Thus, the handler is
+ * installed by the first caller and restored by the last one. Note that an
+ * interrupt then stops all running computations.
+ */
 typedef void (*sighandler_t)(int);
 
 static struct {
-        int signum;
+        volatile sig_atomic_t signum;
         sighandler_t handler;
+        int references;
 } sig_context = { .signum = 0 };
 
 
+static pthread_mutex_t sig_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
 static void catch_signal(int signum);
 
 
 static void set_signal(void)
 {
-        sig_context.signum = 0;
-        /* Redirect default signal handler */
-        sig_context.handler = signal(SIGINT, &catch_signal);
+        pthread_mutex_lock(&sig_mutex);
+        if (sig_context.references++ == 0) {
+                sig_context.signum = 0;
+                /* Redirect default signal handler */
+                sig_context.handler = signal(SIGINT, &catch_signal);
+        }
+        pthread_mutex_unlock(&sig_mutex);
 }
 
 
 static void clear_signal(void)
 {
-        sig_context.signum = 0;
-        if (sig_context.handler != NULL) {
-                /* Restore default signal handler */
-                signal(SIGINT, sig_context.handler);
-                sig_context.handler = NULL;
+        pthread_mutex_lock(&sig_mutex);
+        if (--sig_context.references == 0) {
+                sig_context.signum = 0;
+                if (sig_context.handler != NULL) {
+                        /* Restore default signal handler */
+                        signal(SIGINT, sig_context.handler);
+                        sig_context.handler = NULL;
+                }
         }
+        pthread_mutex_unlock(&sig_mutex);
 }
 
 
@@ -111,7 +141,259 @@ static void catch_signal(int signum)
 }
 
 
-/* Vectorized topography height */
+/* Multithreaded execution of vectorized fluxmeter functions
+ *
+ * Entries are processed by blocks, which are dispatched dynamically between
+ * workers. The calling thread acts as worker 0, using the provided fluxmeter,
+ * while other workers use sessions of the latter. Sessions are seeded from the
+ * parent PRNG if the transport is randomised, or if random is true (e.g. for
+ * generating states). In this case, threads are only used with a built-in
+ * PRNG, which is owned per session.
+ *
+ * If the PRNG supports substreams, entries are rather processed by fixed size
+ * blocks, each using its own substream. Thus, randomised results do not depend
+ * on the number of threads.
+ */
+typedef void range_function_t(
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args
+);
+
+struct pool {
+        range_function_t * run;
+        void * args;
+        int size;
+        int block;
+        int next;
+        int substreams;
+        unsigned long substream;
+        /* First error of worker threads (if any) */
+        volatile int failed;
+        char * error;
+        pthread_mutex_t mutex;
+};
+
+#define SUBSTREAM_BLOCK_SIZE 64
+
+struct worker {
+        struct pool * pool;
+        struct mulder_fluxmeter * fluxmeter;
+        struct mulder_stats stats;
+        pthread_t thread;
+        int started;
+};
+
+
+/* Merge instrumentation counters of a session */
+static void merge_stats(struct mulder_stats * dst,
+    const struct mulder_stats * src)
+{
+        dst->transports += src->transports;
+        dst->steps += src->steps;
+        dst->geomagnet_misses += src->geomagnet_misses;
+        dst->stepper_updates += src->stepper_updates;
+        dst->pruned += src->pruned;
+        dst->failed_energy += src->failed_energy;
+        dst->failed_transport += src->failed_transport;
+        dst->failed_limit += src->failed_limit;
+        dst->failed_location += src->failed_location;
+        dst->failed_stopping += src->failed_stopping;
+        dst->time_underground += src->time_underground;
+        dst->time_opensky += src->time_opensky;
+        dst->time_reference += src->time_reference;
+        dst->time_geometry += src->time_geometry;
+}
+
+
+/* Pool of the current thread (if any), for propagating failures */
+static __thread struct pool * current_pool = NULL;
+
+static int is_interrupted(void)
+{
+        return (last_error.rc == MULDER_FAILURE) ||
+            (sig_context.signum != 0) ||
+            ((current_pool != NULL) && current_pool->failed);
+}
+
+
+static void * run_worker(void * arg)
+{
+        struct worker * worker = arg;
+        struct pool * pool = worker->pool;
+        current_pool = pool;
+        while (!is_interrupted()) {
+                const int start = __sync_fetch_and_add(
+                    &pool->next, pool->block);
+                if (start >= pool->size) break;
+                const int stop = (start + pool->block < pool->size) ?
+                    start + pool->block : pool->size;
+                if (pool->substreams) {
+                        /* Sessions own their PRNG (see run_threaded) */
+                        struct mulder_prng * prng = worker->fluxmeter->prng;
+                        prng->set_substream(prng,
+                            pool->substream + start / pool->block + 1);
+                }
+                pool->run(worker->fluxmeter, start, stop, pool->args);
+        }
+        if (pool->substreams) {
+                /* Resume the main stream */
+                struct mulder_prng * prng = worker->fluxmeter->prng;
+                prng->set_substream(prng, 0);
+        }
+        if (last_error.rc == MULDER_FAILURE) {
+                /* Notify other workers */
+                pool->failed = 1;
+        }
+        current_pool = NULL;
+        return NULL;
+}
+
+
+/* Run a worker thread, forwarding its error (if any) to the pool */
+static void * run_session(void * arg)
+{
+        struct worker * worker = arg;
+        struct pool * pool = worker->pool;
+        run_worker(arg);
+        if (last_error.rc == MULDER_FAILURE) {
+                pthread_mutex_lock(&pool->mutex);
+                if (pool->error == NULL) {
+                        pool->error = last_error.msg;
+                        last_error.msg = NULL;
+                }
+                pthread_mutex_unlock(&pool->mutex);
+        }
+        mulder_error_clear();
+        return NULL;
+}
+
+
+static void run_threaded(
+    struct mulder_fluxmeter * fluxmeter,
+    int threads,
+    int size,
+    range_function_t * run,
+    void * args,
+    int random)
+{
+        struct mulder_prng * prng = fluxmeter->prng;
+        const int use_prng = random || (fluxmeter->mode != MULDER_CONTINUOUS);
+
+        if (threads > size) threads = size;
+        if (threads < 1) threads = 1;
+
+        /* Randomised computations require a PRNG per session, i.e. a built-in
+         * one. A user PRNG is shared by all sessions, thus it is used by the
+         * calling thread only, without substreams.
+         */
+        const int owned = mulder_fluxmeter_prng_owned(fluxmeter);
+        if (use_prng && !owned) threads = 1;
+
+        /* Create sessions, before starting any worker thread. Failures are
+         * silently ignored, since the calling thread would process any
+         * remaining entries.
+         */
+        struct worker workers[threads];
+        int i;
+        for (i = 1; i < threads; i++) {
+                struct worker * worker = workers + i;
+                worker->fluxmeter = mulder_fluxmeter_session_get(
+                    fluxmeter, i - 1);
+                if (worker->fluxmeter == NULL) {
+                        mulder_error_clear();
+                        threads = i;
+                        break;
+                }
+        }
+
+        const int substreams = use_prng && owned &&
+            (prng->set_substream != NULL);
+
+        if ((threads == 1) && !substreams) {
+                run(fluxmeter, 0, size, args);
+                return;
+        }
+
+        struct pool pool = {
+                .run = run,
+                .args = args,
+                .size = size,
+                .block = size / (8 * threads),
+                .next = 0,
+                .substreams = substreams,
+                .failed = 0,
+                .error = NULL
+        };
+        pthread_mutex_init(&pool.mutex, NULL);
+        if (substreams) {
+                /* Substreams are offset randomly, using the main stream */
+                pool.block = SUBSTREAM_BLOCK_SIZE;
+                pool.substream = (unsigned long)(
+                    prng->uniform01(prng) * 9007199254740992.);
+        } else if (pool.block < 1) pool.block = 1;
+        else if (pool.block > 256) pool.block = 256;
+
+        /* Configure sessions */
+        workers[0].pool = &pool;
+        workers[0].fluxmeter = fluxmeter;
+        workers[0].started = 0;
+        for (i = 1; i < threads; i++) {
+                struct worker * worker = workers + i;
+                worker->pool = &pool;
+                worker->started = 0;
+                if (fluxmeter->stats != NULL) {
+                        /* Sessions use their own counters */
+                        memset(&worker->stats, 0x0, sizeof worker->stats);
+                        worker->fluxmeter->stats = &worker->stats;
+                }
+                if (use_prng && !substreams &&
+                    (worker->fluxmeter->prng->set_seed != NULL)) {
+                        /* Seed sessions from the parent stream, for
+                         * reproducibility
+                         */
+                        const unsigned long seed = (unsigned long)(
+                            prng->uniform01(prng) * 4294967295.);
+                        worker->fluxmeter->prng->set_seed(
+                            worker->fluxmeter->prng, &seed);
+                }
+        }
+
+        /* Start workers (failures are silently ignored, see above) */
+        for (i = 1; i < threads; i++) {
+                struct worker * worker = workers + i;
+                worker->started = (pthread_create(&worker->thread, NULL,
+                    &run_session, worker) == 0);
+        }
+
+        run_worker(workers);
+
+        for (i = 1; i < threads; i++) {
+                struct worker * worker = workers + i;
+                if (worker->started) {
+                        pthread_join(worker->thread, NULL);
+                }
+                if (fluxmeter->stats != NULL) {
+                        merge_stats(fluxmeter->stats, &worker->stats);
+                        worker->fluxmeter->stats = NULL;
+                }
+        }
+
+        /* Forward workers errors to the calling thread */
+        if (pool.error != NULL) {
+                if (last_error.rc != MULDER_FAILURE) {
+                        capture_error(pool.error);
+                }
+                free(pool.error);
+        }
+        pthread_mutex_destroy(&pool.mutex);
+}
+
+
+/* Vectorized topography height, using batches of map locations */
+#define LAYER_BLOCK_SIZE 65536
+
 void mulder_layer_height_v(
     const struct mulder_layer * layer,
     int size,
@@ -120,15 +402,22 @@ void mulder_layer_height_v(
     double * height)
 {
         set_signal();
-        for (; size > 0; size--, height++) {
-                *height = mulder_layer_height(
+        while (size > 0) {
+                const int n = (size > LAYER_BLOCK_SIZE) ?
+                    LAYER_BLOCK_SIZE : size;
+                mulder_layer_height_batch(
                     layer,
-                    *projection
+                    n,
+                    stride,
+                    projection,
+                    height
                 );
                 if (sig_context.signum != 0) {
                         goto exit;
                 }
-                projection = (void *)projection + stride;
+                size -= n;
+                height += n;
+                projection = (void *)projection + n * stride;
         }
 exit:
         clear_signal();
@@ -144,15 +433,61 @@ void mulder_layer_gradient_v(
     struct mulder_projection * gradient)
 {
         set_signal();
-        for (; size > 0; size--, gradient++) {
-                *gradient = mulder_layer_gradient(
+        while (size > 0) {
+                const int n = (size > LAYER_BLOCK_SIZE) ?
+                    LAYER_BLOCK_SIZE : size;
+                mulder_layer_gradient_batch(
                     layer,
-                    *projection
+                    n,
+                    stride,
+                    projection,
+                    gradient
+                );
+                if (sig_context.signum != 0) {
+                        goto exit;
+                }
+                size -= n;
+                gradient += n;
+                projection = (void *)projection + n * stride;
+        }
+exit:
+        clear_signal();
+}
+
+
+/* Topography height over a regular grid (by blocks of rows) */
+void mulder_layer_height_grid_v(
+    const struct mulder_layer * layer,
+    int nx,
+    int ny,
+    double xmin,
+    double xmax,
+    double ymin,
+    double ymax,
+    double * height)
+{
+        if ((nx <= 0) || (ny <= 0)) return;
+        const double dy = (ny > 1) ? (ymax - ymin) / (ny - 1) : 0.;
+        int rows = LAYER_BLOCK_SIZE / nx;
+        if (rows < 1) rows = 1;
+
+        set_signal();
+        int iy;
+        for (iy = 0; iy < ny; iy += rows) {
+                const int n = (ny - iy > rows) ? rows : ny - iy;
+                mulder_layer_height_grid(
+                    layer,
+                    nx,
+                    n,
+                    xmin,
+                    xmax,
+                    ymin + iy * dy,
+                    ymin + (iy + n - 1) * dy,
+                    height + (size_t)iy * nx
                 );
                 if (sig_context.signum != 0) {
                         goto exit;
                 }
-                projection = (void *)projection + stride;
         }
 exit:
         clear_signal();
@@ -253,32 +588,113 @@ exit:
 
 
 /* Vectorized flux computation */
+struct flux_args {
+        int stride;
+        const struct mulder_state * state;
+        struct mulder_flux * flux;
+};
+
+static void flux_range(
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args)
+{
+        struct flux_args * a = args;
+        const struct mulder_state * state =
+            (void *)a->state + start * a->stride;
+        struct mulder_flux * flux = a->flux + start;
+        int i;
+        for (i = start; i < stop; i++, flux++) {
+                *flux = mulder_fluxmeter_flux(
+                    fluxmeter,
+                    *state
+                );
+                if (is_interrupted()) {
+                        return;
+                }
+                state = (void *)state + a->stride;
+        }
+}
+
 enum mulder_return mulder_fluxmeter_flux_v(
     struct mulder_fluxmeter * fluxmeter,
     int size,
     int stride,
     const struct mulder_state * state,
-    struct mulder_flux * flux)
+    struct mulder_flux * flux,
+    int threads)
 {
         set_signal();
         last_error.rc = MULDER_SUCCESS;
-        for (; size > 0; size--, flux++) {
-                *flux = mulder_fluxmeter_flux(
+        struct flux_args args = {stride, state, flux};
+        run_threaded(fluxmeter, threads, size, &flux_range, &args, 0);
+        clear_signal();
+        return last_error.rc;
+}
+
+
+/* Vectorized flux estimates */
+struct estimate_args {
+        int stride;
+        const struct mulder_state * state;
+        double precision;
+        long max_events;
+        int antithetic;
+        struct mulder_estimate * estimate;
+};
+
+static void estimate_range(
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args)
+{
+        struct estimate_args * a = args;
+        const struct mulder_state * state =
+            (void *)a->state + start * a->stride;
+        struct mulder_estimate * estimate = a->estimate + start;
+        int i;
+        for (i = start; i < stop; i++, estimate++) {
+                *estimate = mulder_fluxmeter_estimate(
                     fluxmeter,
-                    *state
+                    *state,
+                    a->precision,
+                    a->max_events,
+                    a->antithetic
                 );
-                if ((last_error.rc == MULDER_FAILURE) ||
-                    (sig_context.signum != 0)) {
-                        goto exit;
+                if (is_interrupted()) {
+                        return;
                 }
-                state = (void *)state + stride;
+                state = (void *)state + a->stride;
         }
-exit:
+}
+
+enum mulder_return mulder_fluxmeter_estimate_v(
+    struct mulder_fluxmeter * fluxmeter,
+    int size,
+    int stride,
+    const struct mulder_state * state,
+    double precision,
+    long max_events,
+    int antithetic,
+    struct mulder_estimate * estimate,
+    int threads)
+{
+        set_signal();
+        last_error.rc = MULDER_SUCCESS;
+        struct estimate_args args = {
+            stride, state, precision, max_events, antithetic, estimate
+        };
+        run_threaded(fluxmeter, threads, size, &estimate_range, &args, 0);
         clear_signal();
         return last_error.rc;
 }
 
 
+/* Size of data blocks for batched reference flux computations */
+#define FLUX_BLOCK_SIZE 256
+
 /* Vectorized reference flux */
 void mulder_reference_flux_v(
     struct mulder_reference * reference,
@@ -290,6 +706,32 @@ void mulder_reference_flux_v(
     struct mulder_flux * flux)
 {
         set_signal();
+        if (reference->flux_v != NULL) {
+                /* Use the batched kernel, over contiguous blocks of data */
+                double h[FLUX_BLOCK_SIZE], e[FLUX_BLOCK_SIZE],
+                    k[FLUX_BLOCK_SIZE];
+                while (size > 0) {
+                        const int n = (size < FLUX_BLOCK_SIZE) ?
+                            size : FLUX_BLOCK_SIZE;
+                        int i;
+                        for (i = 0; i < n; i++) {
+                                h[i] = *height;
+                                e[i] = *elevation;
+                                k[i] = *energy;
+                                height = (void *)height + strides[0];
+                                elevation = (void *)elevation + strides[1];
+                                energy = (void *)energy + strides[2];
+                        }
+                        reference->flux_v(reference, n, h, e, k, flux);
+                        if (sig_context.signum != 0) {
+                                goto exit;
+                        }
+                        size -= n;
+                        flux += n;
+                }
+                goto exit;
+        }
+
         for (; size > 0; size--, flux++) {
                 *flux = reference->flux(
                     reference,
@@ -309,6 +751,78 @@ exit:
 }
 
 
+/* Tabulation of a flux map */
+struct fluxmap_args {
+        struct mulder_fluxmap * fluxmap;
+};
+
+static void fluxmap_range(
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args)
+{
+        struct fluxmap_args * a = args;
+        int i;
+        for (i = start; i < stop; i++) {
+                if ((mulder_fluxmap_tabulate(a->fluxmap, fluxmeter, i, i + 1)
+                    != MULDER_SUCCESS) || is_interrupted()) {
+                        return;
+                }
+        }
+}
+
+enum mulder_return mulder_fluxmap_tabulate_v(
+    struct mulder_fluxmap * fluxmap,
+    struct mulder_fluxmeter * fluxmeter,
+    int threads)
+{
+        set_signal();
+        last_error.rc = MULDER_SUCCESS;
+        struct fluxmap_args args = {fluxmap};
+        const int size = fluxmap->n_azimuth * fluxmap->n_elevation *
+            fluxmap->n_energy;
+        run_threaded(fluxmeter, threads, size, &fluxmap_range, &args, 0);
+        clear_signal();
+        return last_error.rc;
+}
+
+
+/* Vectorized flux map */
+void mulder_fluxmap_flux_v(
+    const struct mulder_fluxmap * fluxmap,
+    int size,
+    int strides[3],
+    const double * azimuth,
+    const double * elevation,
+    const double * energy,
+    struct mulder_flux * flux)
+{
+        set_signal();
+        double a[FLUX_BLOCK_SIZE], e[FLUX_BLOCK_SIZE], k[FLUX_BLOCK_SIZE];
+        while (size > 0) {
+                const int n = (size < FLUX_BLOCK_SIZE) ?
+                    size : FLUX_BLOCK_SIZE;
+                int i;
+                for (i = 0; i < n; i++) {
+                        a[i] = *azimuth;
+                        e[i] = *elevation;
+                        k[i] = *energy;
+                        azimuth = (void *)azimuth + strides[0];
+                        elevation = (void *)elevation + strides[1];
+                        energy = (void *)energy + strides[2];
+                }
+                mulder_fluxmap_flux_batch(fluxmap, n, a, e, k, flux);
+                if (sig_context.signum != 0) {
+                        break;
+                }
+                size -= n;
+                flux += n;
+        }
+        clear_signal();
+}
+
+
 /* Vectorized state flux */
 void mulder_state_flux_v(
     struct mulder_reference * reference,
@@ -318,6 +832,44 @@ void mulder_state_flux_v(
     struct mulder_flux * flux)
 {
         set_signal();
+        if (reference->flux_v != NULL) {
+                /* Use the batched kernel, over contiguous blocks of data */
+                double h[FLUX_BLOCK_SIZE], e[FLUX_BLOCK_SIZE],
+                    k[FLUX_BLOCK_SIZE];
+                while (size > 0) {
+                        const int n = (size < FLUX_BLOCK_SIZE) ?
+                            size : FLUX_BLOCK_SIZE;
+                        const struct mulder_state * s = state;
+                        int i;
+                        for (i = 0; i < n; i++) {
+                                h[i] = s->position.height;
+                                e[i] = s->direction.elevation;
+                                k[i] = s->energy;
+                                s = (void *)s + stride;
+                        }
+                        reference->flux_v(reference, n, h, e, k, flux);
+
+                        /* Apply charge and weight (as mulder_state_flux) */
+                        for (i = 0; i < n; i++, flux++) {
+                                if (state->pid != MULDER_ANY) {
+                                        const double charge =
+                                            (state->pid == MULDER_MUON) ?
+                                            -1. : 1.;
+                                        flux->value *= 0.5 * (1. +
+                                            charge * flux->asymmetry);
+                                        flux->asymmetry = charge;
+                                }
+                                flux->value *= state->weight;
+                                state = (void *)state + stride;
+                        }
+                        if (sig_context.signum != 0) {
+                                goto exit;
+                        }
+                        size -= n;
+                }
+                goto exit;
+        }
+
         for (; size > 0; size--, flux++) {
                 *flux = mulder_state_flux(
                     *state,
@@ -334,93 +886,404 @@ exit:
 
 
 /* Vectorized transport */
+struct transport_args {
+        int events;
+        int stride;
+        const struct mulder_state * in;
+        struct mulder_state * out;
+};
+
+static void transport_range(
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args)
+{
+        struct transport_args * a = args;
+        const struct mulder_state * in = (void *)a->in + start * a->stride;
+        struct mulder_state * out = a->out + start * a->events;
+        int i;
+        for (i = start; i < stop; i++) {
+                int j;
+                for (j = 0; j < a->events; j++, out++) {
+                        *out = mulder_fluxmeter_transport(
+                            fluxmeter,
+                            *in
+                        );
+                        if (is_interrupted()) {
+                                return;
+                        }
+                }
+                in = (void *)in + a->stride;
+        }
+}
+
 enum mulder_return mulder_fluxmeter_transport_v(
     struct mulder_fluxmeter * fluxmeter,
     int events,
     int size,
     int stride,
     const struct mulder_state * in,
-    struct mulder_state * out)
+    struct mulder_state * out,
+    int threads)
 {
         set_signal();
         last_error.rc = MULDER_SUCCESS;
-        for (; size > 0; size--) {
-                int i;
-                for (i = 0; i < events; i++, out++) {
-                        *out = mulder_fluxmeter_transport(
-                            fluxmeter,
-                            *in
-                        );
-                        if ((last_error.rc == MULDER_FAILURE) ||
-                            (sig_context.signum != 0)) {
-                                goto exit;
-                        }
+        struct transport_args args = {events, stride, in, out};
+        run_threaded(fluxmeter, threads, size, &transport_range, &args,
+            0);
+        clear_signal();
+        return last_error.rc;
+}
+
+
+/* Batched computations over columns of states. Blocks of states are
+ * dispatched to mulder batch functions, checking for interrupts in between.
+ */
+#define COLUMNS_BLOCK_SIZE 32
+
+static struct mulder_states columns_offset(
+    const struct mulder_states * states,
+    int offset)
+{
+        struct mulder_states result = *states;
+        const int * s = states->strides;
+        if (result.pid != NULL) {
+                result.pid = (void *)result.pid + offset * s[0];
+        }
+        result.latitude = (void *)result.latitude + offset * s[1];
+        result.longitude = (void *)result.longitude + offset * s[2];
+        result.height = (void *)result.height + offset * s[3];
+        result.azimuth = (void *)result.azimuth + offset * s[4];
+        result.elevation = (void *)result.elevation + offset * s[5];
+        result.energy = (void *)result.energy + offset * s[6];
+        if (result.weight != NULL) {
+                result.weight = (void *)result.weight + offset * s[7];
+        }
+        return result;
+}
+
+struct flux_columns_args {
+        const struct mulder_states * states;
+        struct mulder_flux * flux;
+};
+
+static void flux_columns_range(
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args)
+{
+        struct flux_columns_args * a = args;
+        int i;
+        for (i = start; i < stop; i += COLUMNS_BLOCK_SIZE) {
+                const int n = (stop - i < COLUMNS_BLOCK_SIZE) ?
+                    stop - i : COLUMNS_BLOCK_SIZE;
+                const struct mulder_states states =
+                    columns_offset(a->states, i);
+                mulder_fluxmeter_flux_batch(
+                    fluxmeter, n, &states, a->flux + i);
+                if (is_interrupted()) {
+                        return;
                 }
-                in = (void *)in + stride;
         }
-exit:
+}
+
+enum mulder_return mulder_fluxmeter_flux_columns(
+    struct mulder_fluxmeter * fluxmeter,
+    int size,
+    const struct mulder_states * states,
+    struct mulder_flux * flux,
+    int threads)
+{
+        set_signal();
+        last_error.rc = MULDER_SUCCESS;
+        struct flux_columns_args args = {states, flux};
+        run_threaded(fluxmeter, threads, size, &flux_columns_range, &args,
+            0);
         clear_signal();
         return last_error.rc;
 }
 
+struct transport_columns_args {
+        int events;
+        const struct mulder_states * in;
+        struct mulder_states * out;
+};
 
-/* Vectorized intersections */
-enum mulder_return mulder_fluxmeter_intersect_v(
+static void transport_columns_range(
     struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args)
+{
+        struct transport_columns_args * a = args;
+        int i;
+        for (i = start; i < stop; i += COLUMNS_BLOCK_SIZE) {
+                const int n = (stop - i < COLUMNS_BLOCK_SIZE) ?
+                    stop - i : COLUMNS_BLOCK_SIZE;
+                const struct mulder_states in = columns_offset(a->in, i);
+                struct mulder_states out =
+                    columns_offset(a->out, i * a->events);
+                mulder_fluxmeter_transport_batch(
+                    fluxmeter, a->events, n, &in, &out);
+                if (is_interrupted()) {
+                        return;
+                }
+        }
+}
+
+enum mulder_return mulder_fluxmeter_transport_columns(
+    struct mulder_fluxmeter * fluxmeter,
+    int events,
     int size,
-    int strides[2],
-    const struct mulder_position * position,
-    const struct mulder_direction * direction,
-    struct mulder_intersection * intersection)
+    const struct mulder_states * in,
+    struct mulder_states * out,
+    int threads)
+{
+        set_signal();
+        last_error.rc = MULDER_SUCCESS;
+        struct transport_columns_args args = {events, in, out};
+        run_threaded(fluxmeter, threads, size, &transport_columns_range,
+            &args, 0);
+        clear_signal();
+        return last_error.rc;
+}
+
+
+/* Multithreaded generation of Monte Carlo events */
+struct generate_args {
+        const struct mulder_generator * generator;
+        struct mulder_tally * tally;
+        pthread_mutex_t mutex;
+};
+
+static void generate_range(
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args)
+{
+        /* Tally events locally, then merge */
+        struct generate_args * a = args;
+        struct mulder_tally tally = {
+                .variable = a->tally->variable,
+                .bins = a->tally->bins
+        };
+        if (tally.bins > 0) {
+                tally.values = calloc(2 * tally.bins, sizeof *tally.values);
+                if (tally.values == NULL) {
+                        capture_error("could not allocate memory");
+                        return;
+                }
+                tally.squares = tally.values + tally.bins;
+        }
+
+        mulder_fluxmeter_generate(
+            fluxmeter, a->generator, stop - start, &tally);
+
+        pthread_mutex_lock(&a->mutex);
+        a->tally->events += tally.events;
+        a->tally->sum += tally.sum;
+        a->tally->sum2 += tally.sum2;
+        a->tally->asymmetry += tally.asymmetry;
+        int i;
+        for (i = 0; i < tally.bins; i++) {
+                a->tally->values[i] += tally.values[i];
+                a->tally->squares[i] += tally.squares[i];
+        }
+        pthread_mutex_unlock(&a->mutex);
+        free(tally.values);
+}
+
+enum mulder_return mulder_fluxmeter_generate_v(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_generator * generator,
+    int events,
+    struct mulder_tally * tally,
+    int threads)
 {
         set_signal();
         last_error.rc = MULDER_SUCCESS;
-        for (; size > 0; size--, intersection++) {
+        struct generate_args args = {
+            generator, tally, PTHREAD_MUTEX_INITIALIZER};
+        run_threaded(fluxmeter, threads, events, &generate_range, &args, 1);
+        clear_signal();
+        return last_error.rc;
+}
+
+
+/* Vectorized intersections */
+struct intersect_args {
+        int strides[2];
+        const struct mulder_position * position;
+        const struct mulder_direction * direction;
+        struct mulder_intersection * intersection;
+};
+
+static void intersect_range(
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args)
+{
+        struct intersect_args * a = args;
+        const struct mulder_position * position =
+            (void *)a->position + start * a->strides[0];
+        const struct mulder_direction * direction =
+            (void *)a->direction + start * a->strides[1];
+        struct mulder_intersection * intersection = a->intersection + start;
+        int i;
+        for (i = start; i < stop; i++, intersection++) {
                 *intersection = mulder_fluxmeter_intersect(
                     fluxmeter,
                     *position,
                     *direction
                 );
-                if ((last_error.rc == MULDER_FAILURE) ||
-                    (sig_context.signum != 0)) {
-                        goto exit;
+                if (is_interrupted()) {
+                        return;
                 }
-                position = (void *)position + strides[0];
-                direction = (void *)direction + strides[1];
+                position = (void *)position + a->strides[0];
+                direction = (void *)direction + a->strides[1];
         }
-exit:
-        clear_signal();
-        return last_error.rc;
 }
 
-
-/* Vectorized grammage */
-enum mulder_return mulder_fluxmeter_grammage_v(
+enum mulder_return mulder_fluxmeter_intersect_v(
     struct mulder_fluxmeter * fluxmeter,
     int size,
     int strides[2],
     const struct mulder_position * position,
     const struct mulder_direction * direction,
-    double * grammage)
+    struct mulder_intersection * intersection,
+    int threads)
 {
         set_signal();
         last_error.rc = MULDER_SUCCESS;
+        struct intersect_args args = {
+            {strides[0], strides[1]}, position, direction, intersection};
+        run_threaded(fluxmeter, threads, size, &intersect_range, &args,
+            0);
+        clear_signal();
+        return last_error.rc;
+}
+
+
+/* Vectorized grammage */
+struct grammage_args {
+        int strides[2];
+        const struct mulder_position * position;
+        const struct mulder_direction * direction;
+        double * grammage;
+};
+
+static void grammage_range(
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args)
+{
+        struct grammage_args * a = args;
         const int m = fluxmeter->geometry->size + 1;
-        for (; size > 0; size--, grammage+= m) {
+        const struct mulder_position * position =
+            (void *)a->position + start * a->strides[0];
+        const struct mulder_direction * direction =
+            (void *)a->direction + start * a->strides[1];
+        double * grammage = a->grammage + start * m;
+        int i;
+        for (i = start; i < stop; i++, grammage += m) {
                 mulder_fluxmeter_grammage(
                     fluxmeter,
                     *position,
                     *direction,
                     grammage
                 );
-                if ((last_error.rc == MULDER_FAILURE) ||
-                    (sig_context.signum != 0)) {
-                        goto exit;
+                if (is_interrupted()) {
+                        return;
                 }
-                position = (void *)position + strides[0];
-                direction = (void *)direction + strides[1];
+                position = (void *)position + a->strides[0];
+                direction = (void *)direction + a->strides[1];
         }
-exit:
+}
+
+enum mulder_return mulder_fluxmeter_grammage_v(
+    struct mulder_fluxmeter * fluxmeter,
+    int size,
+    int strides[2],
+    const struct mulder_position * position,
+    const struct mulder_direction * direction,
+    double * grammage,
+    int threads)
+{
+        set_signal();
+        last_error.rc = MULDER_SUCCESS;
+        struct grammage_args args = {
+            {strides[0], strides[1]}, position, direction, grammage};
+        run_threaded(fluxmeter, threads, size, &grammage_range, &args,
+            0);
+        clear_signal();
+        return last_error.rc;
+}
+
+
+/* Camera images, threaded over bands of rows */
+#define IMAGE_BAND 8
+
+struct image_args {
+        struct mulder_position position;
+        int width;
+        int height;
+        const struct mulder_direction * direction;
+        double energy;
+        double * grammage;
+        struct mulder_flux * flux;
+};
+
+static void image_range(
+    struct mulder_fluxmeter * fluxmeter,
+    int start,
+    int stop,
+    void * args)
+{
+        struct image_args * a = args;
+        int band;
+        for (band = start; band < stop; band++) {
+                const int row = band * IMAGE_BAND;
+                const int rows = (row + IMAGE_BAND < a->height) ?
+                    IMAGE_BAND : a->height - row;
+                const size_t offset = (size_t)row * a->width;
+                mulder_fluxmeter_image(
+                    fluxmeter,
+                    a->position,
+                    a->width,
+                    rows,
+                    a->direction + offset,
+                    a->energy,
+                    (a->grammage == NULL) ? NULL : a->grammage + offset,
+                    (a->flux == NULL) ? NULL : a->flux + offset
+                );
+                if (is_interrupted()) {
+                        return;
+                }
+        }
+}
+
+enum mulder_return mulder_fluxmeter_image_v(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_position * position,
+    int width,
+    int height,
+    const struct mulder_direction * direction,
+    double energy,
+    double * grammage,
+    struct mulder_flux * flux,
+    int threads)
+{
+        set_signal();
+        last_error.rc = MULDER_SUCCESS;
+        struct image_args args = {
+            *position, width, height, direction, energy, grammage, flux};
+        const int bands = (height + IMAGE_BAND - 1) / IMAGE_BAND;
+        run_threaded(fluxmeter, threads, bands, &image_range, &args, 0);
         clear_signal();
         return last_error.rc;
 }
@@ -459,6 +1322,10 @@ void mulder_prng_uniform01_v(
     int n,
     double * values)
 {
+        if (prng->uniform01_v != NULL) {
+                prng->uniform01_v(prng, n, values);
+                return;
+        }
         for (; n > 0; n--, values++) {
                 *values = prng->uniform01(prng);
         }
@@ -476,65 +1343,344 @@ enum mulder_return mulder_map_create(
     double ymax,
     const double * z)
 {
-        struct turtle_map_info info = {
-                .nx = nx,
-                .ny = ny,
-                .x = {xmin, xmax},
-                .y = {ymin, ymax}
-        };
-
         const int n = nx * ny;
         int i;
-        double zmin = DBL_MAX, zmax = -DBL_MIN;
+        double zmin = DBL_MAX, zmax = -DBL_MAX;
         const double * zi;
         for (i = 0, zi = z; i < n; i++, zi++) {
                 if (*zi < zmin) zmin = *zi;
                 if (*zi > zmax) zmax = *zi;
         }
-        info.z[0] = zmin;
-        info.z[1] = zmax;
+        if (zmax <= zmin) zmax = zmin + 1.;
 
-        last_error.rc = MULDER_SUCCESS;
-        struct turtle_map * map;
-        turtle_map_create(&map, &info, projection);
-        if (last_error.rc == MULDER_FAILURE) {
+        struct mulder_map_writer * writer = mulder_map_begin(path,
+            projection, nx, ny, xmin, xmax, ymin, ymax, zmin, zmax, 0);
+        if (writer == NULL) {
                 return MULDER_FAILURE;
         }
+        enum mulder_return rc = mulder_map_write_rows(writer, ny, z);
+        if (rc == MULDER_SUCCESS) {
+                rc = mulder_map_finalize(writer);
+        }
+        mulder_map_writer_destroy(&writer);
 
-        for (i = 0, zi = z; i < ny; i++) {
-                int j;
-                for (j = 0; j < nx; j++, zi++) {
-                        turtle_map_fill(map, j, i, *zi);
+        return rc;
+}
+
+
+/* Streaming map writer.
+ *
+ * Without tiling, rows are filled directly if the z-range is known.
+ * Otherwise, they are spooled to a temporary file, and filled when the map
+ * is finalized. With tiling, rows are buffered over a band of tiles, and
+ * each tile is dumped (with its own z-range) once the band is complete.
+ * Adjacent tiles share their edge nodes.
+ */
+struct mulder_map_writer {
+        char * path;
+        char * projection;
+        struct turtle_map_info info;
+        int tile;
+        int row; /* next row to be written */
+        double zmin;
+        double zmax;
+        struct turtle_map * map; /* untiled map */
+        FILE * spool; /* untiled rows, if the z-range is unknown */
+        int band_start; /* first row of the current band (tiled) */
+        double * band;
+};
+
+
+static enum mulder_return writer_error(const char * format, const char * arg)
+{
+        const int n = strlen(format) + strlen(arg) + 1;
+        char msg[n];
+        sprintf(msg, format, arg);
+        mulder_error(msg);
+        return MULDER_FAILURE;
+}
+
+
+static char * writer_strdup(const char * s)
+{
+        if (s == NULL) return NULL;
+        const size_t n = strlen(s) + 1;
+        char * d = malloc(n);
+        if (d != NULL) memcpy(d, s, n);
+        return d;
+}
+
+
+struct mulder_map_writer * mulder_map_begin(
+    const char * path,
+    const char * projection,
+    int nx,
+    int ny,
+    double xmin,
+    double xmax,
+    double ymin,
+    double ymax,
+    double zmin,
+    double zmax,
+    int tile)
+{
+        last_error.rc = MULDER_SUCCESS;
+        if ((nx < 2) || (ny < 2)) {
+                mulder_error("bad map shape");
+                return NULL;
+        }
+        struct mulder_map_writer * writer = calloc(1, sizeof *writer);
+        if (writer == NULL) goto memory_error;
+        writer->path = writer_strdup(path);
+        writer->projection = writer_strdup(projection);
+        if ((writer->path == NULL) ||
+            ((projection != NULL) && (writer->projection == NULL))) {
+                goto memory_error;
+        }
+        writer->info.nx = nx;
+        writer->info.ny = ny;
+        writer->info.x[0] = xmin;
+        writer->info.x[1] = xmax;
+        writer->info.y[0] = ymin;
+        writer->info.y[1] = ymax;
+        writer->tile = ((tile > 0) && ((tile < nx - 1) || (tile < ny - 1))) ?
+            tile : 0;
+        writer->zmin = DBL_MAX;
+        writer->zmax = -DBL_MAX;
+
+        if (writer->tile > 0) {
+                writer->band = malloc((size_t)(writer->tile + 1) * nx *
+                    sizeof *writer->band);
+                if (writer->band == NULL) goto memory_error;
+        } else if (zmax > zmin) {
+                writer->info.z[0] = zmin;
+                writer->info.z[1] = zmax;
+                turtle_map_create(&writer->map, &writer->info, projection);
+                if (last_error.rc == MULDER_FAILURE) {
+                        mulder_map_writer_destroy(&writer);
+                        return NULL;
+                }
+        } else {
+                writer->spool = tmpfile();
+                if (writer->spool == NULL) {
+                        mulder_map_writer_destroy(&writer);
+                        mulder_error("could not create temporary file");
+                        return NULL;
+                }
+        }
+        return writer;
+
+memory_error:
+        mulder_map_writer_destroy(&writer);
+        mulder_error("could not allocate memory");
+        return NULL;
+}
+
+
+/* Dump the tiles of the current band (tiled mode) */
+static enum mulder_return writer_flush_band(
+    struct mulder_map_writer * writer,
+    int rows)
+{
+        const int nx = writer->info.nx, tile = writer->tile;
+        const double dx = (writer->info.x[1] - writer->info.x[0]) /
+            (nx - 1);
+        const double dy = (writer->info.y[1] - writer->info.y[0]) /
+            (writer->info.ny - 1);
+        const int iy = writer->band_start / tile;
+        int ix;
+        for (ix = 0; ix * tile < nx - 1; ix++) {
+                const int x0 = ix * tile;
+                const int cols = (x0 + tile < nx) ? tile + 1 : nx - x0;
+                double zmin = DBL_MAX, zmax = -DBL_MAX;
+                int i, j;
+                for (i = 0; i < rows; i++) {
+                        const double * z = writer->band + (size_t)i * nx + x0;
+                        for (j = 0; j < cols; j++) {
+                                if (z[j] < zmin) zmin = z[j];
+                                if (z[j] > zmax) zmax = z[j];
+                        }
+                }
+                if (zmax <= zmin) zmax = zmin + 1.;
+                struct turtle_map_info info = {
+                        .nx = cols,
+                        .ny = rows,
+                        .x = {
+                            writer->info.x[0] + x0 * dx,
+                            writer->info.x[0] + (x0 + cols - 1) * dx
+                        },
+                        .y = {
+                            writer->info.y[0] + writer->band_start * dy,
+                            writer->info.y[0] +
+                                (writer->band_start + rows - 1) * dy
+                        },
+                        .z = {zmin, zmax}
+                };
+                struct turtle_map * map;
+                turtle_map_create(&map, &info, writer->projection);
+                if (last_error.rc == MULDER_FAILURE) return MULDER_FAILURE;
+                for (i = 0; i < rows; i++) {
+                        const double * z = writer->band + (size_t)i * nx + x0;
+                        for (j = 0; j < cols; j++) {
+                                turtle_map_fill(map, j, i, z[j]);
+                        }
+                }
+                const char format[] = "%s/%04d_%04d.png";
+                char path[strlen(writer->path) + sizeof(format) + 16];
+                sprintf(path, format, writer->path, iy, ix);
+                turtle_map_dump(map, path);
+                turtle_map_destroy(&map);
+                if (last_error.rc == MULDER_FAILURE) return MULDER_FAILURE;
+        }
+
+        /* The last row is shared with the next band */
+        memcpy(writer->band, writer->band + (size_t)(rows - 1) * nx,
+            nx * sizeof *writer->band);
+        writer->band_start += rows - 1;
+        return MULDER_SUCCESS;
+}
+
+
+enum mulder_return mulder_map_write_rows(
+    struct mulder_map_writer * writer,
+    int rows,
+    const double * z)
+{
+        last_error.rc = MULDER_SUCCESS;
+        const int nx = writer->info.nx, ny = writer->info.ny;
+        if ((rows < 0) || (writer->row + rows > ny)) {
+                return writer_error("too many rows (%s)", writer->path);
+        }
+
+        int i, j;
+        for (i = 0; i < rows; i++, writer->row++, z += nx) {
+                if (writer->tile > 0) {
+                        const int k = writer->row - writer->band_start;
+                        memcpy(writer->band + (size_t)k * nx, z,
+                            nx * sizeof *z);
+                        if ((k == writer->tile) || (writer->row == ny - 1)) {
+                                if (writer_flush_band(writer, k + 1) !=
+                                    MULDER_SUCCESS) {
+                                        return MULDER_FAILURE;
+                                }
+                        }
+                } else if (writer->map != NULL) {
+                        for (j = 0; j < nx; j++) {
+                                turtle_map_fill(writer->map, j, writer->row,
+                                    z[j]);
+                        }
+                } else {
+                        for (j = 0; j < nx; j++) {
+                                if (z[j] < writer->zmin) writer->zmin = z[j];
+                                if (z[j] > writer->zmax) writer->zmax = z[j];
+                        }
+                        if (fwrite(z, sizeof *z, nx, writer->spool) !=
+                            (size_t)nx) {
+                                return writer_error(
+                                    "could not spool rows (%s)",
+                                    writer->path);
+                        }
                 }
+                if (last_error.rc == MULDER_FAILURE) return MULDER_FAILURE;
         }
+        return MULDER_SUCCESS;
+}
+
 
-        turtle_map_dump(map, path);
-        turtle_map_destroy(&map);
+enum mulder_return mulder_map_finalize(struct mulder_map_writer * writer)
+{
+        last_error.rc = MULDER_SUCCESS;
+        const int nx = writer->info.nx, ny = writer->info.ny;
+        if (writer->row != ny) {
+                return writer_error("missing rows (%s)", writer->path);
+        }
+        if (writer->tile > 0) return MULDER_SUCCESS;
+
+        if (writer->spool != NULL) {
+                /* Second pass over spooled rows */
+                writer->info.z[0] = writer->zmin;
+                writer->info.z[1] = writer->zmax;
+                turtle_map_create(&writer->map, &writer->info,
+                    writer->projection);
+                if (last_error.rc == MULDER_FAILURE) return MULDER_FAILURE;
+                rewind(writer->spool);
+                double * z = malloc(nx * sizeof *z);
+                if (z == NULL) {
+                        mulder_error("could not allocate memory");
+                        return MULDER_FAILURE;
+                }
+                int i, j;
+                for (i = 0; i < ny; i++) {
+                        if (fread(z, sizeof *z, nx, writer->spool) !=
+                            (size_t)nx) {
+                                free(z);
+                                return writer_error(
+                                    "could not read spooled rows (%s)",
+                                    writer->path);
+                        }
+                        for (j = 0; j < nx; j++) {
+                                turtle_map_fill(writer->map, j, i, z[j]);
+                        }
+                }
+                free(z);
+                fclose(writer->spool);
+                writer->spool = NULL;
+        }
 
+        turtle_map_dump(writer->map, writer->path);
+        turtle_map_destroy(&writer->map);
         return last_error.rc;
 }
 
 
+void mulder_map_writer_destroy(struct mulder_map_writer ** writer)
+{
+        if ((writer == NULL) || (*writer == NULL)) return;
+        struct mulder_map_writer * w = *writer;
+        turtle_map_destroy(&w->map);
+        if (w->spool != NULL) fclose(w->spool);
+        free(w->band);
+        free(w->path);
+        free(w->projection);
+        free(w);
+        *writer = NULL;
+}
+
+
 /* Generate physics tables for Pumas */
 enum mulder_return mulder_generate_physics(
     const char * path,
     const char * destination,
-    const char * dump)
+    const char * dump,
+    int tabulated)
 {
-        /* Pre-compute physics data */
+        /* Pre-compute physics data, or load tabulated ones */
         struct pumas_physics * physics;
         {
-                enum pumas_return tmp = pumas_physics_create(
-                    &physics,
-                    PUMAS_PARTICLE_MUON,
-                    path,
-                    destination,
-                    NULL
-                );
+                enum pumas_return tmp = tabulated ?
+                    pumas_physics_create_tabulated(
+                        &physics,
+                        PUMAS_PARTICLE_MUON,
+                        path,
+                        destination,
+                        NULL
+                    ) :
+                    pumas_physics_create(
+                        &physics,
+                        PUMAS_PARTICLE_MUON,
+                        path,
+                        destination,
+                        NULL
+                    );
                 if (tmp != PUMAS_RETURN_SUCCESS) {
                         return MULDER_FAILURE;
                 }
         }
+        if (dump == NULL) {
+                /* Only energy loss tables are requested */
+                pumas_physics_destroy(&physics);
+                return MULDER_SUCCESS;
+        }
 
         /* Dump the result */
         enum mulder_return rc = MULDER_FAILURE;
@@ -549,7 +1695,7 @@ enum mulder_return mulder_generate_physics(
                 const char format[] = "could not open %s";
                 const int n = sizeof(format) + strlen(dump);
                 char msg[n];
-                sprintf(msg, dump);
+                sprintf(msg, format, dump);
                 mulder_error(msg);
         }
         pumas_physics_destroy(&physics);
@@ -2,12 +2,6 @@
 const char * mulder_error_get(void);
 void mulder_error_clear(void);
 
-/* Return codes */
-enum mulder_return {
-    MULDER_SUCCESS = 0,
-    MULDER_FAILURE
-};
-
 /* Vectorized layer height */
 void mulder_layer_height_v(
     const struct mulder_layer * layer,
@@ -26,6 +20,18 @@ void mulder_layer_gradient_v(
     struct mulder_projection * gradient
 );
 
+/* Topography height over a regular grid */
+void mulder_layer_height_grid_v(
+    const struct mulder_layer * layer,
+    int nx,
+    int ny,
+    double xmin,
+    double xmax,
+    double ymin,
+    double ymax,
+    double * height
+);
+
 /* Vectorized geographic coordinates */
 void mulder_layer_position_v(
     const struct mulder_layer * layer,
@@ -62,13 +68,27 @@ void mulder_geometry_atmosphere_v(
     struct mulder_atmosphere * atmosphere
 );
 
-/* Vectorized flux computation */
+/* Vectorized flux computation (over `threads` concurrent workers) */
 enum mulder_return mulder_fluxmeter_flux_v(
     struct mulder_fluxmeter * fluxmeter,
     int size,
     int stride,
     const struct mulder_state * state,
-    struct mulder_flux * flux
+    struct mulder_flux * flux,
+    int threads
+);
+
+/* Vectorized flux estimates (over `threads` concurrent workers) */
+enum mulder_return mulder_fluxmeter_estimate_v(
+    struct mulder_fluxmeter * fluxmeter,
+    int size,
+    int stride,
+    const struct mulder_state * state,
+    double precision,
+    long max_events,
+    int antithetic,
+    struct mulder_estimate * estimate,
+    int threads
 );
 
 /* Vectorized reference flux */
@@ -82,6 +102,24 @@ void mulder_reference_flux_v(
     struct mulder_flux * flux
 );
 
+/* Flux map tabulation (over `threads` concurrent workers) */
+enum mulder_return mulder_fluxmap_tabulate_v(
+    struct mulder_fluxmap * fluxmap,
+    struct mulder_fluxmeter * fluxmeter,
+    int threads
+);
+
+/* Vectorized flux map */
+void mulder_fluxmap_flux_v(
+    const struct mulder_fluxmap * fluxmap,
+    int size,
+    int strides[3],
+    const double * azimuth,
+    const double * elevation,
+    const double * energy,
+    struct mulder_flux * flux
+);
+
 /* Vectorized state flux */
 void mulder_state_flux_v(
     struct mulder_reference * reference,
@@ -91,34 +129,80 @@ void mulder_state_flux_v(
     struct mulder_flux * flux
 );
 
-/* Vectorized transport */
+/* Vectorized transport (over `threads` concurrent workers) */
 enum mulder_return mulder_fluxmeter_transport_v(
     struct mulder_fluxmeter * fluxmeter,
     int events,
     int size,
     int stride,
     const struct mulder_state * in,
-    struct mulder_state * out
+    struct mulder_state * out,
+    int threads
+);
+
+/* Batched flux, using columns of states (over `threads` concurrent workers) */
+enum mulder_return mulder_fluxmeter_flux_columns(
+    struct mulder_fluxmeter * fluxmeter,
+    int size,
+    const struct mulder_states * states,
+    struct mulder_flux * flux,
+    int threads
+);
+
+/* Batched transport, using columns of states (over `threads` concurrent
+ * workers)
+ */
+enum mulder_return mulder_fluxmeter_transport_columns(
+    struct mulder_fluxmeter * fluxmeter,
+    int events,
+    int size,
+    const struct mulder_states * in,
+    struct mulder_states * out,
+    int threads
+);
+
+/* Generation of Monte Carlo events (over `threads` concurrent workers) */
+enum mulder_return mulder_fluxmeter_generate_v(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_generator * generator,
+    int events,
+    struct mulder_tally * tally,
+    int threads
 );
 
-/* Vectorized intersections */
+/* Vectorized intersections (over `threads` concurrent workers) */
 enum mulder_return mulder_fluxmeter_intersect_v(
     struct mulder_fluxmeter * fluxmeter,
     int size,
     int strides[2],
     const struct mulder_position * position,
     const struct mulder_direction * direction,
-    struct mulder_intersection * intersection
+    struct mulder_intersection * intersection,
+    int threads
 );
 
-/* Vectorized gramage */
+/* Vectorized gramage (over `threads` concurrent workers) */
 enum mulder_return mulder_fluxmeter_grammage_v(
     struct mulder_fluxmeter * fluxmeter,
     int size,
     int strides[2],
     const struct mulder_position * position,
     const struct mulder_direction * direction,
-    double * grammage
+    double * grammage,
+    int threads
+);
+
+/* Camera image (over `threads` concurrent workers) */
+enum mulder_return mulder_fluxmeter_image_v(
+    struct mulder_fluxmeter * fluxmeter,
+    const struct mulder_position * position,
+    int width,
+    int height,
+    const struct mulder_direction * direction,
+    double energy,
+    double * grammage,
+    struct mulder_flux * flux,
+    int threads
 );
 
 /* Vectorized locator */
@@ -150,9 +234,49 @@ enum mulder_return mulder_map_create(
     const double * z
 );
 
-/* Generate physics tables for Pumas */
+/* Streaming map writer, e.g. for large maps.
+ *
+ * Rows of nx heights are written by chunks, along increasing y. If the
+ * z-range (zmin < zmax) is known in advance, rows are filled directly.
+ * Otherwise, they are spooled to disk. If tile is strictly positive, path is
+ * a directory, where tiles of tile x tile cells are written as separate PNG
+ * maps (named {row}_{column}.png), using the writer's projection. Note that
+ * these are not Turtle stack tiles.
+ */
+struct mulder_map_writer;
+
+struct mulder_map_writer * mulder_map_begin(
+    const char * path,
+    const char * projection,
+    int nx,
+    int ny,
+    double xmin,
+    double xmax,
+    double ymin,
+    double ymax,
+    double zmin,
+    double zmax,
+    int tile
+);
+
+enum mulder_return mulder_map_write_rows(
+    struct mulder_map_writer * writer,
+    int rows,
+    const double * z
+);
+
+enum mulder_return mulder_map_finalize(struct mulder_map_writer * writer);
+
+void mulder_map_writer_destroy(struct mulder_map_writer ** writer);
+
+/* Generate physics tables for Pumas.
+ *
+ * Energy loss tables are written to destination, or loaded from it if
+ * tabulated is true. Physics are then dumped, unless dump is NULL.
+ */
 enum mulder_return mulder_generate_physics(
     const char * path,
     const char * destination,
-    const char * dump
+    const char * dump,
+    int tabulated
 );